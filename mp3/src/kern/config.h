@@ -29,6 +29,7 @@
 #define USER_START_VMA  0xC0000000UL // User programs loaded here
 #define USER_END_VMA    0xD0000000UL // End of user program space
 #define USER_STACK_VMA  USER_END_VMA // starting user stack pointer
+#define USER_STACK_SIZE (8UL*1024*1024) // reserved for the stack below it
 
 #define UART0_IOBASE 0x10000000 // PMA
 #define UART1_IOBASE 0x10000100 // PMA
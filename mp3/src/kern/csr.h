@@ -246,6 +246,11 @@ static inline void csrc_mstatus(intptr_t mask) {
 #define RISCV_SSTATUS_SIE (1UL << 1)
 #define RISCV_SSTATUS_SPIE (1UL << 5)
 #define RISCV_SSTATUS_SPP (1UL << 8)
+#define RISCV_SSTATUS_FS (3UL << 13)
+#define RISCV_SSTATUS_FS_OFF (0UL << 13)
+#define RISCV_SSTATUS_FS_INITIAL (1UL << 13)
+#define RISCV_SSTATUS_FS_CLEAN (2UL << 13)
+#define RISCV_SSTATUS_FS_DIRTY (3UL << 13)
 #define RISCV_SSTATUS_SUM (1UL << 18)
 
 static inline intptr_t csrr_sstatus(void) {
@@ -298,4 +303,13 @@ static inline uintptr_t csrrw_satp(uintptr_t satp_new) {
     return satp_old;
 }
 
+// time
+
+static inline uint64_t csrr_time(void) {
+    uint64_t time_cur;
+
+    asm inline volatile ("rdtime %0" : "=r" (time_cur));
+    return time_cur;
+}
+
 #endif // _CSR_H_
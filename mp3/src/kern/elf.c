@@ -7,6 +7,7 @@
 #include "memory.h"
 #include "config.h"
 #include "string.h"
+#include "lock.h"
 
 #define EI_MAG0     0       // e_ident[] indexes
 #define EI_MAG1     1
@@ -67,6 +68,27 @@ typedef struct {
     uint64_t p_align;   /* Alignment of segment */
 } Elf64_Phdr;
 
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int elf_read_ehdr(struct io_intf * io, Elf64_Ehdr * ehdr);
+static int elf_read_phdr (
+    struct io_intf * io, const Elf64_Ehdr * ehdr, int i, Elf64_Phdr * phdr);
+static uint8_t elf_pte_flags(uint32_t p_flags);
+static int elf_load_megapage(const struct elf_image * img, uintptr_t vma);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Serializes demand reads. Forked processes share the executable's io_intf,
+// so the seek and the read of one page must not interleave with another's.
+
+static struct lock elf_io_lock = {
+    .cond = { .name = "elf_io" },
+    .tid = -1,
+    .handoff = LOCK_HANDOFF
+};
+
 
 /**
  * elf_load - Loads and validates an ELF executable into memory.
@@ -81,9 +103,10 @@ typedef struct {
  * 
  * If all validations pass, the function proceeds to load the ELF file's program
  * headers, ensuring that only PT_LOAD segments within the specified memory range
- * (between 0x80100000 and 0x81000000) are loaded. For each PT_LOAD segment,
+ * (between USER_START_VMA and USER_END_VMA) are loaded. For each PT_LOAD segment,
  * the function allocates memory, reads the segment data, and copies it to the
  * designated virtual memory address. The .BSS section is zero-initialized.
+ * Processes use elf_map instead, which defers the reads to the first access.
  * 
  * Outputs:
  * - Sets *entryptr to the entry point address of the ELF executable if loading is successful.
@@ -100,87 +123,318 @@ int elf_load(struct io_intf *io, void (**entryptr)(void)) {
 
     Elf64_Ehdr ehdr;
 
+    // 1. Read and check the ELF header
+    int result = elf_read_ehdr(io, &ehdr);
+    if (result < 0)
+        return result;
+
+    // 2. Set the address of entry
+    *entryptr = (void (*)(void)) ehdr.e_entry;
+
+    // 3. Loop through the Program header table;
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        Elf64_Phdr phdr;
+
+        // 3.1. Read the Program header
+        result = elf_read_phdr(io, &ehdr, i, &phdr);
+        if (result < 0)
+            return result;
+
+        // 3.2. Elf_loader should only load program header entries of type PT_LOAD;
+        if (phdr.p_type != PT_LOAD) continue;
+
+        // 3.3. Check the range of virtual memory (between USER_START_VMA and USER_END_VMA);
+        if (phdr.p_vaddr < USER_START_VMA || phdr.p_vaddr + phdr.p_memsz > USER_END_VMA) {
+            continue;
+        }
+
+        // 3.4. Allocate and map physical pages for the segment
+        memory_alloc_and_map_range(phdr.p_vaddr, phdr.p_memsz, (PTE_W|PTE_R));
+        
+        // 3.5. Jump to the segment offset and load segment data into memory
+        if (ioseek(io, phdr.p_offset) < 0 || ioread_full(io, (void*)phdr.p_vaddr, phdr.p_filesz) < phdr.p_filesz) {
+            return -ENOTSUP;
+        }
+
+        // 3.6. Initialize the .BSS section to zeros;
+        memset((void*)(phdr.p_vaddr + phdr.p_filesz), 0, phdr.p_memsz - phdr.p_filesz);
+
+        // 3.7. Set appropriate flags for the memory region after loading
+        memory_set_range_flags((const void*)phdr.p_vaddr, phdr.p_memsz,
+            elf_pte_flags(phdr.p_flags));
+    }
+
+    return 0;
+}
+
+
+/**
+ * elf_map - Validates an ELF executable and records its loadable segments.
+ *
+ * Inputs:
+ * io -- Pointer to an I/O interface (struct io_intf*) to read the ELF file.
+ * img -- Image descriptor to fill in.
+ * entryptr -- Pointer to a function pointer where the entry point will be stored.
+ *
+ * Description:
+ * Performs the same checks as elf_load, but nothing is read beyond the headers
+ * and no memory is mapped. The file extent of each PT_LOAD segment is recorded
+ * in /img/, and elf_load_page brings in each page on its first access. The
+ * image takes a reference to /io/, dropped by elf_release.
+ *
+ * Returns:
+ * 0 -- success.
+ * EIO -- the I/O interface is NULL.
+ * ENOTSUP -- error reading a header, or too many segments.
+ * EINVAL -- if the file is not a valid ELF executable or fails validation.
+ */
+int elf_map(struct io_intf *io, struct elf_image *img, void (**entryptr)(void)) {
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    int result;
+
+    if (io == NULL)
+        return -EIO;
+
+    result = elf_read_ehdr(io, &ehdr);
+    if (result < 0)
+        return result;
+
+    img->nseg = 0;
+
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+        result = elf_read_phdr(io, &ehdr, i, &phdr);
+        if (result < 0)
+            return result;
+
+        if (phdr.p_type != PT_LOAD)
+            continue;
+
+        if (phdr.p_vaddr < USER_START_VMA || phdr.p_vaddr + phdr.p_memsz > USER_END_VMA)
+            continue;
+
+        if (phdr.p_memsz < phdr.p_filesz)
+            return -EINVAL;
+
+        if (img->nseg == ELF_MAXSEG)
+            return -ENOTSUP;
+
+        img->seg[img->nseg].vma = phdr.p_vaddr;
+        img->seg[img->nseg].offset = phdr.p_offset;
+        img->seg[img->nseg].filesz = phdr.p_filesz;
+        img->seg[img->nseg].memsz = phdr.p_memsz;
+        img->seg[img->nseg].flags = elf_pte_flags(phdr.p_flags);
+        img->nseg++;
+    }
+
+    img->io = io;
+    ioref(io);
+
+    *entryptr = (void (*)(void)) ehdr.e_entry;
+    return 0;
+}
+
+
+/**
+ * elf_load_page - Maps the page of an image containing an address.
+ *
+ * Inputs:
+ * img -- Image recorded by elf_map.
+ * vma -- Faulting user address.
+ *
+ * Description:
+ * Maps a zeroed page at the page containing /vma/ in the active memory space,
+ * reads in the part of each segment that overlaps the page (usually one) and
+ * gives the page the segment's permissions. Bytes past p_filesz (.bss) are
+ * left zero. The file position of the shared io_intf is preserved. A fault in
+ * a 2 MB aligned region that lies wholly in the .bss part of a segment maps
+ * the whole region with one zeroed megapage instead, when one is available.
+ *
+ * Returns:
+ * 0 -- the page was loaded.
+ * EINVAL -- /vma/ is not part of any segment; nothing was mapped.
+ * EIO -- reading the file failed; the page is mapped but its contents are bad.
+ */
+int elf_load_page(const struct elf_image *img, uintptr_t vma) {
+    const uintptr_t page = vma & ~(uintptr_t)(PAGE_SIZE-1);
+    const struct elf_segment * seg;
+    uintptr_t lo, hi;
+    uint8_t flags = 0;
+    uint64_t savepos;
+    int result = 0;
+    int i;
+
+    for (i = 0; i < img->nseg; i++) {
+        seg = &img->seg[i];
+        if (seg->vma < page + PAGE_SIZE && page < seg->vma + seg->memsz)
+            flags |= seg->flags;
+    }
+
+    if (flags == 0)
+        return -EINVAL;
+
+    if (USER_MEGAPAGES && elf_load_megapage(img, vma))
+        return 0;
+
+    memory_alloc_and_map_page(page, PTE_R | PTE_W); // zero-filled
+
+    lock_acquire(&elf_io_lock);
+
+    if (ioctl(img->io, IOCTL_GETPOS, &savepos) < 0)
+        savepos = 0;
+
+    for (i = 0; i < img->nseg && result == 0; i++) {
+        seg = &img->seg[i];
+        lo = (seg->vma < page) ? page : seg->vma;
+        hi = (seg->vma + seg->filesz < page + PAGE_SIZE) ?
+            seg->vma + seg->filesz : page + PAGE_SIZE;
+        
+        if (hi <= lo)
+            continue;
+
+        if (ioseek(img->io, seg->offset + (lo - seg->vma)) < 0 ||
+            ioread_full(img->io, (void*)lo, hi - lo) < (long)(hi - lo))
+        {
+            result = -EIO;
+        }
+    }
+
+    ioseek(img->io, savepos);
+    lock_release(&elf_io_lock);
+
+    memory_set_page_flags((const void*)page, flags);
+    return result;
+}
+
+
+/**
+ * elf_release - Drops an image's reference to its executable.
+ *
+ * Inputs:
+ * img -- Image recorded by elf_map, or an empty image.
+ */
+void elf_release(struct elf_image *img) {
+    if (img->io != NULL)
+        ioclose(img->io);
+    img->io = NULL;
+    img->nseg = 0;
+}
+
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * elf_read_ehdr - Reads the ELF header and checks it describes a 64-bit,
+ * little-endian RISC-V executable.
+ *
+ * Returns 0 on success, -ENOTSUP if the header cannot be read, or -EINVAL if
+ * the file is not a suitable executable.
+ */
+static int elf_read_ehdr(struct io_intf * io, Elf64_Ehdr * ehdr) {
     // 1. Read the ELF header with io;
-    long read_ELF_result = ioread_full(io, &ehdr, sizeof(Elf64_Ehdr));
+    if (ioseek(io, 0) < 0)
+        return -ENOTSUP;
+
+    long read_ELF_result = ioread_full(io, ehdr, sizeof(Elf64_Ehdr));
     if (read_ELF_result < 0 || read_ELF_result < sizeof(Elf64_Ehdr)) {
         return -ENOTSUP; 
     }
 
     // 2. Check the magic numbers of e_ident, to see whether it is an available ELF file;
-    if (ehdr.e_ident[EI_MAG0] != ELFMAG0 || ehdr.e_ident[EI_MAG1] != ELFMAG1 
-        || ehdr.e_ident[EI_MAG2] != ELFMAG2 || ehdr.e_ident[EI_MAG3] != ELFMAG3) {
+    if (ehdr->e_ident[EI_MAG0] != ELFMAG0 || ehdr->e_ident[EI_MAG1] != ELFMAG1 
+        || ehdr->e_ident[EI_MAG2] != ELFMAG2 || ehdr->e_ident[EI_MAG3] != ELFMAG3) {
         return -EINVAL; 
     }
 
     // 3. Check if the ELF file is 64-bit;
-    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64){
+    if (ehdr->e_ident[EI_CLASS] != ELFCLASS64){
         return -EINVAL;
     }
 
     // 4. Check if the ELF file is RISC-V architecture;
-    if (ehdr.e_machine != EM_RISCV){
+    if (ehdr->e_machine != EM_RISCV){
         return -EINVAL;
     }
     
     // 5. Check if the ELF file is little-endian;
-    if (ehdr.e_ident[EI_DATA] != ELFDATA2LSB){
+    if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB){
         return -EINVAL;
     }
 
     // 6. Check if the ELF file is executable;
-    if (ehdr.e_type != ET_EXEC) {
+    if (ehdr->e_type != ET_EXEC) {
         return -EINVAL; 
     }
 
-    // 7. Set the address of entry
-    *entryptr = (void (*)(void)) ehdr.e_entry;
+    return 0;
+}
 
-    // 8. Set the position to the beginning of Program header table
-    if (ioseek(io, ehdr.e_phoff) < 0){
+/**
+ * elf_read_phdr - Reads program header /i/ of the file.
+ *
+ * Returns 0 on success, or -ENOTSUP if the header cannot be read.
+ */
+static int elf_read_phdr (
+    struct io_intf * io, const Elf64_Ehdr * ehdr, int i, Elf64_Phdr * phdr)
+{
+    long offset = ehdr->e_phoff + i * ehdr->e_phentsize;
+
+    if (ehdr->e_phentsize < sizeof(Elf64_Phdr))
+        return -ENOTSUP;
+
+    // Set the io to current program header
+    if (ioseek(io, offset) < 0){
         return -ENOTSUP;
     }
 
-    // 9. Loop through the Program header table;
-    for (int i = 0; i < ehdr.e_phnum; i++) {
-        Elf64_Phdr phdr;
-        long offset = ehdr.e_phoff + i * ehdr.e_phentsize;
+    // Read the Program header table with io;
+    long read_pro_result = ioread_full(io, phdr, sizeof(Elf64_Phdr));
+    if (read_pro_result < 0 || read_pro_result < sizeof(Elf64_Phdr)) {
+        return -ENOTSUP; 
+    }
 
-        // 9.1 Set the io to current program header
-        if (ioseek(io, offset) < 0){
-            return -ENOTSUP;
-        }
+    return 0;
+}
 
-        // 9.2. Read the Program header table with io;
-        long read_pro_result = ioread_full(io, &phdr, ehdr.e_phentsize);
-        if (read_pro_result < 0 || read_pro_result < ehdr.e_phentsize) {
-            return -ENOTSUP; 
-        }
+/**
+ * elf_pte_flags - Converts segment flags (PF_R, PF_W, PF_X) to the PTE flags
+ * of a user page.
+ */
+static uint8_t elf_pte_flags(uint32_t p_flags) {
+    uint8_t flags = PTE_U | PTE_V;
 
-        // 9.3. Elf_loader should only load program header entries of type PT_LOAD;
-        if (phdr.p_type != PT_LOAD) continue;
+    if (p_flags & PF_R) flags |= PTE_R;
+    if (p_flags & PF_W) flags |= PTE_W;
+    if (p_flags & PF_X) flags |= PTE_X;
+    return flags;
+}
 
-        // 9.4. Check the range of virtual memory (between USER_START_VMA and USER_END_VMA);
-        if (phdr.p_vaddr < USER_START_VMA || phdr.p_vaddr + phdr.p_memsz > USER_END_VMA) {
-            continue;
-        }
+/**
+ * elf_load_megapage - Maps a zeroed megapage for a fault in the .bss part of a
+ * segment, if the 2 MB aligned region containing /vma/ lies wholly in it and
+ * nothing in the region is mapped yet.
+ *
+ * Returns 1 if the megapage was mapped, 0 otherwise.
+ */
+static int elf_load_megapage(const struct elf_image * img, uintptr_t vma) {
+    const uintptr_t mega = vma & ~(uintptr_t)(MEGA_SIZE-1);
+    const struct elf_segment * seg;
+    uintptr_t bss;
 
-        // 9.5. Allocate and map physical pages for the segment
-        memory_alloc_and_map_range(phdr.p_vaddr, phdr.p_memsz, (PTE_W|PTE_R));
-        
-        // 9.6. Jump to the segment offset and load segment data into memory
-        if (ioseek(io, phdr.p_offset) < 0 || ioread_full(io, (void*)phdr.p_vaddr, phdr.p_filesz) < phdr.p_filesz) {
-            return -ENOTSUP;
-        }
+    for (int i = 0; i < img->nseg; i++) {
+        seg = &img->seg[i];
+        bss = (seg->vma + seg->filesz + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1);
 
-        // 9.7. Initialize the .BSS section to zeros;
-        memset((void*)(phdr.p_vaddr + phdr.p_filesz), 0, phdr.p_memsz - phdr.p_filesz);
+        if (mega < bss || seg->vma + seg->memsz < mega + MEGA_SIZE)
+            continue;
+        
+        if (!memory_map_megapage(mega, PTE_R | PTE_W))
+            return 0;
 
-        // 9.8. Set appropriate flags for the memory region after loading
-        int flags = PTE_U | PTE_V;
-        if (phdr.p_flags & PF_R) flags |= PTE_R;
-        if (phdr.p_flags & PF_W) flags |= PTE_W;
-        if (phdr.p_flags & PF_X) flags |= PTE_X;
-        memory_set_range_flags((const void*)phdr.p_vaddr, phdr.p_memsz, flags);
+        memset((void*)mega, 0, MEGA_SIZE);
+        memory_set_range_flags((const void*)mega, MEGA_SIZE, seg->flags);
+        return 1;
     }
 
     return 0;
@@ -6,6 +6,31 @@
 
 #include "io.h"
 #include "error.h"
+#include <stdint.h>
+
+//           ELF_MAXSEG is the maximum number of PT_LOAD segments elf_map records
+
+#ifndef ELF_MAXSEG
+#define ELF_MAXSEG 8
+#endif
+
+//           A loadable segment of an executable mapped by elf_map. Its pages are
+//           read from offset /offset/ of the file on first access; bytes past
+//           /filesz/ up to /memsz/ are zero.
+
+struct elf_segment {
+    uintptr_t vma;      // p_vaddr
+    uint64_t offset;    // p_offset
+    uint64_t filesz;    // p_filesz
+    uint64_t memsz;     // p_memsz
+    uint8_t flags;      // PTE flags of the mapped pages
+};
+
+struct elf_image {
+    struct io_intf * io; // executable, referenced while the image is in use
+    int nseg;
+    struct elf_segment seg[ELF_MAXSEG];
+};
 
 //           arg1: io interface from which to load the elf arg2: pointer to void
 //           (*entry)(struct io_intf *io), which is a function pointer elf_load fills in
@@ -20,6 +45,25 @@
 
 int elf_load(struct io_intf *io, void (**entryptr)(void));
 
+//           int elf_map(struct io_intf *io, struct elf_image *img, void (**entryptr)(void))
+//           Validates an executable like elf_load, but only records its segments in
+//           /img/ without mapping or reading them. Takes a reference to /io/.
+//           Return 0 on success or a negative error code on error.
+
+int elf_map(struct io_intf *io, struct elf_image *img, void (**entryptr)(void));
+
+//           int elf_load_page(const struct elf_image *img, uintptr_t vma)
+//           Maps and reads in the page of /img/ containing /vma/ into the active
+//           memory space. Returns -EINVAL if /vma/ is not in the image, -EIO if
+//           the read failed, and 0 on success.
+
+int elf_load_page(const struct elf_image *img, uintptr_t vma);
+
+//           void elf_release(struct elf_image *img)
+//           Drops the reference to the executable and empties the image.
+
+void elf_release(struct elf_image *img);
+
 //           _ELF_H_
 #endif
 
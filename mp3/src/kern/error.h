@@ -14,5 +14,7 @@
 #define EACCESS     8
 #define EBADFD      9
 #define EMFILE     10
+#define EFAULT     11
+#define ENOMEM     12
 
 #endif // _ERROR_H_
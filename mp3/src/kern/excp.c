@@ -6,6 +6,8 @@
 #include "halt.h"
 #include "memory.h"
 #include "process.h"
+#include "thread.h"
+#include "config.h"
 
 #include <stddef.h>
 
@@ -51,6 +53,32 @@ static const char * const excp_names[] = {
 //
 
 void smode_excp_handler(unsigned int code, struct trap_frame * tfr) {
+    const uintptr_t vma = csrr_stval();
+    uintptr_t fixup;
+
+    // The kernel accesses user buffers through SUM (e.g. copy_to_user). A
+    // store to a page shared copy-on-write by fork, or an access to a page of
+    // the executable not read in yet, faults here and is resolved the same way
+    // as an access from U mode. If the fault cannot be resolved, an
+    // instruction listed in the exception table resumes at its fixup, which
+    // makes the copy fail with -EFAULT; any other access kills the process.
+
+    if ((code == RISCV_SCAUSE_STORE_PAGE_FAULT ||
+         code == RISCV_SCAUSE_LOAD_PAGE_FAULT) &&
+        USER_START_VMA <= vma && vma < USER_END_VMA)
+    {
+        if (memory_handle_page_fault((void*)vma) == 0)
+            return;
+        
+        fixup = memory_exception_fixup(tfr->sepc);
+        if (fixup != 0) {
+            tfr->sepc = fixup;
+            return;
+        }
+
+        process_exit();
+    }
+
 	default_excp_handler(code, tfr);
 }
 
@@ -71,16 +99,25 @@ void umode_excp_handler(unsigned int code, struct trap_frame * tfr) {
         break;
     
     // page fault part
+    case RISCV_SCAUSE_INSTR_PAGE_FAULT:
     case RISCV_SCAUSE_LOAD_PAGE_FAULT:
     case RISCV_SCAUSE_STORE_PAGE_FAULT:
-        memory_handle_page_fault((void*)csrr_stval());
+        if (USER_START_VMA <= csrr_stval() && csrr_stval() < USER_END_VMA) {
+            if (memory_handle_page_fault((void*)csrr_stval()) < 0)
+                process_exit();
+        } else
+            process_exit();
+        break;
+
+    // FP instruction of a thread with FP off (see thread.h)
+    case RISCV_SCAUSE_ILLEGAL_INSTR:
+        if (thread_handle_fp_fault(tfr) < 0)
+            process_exit();
         break;
 
     // exit part
-    case RISCV_SCAUSE_INSTR_PAGE_FAULT:
     case RISCV_SCAUSE_INSTR_ADDR_MISALIGNED:
     case RISCV_SCAUSE_INSTR_ACCESS_FAULT:
-    case RISCV_SCAUSE_ILLEGAL_INSTR:
     case RISCV_SCAUSE_LOAD_ADDR_MISALIGNED:
     case RISCV_SCAUSE_LOAD_ACCESS_FAULT:
     case RISCV_SCAUSE_STORE_ACCESS_FAULT:
@@ -16,6 +16,12 @@
 #define MAX_OPENFILES 32 // Each task can have up to 32 open files
 #define MAX_DENTRIES 63 // the file system can hold up to 63 files
 
+// FS_CACHE_PAGES is the number of data blocks the page cache holds for mapped
+// files. A cached block is evicted only while no process maps it.
+#ifndef FS_CACHE_PAGES
+#define FS_CACHE_PAGES 128
+#endif
+
 
 /* File structures */
 
@@ -74,6 +80,7 @@ extern int fs_getlen(file_t* fd, void* arg);
 extern int fs_getpos(file_t* fd, void* arg);
 extern int fs_setpos(file_t* fd, void* arg);
 extern int fs_getblksz(file_t* fd, void* arg);
+extern int fs_getpage(file_t* fd, void* arg);
 
 //           _FS_H_
 #endif
@@ -1,20 +1,71 @@
-//           heap.h - Memory manager for small allocations
-//           
+//           heap.h - Memory manager for small allocations
+//
 
 #ifndef _HEAP_H_
 #define _HEAP_H_
 
 #include <stddef.h>
 
-//           Initializes the heap memory manager (for small objects).
+//           Compile-time parameters. Building with HEAP_PROFILE=1 makes
+//           kmalloc, kcalloc and krealloc record the caller and size of every
+//           block in a table of HEAP_PROF_SITES call sites, at the cost of a
+//           16-byte header per block. heap_profile_dump prints the
+//           HEAP_PROF_TOP sites with the most live bytes, and
+//           heap_profile_attach registers the "heapprof" device, whose
+//           IOCTL_HEAPPROF hands a snapshot of the table to user programs.
+//           Objects from kmem_cache_create caches are counted by heap_dump
+//           instead.
+
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE 0
+#endif
+
+#ifndef HEAP_PROF_SITES
+#define HEAP_PROF_SITES 128
+#endif
+
+#ifndef HEAP_PROF_TOP
+#define HEAP_PROF_TOP 10
+#endif
+
+//           Initializes the heap memory manager (for small objects).
 
 extern void heap_init(void * start, void * end);
 extern char heap_initialized;
 
+//           kmalloc returns memory aligned to 16 bytes. Requests up to about
+//           half a page come from size-class slab caches, larger ones get
+//           physically contiguous pages of their own (up to 2^BUDDY_MAX_ORDER
+//           pages). kfree returns the memory for reuse; empty slabs go back
+//           to the page allocator. krealloc resizes in place when the slab
+//           object or page run has room (for pages: the following pages are
+//           free), otherwise it moves the data to a new allocation.
+
 extern void * kmalloc(size_t size);
 extern void * kcalloc(size_t n, size_t size);
 extern void * krealloc(void * ptr, size_t size);
 extern void kfree(void * ptr);
 
-//           _HEAP_H_
+//           A kmem_cache allocates objects of one fixed size, for structures
+//           allocated and freed often (threads, processes). Objects must be
+//           returned to the cache they came from, either with
+//           kmem_cache_free or kfree (which tells them from kmalloc
+//           blocks, also in a HEAP_PROFILE build). Caches live forever.
+
+struct kmem_cache;
+
+extern struct kmem_cache * kmem_cache_create(const char * name, size_t size);
+extern void * kmem_cache_alloc(struct kmem_cache * cache);
+extern void kmem_cache_free(struct kmem_cache * cache, void * obj);
+
+//           Prints the object and slab counts of every cache.
+
+extern void heap_dump(void);
+
+#if HEAP_PROFILE
+extern void heap_profile_dump(void);
+extern void heap_profile_attach(void);
+#endif
+
+//           _HEAP_H_
 #endif
@@ -15,6 +15,7 @@
 #include "csr.h"
 #include "plic.h"
 #include "timer.h"
+#include "thread.h"
 
 #include <stddef.h>
 
@@ -52,13 +53,24 @@ void intr_init(void) {
 
     intr_disable(); // should be disabled already
     plic_init();
+    plic_hart_init(0);
 
     csrw_sip(0); // clear all pending interrupts
-    csrw_sie(RISCV_SIE_SEIE); //enable interrupts from plic
+    // enable interrupts from plic, and from other harts (see hart_kick)
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE);
 
     intr_initialized = 1;
 }
 
+void intr_hart_init(void) {
+    trace("%s()", __func__);
+
+    plic_hart_init(running_hart());
+
+    csrw_sip(0);
+    csrw_sie(RISCV_SIE_SEIE | RISCV_SIE_SSIE);
+}
+
 void intr_register_isr (
     int irqno, int prio,
     void (*isr)(int irqno, void * aux),
@@ -88,7 +100,9 @@ void intr_disable_irq(int irqno) {
 
 // void intr_handler(int code, struct trap_frame * tfr)
 // Called from trapasm.s to handle an interrupt. Dispataches to
-// timer_intr_handler and extern_intr_handler.
+// timer_intr_handler and extern_intr_handler. A software interrupt comes from
+// another hart that made a thread ready for us; thread_preempt below deals
+// with it.
 
 void intr_handler(int code, struct trap_frame * tfr) {
     switch (code) {
@@ -99,15 +113,19 @@ void intr_handler(int code, struct trap_frame * tfr) {
     case RISCV_SCAUSE_INTR_EXCODE_SEI:
         extern_intr_handler();
         break;
+    case RISCV_SCAUSE_INTR_EXCODE_SSI:
+        csrc_sip(RISCV_SIP_SSIP);
+        break;
     default:
         panic("unhandled interrupt");
         break;
     }
 
-    // If we were running user mode, yield thread.
+    // Preempt the interrupted thread if its time slice is up. Interrupts are
+    // only taken where they are enabled, so this is as safe in S mode as in U
+    // mode; kernel code that must not be switched out disables preemption.
 
-    if ((tfr->sstatus & RISCV_SSTATUS_SPP) == 0)
-        thread_yield();
+    thread_preempt();
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -23,6 +23,12 @@ extern char intr_initialized;
 
 extern void intr_init(void);
 
+// Enables interrupts from the PLIC and from other harts on a hart other than
+// hart 0 (see thread_start_harts); intr_init does this for hart 0. Any hart
+// may take a device interrupt; the first to claim it handles it.
+
+extern void intr_hart_init(void);
+
 static inline int intr_enable(void);
 static inline int intr_disable(void);
 static inline void intr_restore(int saved);
@@ -58,6 +58,78 @@ struct io_term {
 #define IOCTL_SETPOS        4   // arg is pointer to uint64_t
 #define IOCTL_FLUSH         5   // arg is ignored
 #define IOCTL_GETBLKSZ      6   // arg is pointer to uint32_t
+#define IOCTL_GETPAGE       7   // arg is pointer to struct io_page
+
+// Argument of IOCTL_GETPAGE, which only the kernel may issue (it is used to
+// map files). /pos/ is a page-aligned position in the object. On success,
+// /page/ points to a frame holding the PAGE_SIZE bytes at /pos/, with a
+// reference taken for the caller; bytes past the end of the object are zero.
+
+struct io_page {
+    uint64_t pos;
+    void * page;
+};
+
+#define IOCTL_HEAPPROF      8   // arg is pointer to struct io_heapprof
+
+// Argument of IOCTL_HEAPPROF, issued on the "heapprof" device of a kernel
+// built with HEAP_PROFILE. /cnt/ is the capacity of /buf/ in entries; the
+// kernel copies that many call sites at most into /buf/ and sets /cnt/ to the
+// number copied. Each entry describes one kmalloc call site.
+
+struct heap_prof_entry {
+    uint64_t caller;        // return address of the kmalloc call
+    uint64_t live_cnt;      // blocks allocated and not yet freed
+    uint64_t live_bytes;    // bytes requested by those blocks
+    uint64_t alloc_cnt;     // blocks allocated since boot
+    uint64_t peak_bytes;    // highest live_bytes seen
+};
+
+struct io_heapprof {
+    uint64_t cnt;
+    struct heap_prof_entry * buf;
+};
+
+#define IOCTL_GETRXTIME     9   // arg is pointer to uint64_t
+
+// IOCTL_GETRXTIME is supported by serial ports. It gets the time (the value of
+// the rdtime counter) at which the receive buffer last went from empty to not
+// empty, that is, when the first byte returned by the next read arrived if
+// that read had to wait.
+
+#define IOCTL_LOCKSTAT      10  // arg is pointer to struct io_lockstat
+
+// Argument of IOCTL_LOCKSTAT, issued on the "lockstat" device of a kernel
+// built with LOCK_STATS. /cnt/ is the capacity of /buf/ in entries; the kernel
+// copies that many locks at most into /buf/ and sets /cnt/ to the number
+// copied. Times are in rdtime ticks.
+
+struct lock_stat_entry {
+    char name[24];
+    uint64_t acquired;      // times the lock was taken
+    uint64_t contended;     // times a thread had to wait for it
+    uint64_t wait_ticks;    // total time threads waited for it
+    uint64_t max_hold;      // longest time it was held
+};
+
+struct io_lockstat {
+    uint64_t cnt;
+    struct lock_stat_entry * buf;
+};
+
+#define IOCTL_TIMERSTAT     11  // arg is pointer to struct io_timerstat
+
+// Argument of IOCTL_TIMERSTAT, issued on the "timerstat" device. Gets the
+// number of timer interrupts taken and of scheduler ticks charged by each
+// hart since boot, and the time (rdtime) they were read at. Entries past
+// /nhart/ are zero.
+
+struct io_timerstat {
+    uint64_t time;
+    uint64_t nhart;
+    uint64_t intr_cnt[8];
+    uint64_t tick_cnt[8];
+};
 
 // EXPORTED FUNCTION DECLARATIONS
 //
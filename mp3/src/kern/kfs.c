@@ -19,11 +19,19 @@
 #include "string.h"
 #include "heap.h"
 #include "lock.h"
+#include "memory.h"
 
 /* Global Variables */
 // the array ptr to file_ts
 static file_t openfiles[MAX_OPENFILES]; // an array of open files
-static struct lock openfile_lock; // each open file has a lock related
+// Reads share openfile_lock, while writes and cache fills hold it alone. The
+// block device has a single position, so readers also take fs_blkio_lock
+// around each seek and read; a read of a cached block needs neither. Readers
+// of one file struct (a descriptor inherited across fork) reserve the range
+// they read by advancing file_pos under fs_pos_lock before the I/O.
+static struct rwlock openfile_lock;
+static struct lock fs_blkio_lock;
+static struct lock fs_pos_lock;
 static bootblock_t boot_block; // the bootblock of the filesystem
 static uint32_t N_inodes;
 static uint32_t N_datablks;
@@ -39,6 +47,30 @@ static const struct io_ops fileio_ops = {
 };
 static struct io_intf* fs_blkio = NULL;
 
+// Page cache of file data blocks, used to map files into processes. Data
+// blocks are page sized, so a cached block is a frame that every process
+// mapping it shares. The cache holds one reference to each frame; an entry
+// whose frame has no other reference is not mapped anywhere and may be
+// evicted. Entries are hashed on (inode, block) and protected by
+// openfile_lock: readers may look blocks up, writers may change entries.
+struct fs_cache_entry {
+    struct fs_cache_entry* next; // next entry in the same bucket
+    uint32_t inode_num;
+    uint32_t blkno; // index of the block in the file
+    void* page; // cached frame, NULL if the entry is unused
+};
+
+#define FS_CACHE_BUCKETS 32
+
+static struct fs_cache_entry fs_cache[FS_CACHE_PAGES];
+static struct fs_cache_entry* fs_cache_bucket[FS_CACHE_BUCKETS];
+static uint32_t fs_cache_hand; // next entry considered for eviction
+
+static struct fs_cache_entry* fs_cache_lookup(uint32_t inode_num, uint32_t blkno);
+static struct fs_cache_entry* fs_cache_fill(file_t* fd, uint32_t blkno);
+static struct fs_cache_entry** fs_cache_head(uint32_t inode_num, uint32_t blkno);
+static void fs_read_unreserve(file_t* fd, uint64_t end, uint64_t pos);
+
 char fs_initialized = 0;
 
 /**fs_init
@@ -125,9 +157,10 @@ int fs_mount(struct io_intf * blkio){
         openfiles[i].file_io_intf.refcnt = 0; // mark the reference count as 0
         openfiles[i].flags = 0; // mark as not used
     }
-    // set up the lock
-    char lock_name[15] = "openfile_lock";
-    lock_init(&openfile_lock, lock_name);
+    // set up the locks
+    rwlock_init(&openfile_lock, "openfile_lock");
+    lock_init(&fs_blkio_lock, "fs_blkio_lock");
+    lock_init(&fs_pos_lock, "fs_pos_lock");
 
     // initialization complete, mark as initialized
     fs_initialized = 1;
@@ -279,7 +312,7 @@ long fs_write(struct io_intf* blkio, const void* buf, unsigned long n){
     uint64_t inode_idx = openfiles[openfile_idx].inode_num;
 
     // lock the file
-    lock_acquire(&openfile_lock);
+    rwlock_acquire_write(&openfile_lock);
 
     while (bytes_written < bytes_to_write) {
         // Calculate block details
@@ -303,7 +336,7 @@ long fs_write(struct io_intf* blkio, const void* buf, unsigned long n){
         // set the write position
         if (ioseek(fs_blkio, real_address) < 0) {
             // unlock the file
-            lock_release(&openfile_lock);
+            rwlock_release_write(&openfile_lock);
             return -ENOTSUP; // if position set failure, return operation not supported
         }
 
@@ -312,10 +345,16 @@ long fs_write(struct io_intf* blkio, const void* buf, unsigned long n){
         long bytes_written_this = iowrite(fs_blkio, thisbuff, bytes_to_process);
         if (bytes_written_this <= 0) {
             // unlock the file
-            lock_release(&openfile_lock);
+            rwlock_release_write(&openfile_lock);
             return (bytes_written_this == 0) ? bytes_written : -EIO; // End loop on EOF or return error on failure
         }
 
+        // Keep a cached copy of the block up to date for the processes that map it
+        struct fs_cache_entry* cached = fs_cache_lookup(inode_idx, block_index);
+        if (cached != NULL) {
+            memcpy((char*)cached->page + block_offset, thisbuff, bytes_written_this);
+        }
+
         // Update counters and pointers after a successful write
         bytes_written += bytes_written_this;
         thisbuff += bytes_written_this;
@@ -323,7 +362,7 @@ long fs_write(struct io_intf* blkio, const void* buf, unsigned long n){
     }
 
     // unlock the file
-    lock_release(&openfile_lock);
+    rwlock_release_write(&openfile_lock);
 
     return bytes_written;
 
@@ -368,26 +407,34 @@ long fs_read(struct io_intf* blkio, void* buf, unsigned long n){
         return -EINVAL; // invalid argument
     }
     
-    // check if it can write
     uint64_t thisfile_size = openfiles[openfile_idx].file_size;
-    if (openfiles[openfile_idx].file_pos >= thisfile_size){ // is already full
-        return 0; // wrote 0 bytes
-    }
-    // can write at most (size - pos) bytes
-    uint64_t bytes_to_read = (n+openfiles[openfile_idx].file_pos > thisfile_size) ? thisfile_size-openfiles[openfile_idx].file_pos : n;
-    // compute the position where the write starts
     uint64_t bytes_read = 0;
     const char* thisbuff = (const char*)buf;
     uint64_t inode_idx = openfiles[openfile_idx].inode_num;
 
-    // lock the file
-    lock_acquire(&openfile_lock);
+    // lock the file for reading
+    rwlock_acquire_read(&openfile_lock);
+
+    // reserve the range to read: other readers of this file struct start
+    // where it ends
+    lock_acquire(&fs_pos_lock);
+    uint64_t pos = openfiles[openfile_idx].file_pos;
+    if (pos >= thisfile_size){ // is already at the end
+        lock_release(&fs_pos_lock);
+        rwlock_release_read(&openfile_lock);
+        return 0; // read 0 bytes
+    }
+    // can read at most (size - pos) bytes
+    uint64_t bytes_to_read = (n+pos > thisfile_size) ? thisfile_size-pos : n;
+    uint64_t reserved_end = pos + bytes_to_read;
+    openfiles[openfile_idx].file_pos = reserved_end;
+    lock_release(&fs_pos_lock);
 
     // read until full read is reached
     while (bytes_read < bytes_to_read) {
         // Calculate block details
-        uint64_t block_index = openfiles[openfile_idx].file_pos / DATABLKSIZE;
-        uint64_t block_offset = openfiles[openfile_idx].file_pos % DATABLKSIZE;
+        uint64_t block_index = pos / DATABLKSIZE;
+        uint64_t block_offset = pos % DATABLKSIZE;
 
         // Determine bytes that can be written in this iteration
         uint64_t bytes_avail = DATABLKSIZE - block_offset; // available bytes in current datablock
@@ -399,33 +446,50 @@ long fs_read(struct io_intf* blkio, void* buf, unsigned long n){
             bytes_to_process = bytes_avail;
         }
 
-        // Compute datablock position and real address of the device for writing
-        uint64_t datablock_position = 1 + boot_block.num_inodes + inodes[inode_idx].datablk_nums[block_index]; // num of boot_block + num of inodes + block_index
-        uint64_t real_address = (datablock_position * DATABLKSIZE) + block_offset; // real address is the actual position in the blocks
-
-        // set the read position
-        if (ioseek(fs_blkio, real_address) < 0) {
-            // unlock the file
-            lock_release(&openfile_lock);
-            return -ENOTSUP; // if position set failure, return operation not supported
+        long bytes_read_this;
+
+        // A block mapped by a process is in the page cache; copy it from there
+        struct fs_cache_entry* cached = fs_cache_lookup(inode_idx, block_index);
+        if (cached != NULL) {
+            memcpy((void*)thisbuff, (char*)cached->page + block_offset, bytes_to_process);
+            bytes_read_this = bytes_to_process;
+        } else {
+            // Compute datablock position and real address of the device for writing
+            uint64_t datablock_position = 1 + boot_block.num_inodes + inodes[inode_idx].datablk_nums[block_index]; // num of boot_block + num of inodes + block_index
+            uint64_t real_address = (datablock_position * DATABLKSIZE) + block_offset; // real address is the actual position in the blocks
+
+            // other readers use the device too
+            lock_acquire(&fs_blkio_lock);
+
+            // set the read position
+            if (ioseek(fs_blkio, real_address) < 0) {
+                // unlock the file
+                lock_release(&fs_blkio_lock);
+                fs_read_unreserve(&openfiles[openfile_idx], reserved_end, pos);
+                rwlock_release_read(&openfile_lock);
+                return -ENOTSUP; // if position set failure, return operation not supported
+            }
+
+            // Perform the write operation. If 0 byte is read, read is complete; if negative value, error.
+            bytes_read_this = ioread_full(fs_blkio, (void*) thisbuff, bytes_to_process);
+            lock_release(&fs_blkio_lock);
         }
 
-        // Perform the write operation. If 0 byte is read, read is complete; if negative value, error.
-        long bytes_read_this = ioread_full(fs_blkio, (void*) thisbuff, bytes_to_process);
         if (bytes_read_this <= 0) {
             // unlock the file
-            lock_release(&openfile_lock);
+            fs_read_unreserve(&openfiles[openfile_idx], reserved_end, pos);
+            rwlock_release_read(&openfile_lock);
             return (bytes_read_this == 0) ? bytes_read : -EIO; // End loop on EOF or return error on failure
         }
 
         // Update counters and pointers after a successful read
         bytes_read += bytes_read_this;
         thisbuff += bytes_read_this;
-        openfiles[openfile_idx].file_pos += bytes_read_this;
+        pos += bytes_read_this;
     }
 
     // unlock the file
-    lock_release(&openfile_lock);
+    rwlock_release_read(&openfile_lock);
 
 
     return bytes_read;
@@ -463,6 +527,9 @@ int fs_ioctl(struct io_intf* blkio, int cmd, void* arg){
         int blksize = fs_getblksz(thisfile, arg);
         return blksize;
         break;
+    case IOCTL_GETPAGE:
+        return fs_getpage(thisfile, arg);
+        break;
     
     default:
         return -ENOTSUP; // operation not supported
@@ -537,3 +604,141 @@ int fs_getblksz(file_t * fd, void * arg) {
     return 0;
 }
 
+
+
+/**fs_getpage
+ * Returns in arg (a struct io_page) the page cache frame holding the block
+ * at the page-aligned position arg->pos of the file, reading the block on a
+ * miss. A reference to the frame is taken for the caller, who drops it with
+ * memory_page_put or passes it on to a mapping.
+ */
+int fs_getpage(file_t * fd, void * arg) {
+    struct io_page* req = arg;
+    struct fs_cache_entry* ent;
+
+    // Do the general checks
+    if (fd == NULL || arg == NULL) {
+        return -EINVAL; // invalid argument was passed into a function
+    }
+    if (req->pos % DATABLKSIZE != 0 || req->pos >= fd->file_size) {
+        return -EINVAL; // not a block of the file
+    }
+
+    uint32_t blkno = req->pos / DATABLKSIZE;
+
+    // filling the cache changes it, so no readers
+    rwlock_acquire_write(&openfile_lock);
+
+    ent = fs_cache_lookup(fd->inode_num, blkno);
+    if (ent == NULL) {
+        ent = fs_cache_fill(fd, blkno);
+    }
+    if (ent == NULL) {
+        rwlock_release_write(&openfile_lock);
+        return -EIO;
+    }
+
+    memory_page_get(ent->page);
+    req->page = ent->page;
+
+    rwlock_release_write(&openfile_lock);
+    return 0;
+}
+
+
+
+/**fs_cache_lookup
+ * Returns the cache entry of block blkno of inode inode_num, or NULL if the
+ * block is not cached. Called with openfile_lock held, for reading or writing.
+ */
+static struct fs_cache_entry* fs_cache_lookup(uint32_t inode_num, uint32_t blkno) {
+    struct fs_cache_entry* ent = *fs_cache_head(inode_num, blkno);
+
+    while (ent != NULL && (ent->inode_num != inode_num || ent->blkno != blkno)) {
+        ent = ent->next;
+    }
+
+    return ent;
+}
+
+
+
+/**fs_cache_fill
+ * Reads block blkno of the file into a new cache entry and returns it, or
+ * NULL if the read failed or every cached block is mapped. Takes an unused
+ * entry if there is one, otherwise evicts the next unmapped block after
+ * fs_cache_hand. Called with openfile_lock held for writing.
+ */
+static struct fs_cache_entry* fs_cache_fill(file_t* fd, uint32_t blkno) {
+    struct fs_cache_entry* ent = NULL;
+    struct fs_cache_entry** link;
+    uint32_t i;
+
+    for (i = 0; i < FS_CACHE_PAGES; i++) {
+        ent = &fs_cache[(fs_cache_hand + i) % FS_CACHE_PAGES];
+        if (ent->page == NULL || memory_page(ent->page)->refcnt == 1) {
+            break;
+        }
+    }
+    if (i == FS_CACHE_PAGES) {
+        return NULL; // all blocks are in use
+    }
+    fs_cache_hand = (fs_cache_hand + i + 1) % FS_CACHE_PAGES;
+
+    // evict the block held by this entry
+    if (ent->page != NULL) {
+        link = fs_cache_head(ent->inode_num, ent->blkno);
+        while (*link != ent) {
+            link = &(*link)->next;
+        }
+        *link = ent->next;
+        memory_page_put(ent->page);
+        ent->page = NULL;
+    }
+
+    // read the block, the part past the end of the file reads as zero
+    void* page = memory_alloc_page();
+    memory_page(page)->type = PAGE_TYPE_CACHE;
+
+    uint64_t len = fd->file_size - (uint64_t)blkno * DATABLKSIZE;
+    if (len > DATABLKSIZE) {
+        len = DATABLKSIZE;
+    }
+    uint64_t datablock_position = 1 + boot_block.num_inodes + inodes[fd->inode_num].datablk_nums[blkno];
+
+    if (ioseek(fs_blkio, datablock_position * DATABLKSIZE) < 0 ||
+        ioread_full(fs_blkio, page, len) != len) {
+        memory_free_page(page);
+        return NULL;
+    }
+    memset((char*)page + len, 0, PAGE_SIZE - len);
+
+    ent->inode_num = fd->inode_num;
+    ent->blkno = blkno;
+    ent->page = page;
+    link = fs_cache_head(ent->inode_num, ent->blkno);
+    ent->next = *link;
+    *link = ent;
+
+    return ent;
+}
+
+
+
+/**fs_read_unreserve
+ * Gives back the part of a range reserved by fs_read that it did not read, from
+ * /pos/ to /end/, unless another reader or a seek moved file_pos since.
+ */
+static void fs_read_unreserve(file_t* fd, uint64_t end, uint64_t pos) {
+    lock_acquire(&fs_pos_lock);
+    if (fd->file_pos == end) {
+        fd->file_pos = pos;
+    }
+    lock_release(&fs_pos_lock);
+}
+
+
+
+static struct fs_cache_entry** fs_cache_head(uint32_t inode_num, uint32_t blkno) {
+    return &fs_cache_bucket[(inode_num * 31 + blkno) % FS_CACHE_BUCKETS];
+}
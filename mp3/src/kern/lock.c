@@ -0,0 +1,128 @@
+// lock.c - Lock statistics
+//
+// The inline functions in lock.h keep the statistics of each lock; this file
+// keeps the list of locks that have any and hands it out (see LOCK_STATS in
+// lock.h).
+//
+
+#include "lock.h"
+#include "io.h"
+#include "device.h"
+#include "heap.h"
+#include "memory.h"
+#include "string.h"
+#include "timer.h"
+#include "error.h"
+
+#include <stdint.h>
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+static struct lock_stats * stats_list;
+static int stats_count;
+
+static struct io_intf stats_io;
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int stats_open(struct io_intf ** ioptr, void * aux);
+static int stats_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static const struct io_ops stats_io_ops = {
+    .ctl = stats_ioctl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void lock_stats_list(struct lock_stats * st, const char * name) {
+    preempt_disable();
+
+    if (!st->listed) {
+        st->name = name;
+        st->next = stats_list;
+        stats_list = st;
+        st->listed = 1;
+        stats_count += 1;
+    }
+
+    preempt_enable();
+}
+
+void lock_stats_dump(void) {
+    const struct lock_stats * st;
+
+    kprintf("%16s %10s %10s %12s %12s\n",
+        "lock", "acquired", "contended", "wait_us", "max_hold_us");
+
+    for (st = stats_list; st != NULL; st = st->next) {
+        kprintf("%16s %10lu %10lu %12lu %12lu\n",
+            (st->name != NULL) ? st->name : "?",
+            st->acquired, st->contended,
+            st->wait_ticks / (TIMER_FREQ / 1000000),
+            st->max_hold / (TIMER_FREQ / 1000000));
+    }
+}
+
+void lock_stats_attach(void) {
+    stats_io.ops = &stats_io_ops;
+    device_register("lockstat", &stats_open, NULL);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static int stats_open(struct io_intf ** ioptr, void * aux) {
+    stats_io.refcnt += 1;
+    *ioptr = &stats_io;
+    return 0;
+}
+
+// Copies the statistics to the user buffer described by the struct
+// io_lockstat at /arg/. They are copied to a kernel buffer first, since
+// faulting in the user buffer may block and take locks.
+
+static int stats_ioctl(struct io_intf * io, int cmd, void * arg) {
+    const struct lock_stats * st;
+    struct lock_stat_entry * snap;
+    struct io_lockstat req;
+    uint64_t cnt = 0;
+    int result = 0;
+
+    if (cmd != IOCTL_LOCKSTAT)
+        return -ENOTSUP;
+
+    if (copy_from_user(&req, arg, sizeof(req)) != 0)
+        return -EFAULT;
+
+    preempt_disable();
+
+    if (stats_count < req.cnt)
+        req.cnt = stats_count;
+
+    snap = kcalloc(req.cnt + 1, sizeof(*snap));
+
+    for (st = stats_list; st != NULL && cnt < req.cnt; st = st->next) {
+        if (st->name != NULL)
+            strncpy(snap[cnt].name, st->name, sizeof(snap[cnt].name) - 1);
+        snap[cnt].acquired = st->acquired;
+        snap[cnt].contended = st->contended;
+        snap[cnt].wait_ticks = st->wait_ticks;
+        snap[cnt].max_hold = st->max_hold;
+        cnt += 1;
+    }
+
+    preempt_enable();
+    req.cnt = cnt;
+
+    if (copy_to_user(req.buf, snap, cnt * sizeof(*snap)) != 0 ||
+        copy_to_user(arg, &req, sizeof(req)) != 0)
+    {
+        result = -EFAULT;
+    }
+
+    kfree(snap);
+    return result;
+}
@@ -1,4 +1,4 @@
-// lock.h - A sleep lock
+// lock.h - Sleep locks: a mutex and a reader-writer lock
 //
 
 #ifdef LOCK_TRACE
@@ -16,16 +16,92 @@
 #include "halt.h"
 #include "console.h"
 #include "intr.h"
+#include "csr.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// lock_release wakes one waiter, if there is any. A lock in handoff mode makes
+// that waiter the holder right away, so that the lock goes to the waiters in
+// the order they started waiting and a thread that comes along in the meantime
+// cannot take it; otherwise the lock is free until the woken thread runs, and
+// whoever gets there first takes it. LOCK_HANDOFF is the mode lock_init sets.
+
+#ifndef LOCK_HANDOFF
+#define LOCK_HANDOFF 1
+#endif
+
+// Building with LOCK_STATS=1 makes every lock and rwlock count how often it
+// was taken, how often a thread had to wait for it and for how long in all,
+// and the longest time it was held (for an rwlock held by readers: from the
+// first reader in to the last reader out). Times are in rdtime ticks. A lock
+// joins the list of locks with statistics the first time it is taken;
+// lock_stats_dump prints the list, and lock_stats_attach registers the
+// "lockstat" device, whose IOCTL_LOCKSTAT hands a snapshot to user programs.
+
+#ifndef LOCK_STATS
+#define LOCK_STATS 0
+#endif
+
+struct lock_stats {
+    const char * name;
+    struct lock_stats * next; // next lock with statistics
+    char listed; // on the list of locks with statistics
+    uint64_t acquired;
+    uint64_t contended; // acquisitions that had to wait
+    uint64_t wait_ticks;
+    uint64_t max_hold;
+    uint64_t hold_start; // when the current holders started holding it
+    int holders;
+};
 
 struct lock {
     struct condition cond;
     int tid; // thread id holding lock or -1
+    char handoff; // pass the lock to the first waiter on release
+    struct lock_stats stats;
+};
+
+// An rwlock is held by any number of readers or by one writer. A writer that
+// has to wait keeps new readers out, so that readers cannot starve writers;
+// a releasing writer lets the next writer in, if there is one, and otherwise
+// all waiting readers. A thread must not take an rwlock it already holds.
+
+struct rwlock {
+    struct condition rd_cond; // readers wait here
+    struct condition wr_cond; // writers wait here
+    int readers; // readers holding the lock
+    int writer; // thread id of the writer holding the lock or -1
+    int writers_waiting;
+    struct lock_stats stats;
 };
 
 static inline void lock_init(struct lock * lk, const char * name);
 static inline void lock_acquire(struct lock * lk);
 static inline void lock_release(struct lock * lk);
 
+static inline void rwlock_init(struct rwlock * rw, const char * name);
+static inline void rwlock_acquire_read(struct rwlock * rw);
+static inline void rwlock_release_read(struct rwlock * rw);
+static inline void rwlock_acquire_write(struct rwlock * rw);
+static inline void rwlock_release_write(struct rwlock * rw);
+
+// Statistics (see above). lock_stats_acquired and lock_stats_released record
+// an acquisition (that started waiting at /wait_start/ if /contended/) and a
+// release; they do nothing unless LOCK_STATS is set. lock_stats_list adds
+// /st/ to the list of locks with statistics.
+
+static inline void lock_stats_acquired (
+    struct lock_stats * st, const char * name,
+    int contended, uint64_t wait_start);
+static inline void lock_stats_released(struct lock_stats * st);
+
+extern void lock_stats_list(struct lock_stats * st, const char * name);
+extern void lock_stats_dump(void);
+extern void lock_stats_attach(void);
+
 // INLINE FUNCTION DEFINITIONS
 //
 
@@ -33,6 +109,7 @@ static inline void lock_init(struct lock * lk, const char * name) {
     trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
     lk->tid = -1;
+    lk->handoff = LOCK_HANDOFF;
 }
 
 /**
@@ -56,8 +133,11 @@ static inline void lock_acquire(struct lock * lk) {
     	return;
 	}
 	
-    // Disable the interrupt
-    int saved_intr_state = intr_disable();
+    // Lock state is only shared between threads, not with ISRs
+    preempt_disable();
+
+    const int contended = (lk->tid != -1);
+    const uint64_t wait_start = LOCK_STATS ? csrr_time() : 0;
 
     // If the lock is acquired by other thread, sleep the current thread
     while(lk->tid != -1){
@@ -65,13 +145,17 @@ static inline void lock_acquire(struct lock * lk) {
             thread_name(curr_tid), curr_tid,
             lk->cond.name, lk);
 		condition_wait(&lk->cond);
+
+        // In handoff mode, lock_release made us the holder
+        if(lk->tid == curr_tid)
+            break;
 	}
 	
     // Acquire the lock
 	lk->tid = curr_tid;
+    lock_stats_acquired(&lk->stats, lk->cond.name, contended, wait_start);
 
-    // Restore the interrupt state
-    intr_restore(saved_intr_state);
+    preempt_enable();
 	
 	debug("Thread <%s:%d> acquired lock <%s:%p>",
         thread_name(curr_tid), curr_tid,
@@ -83,18 +167,146 @@ static inline void lock_release(struct lock * lk) {
 
     assert (lk->tid == running_thread());
     
-    // Disable the interrupt
-    int saved_intr_state = intr_disable();
+    preempt_disable();
 
-    lk->tid = -1;
-    condition_broadcast(&lk->cond);
+    lock_stats_released(&lk->stats);
 
-    // Restore the interrupt state
-    intr_restore(saved_intr_state);
+    // Wake one waiter; the others stay asleep until their turn
+
+    if (lk->handoff)
+        lk->tid = condition_signal(&lk->cond);
+    else {
+        lk->tid = -1;
+        condition_signal(&lk->cond);
+    }
+
+    preempt_enable();
 
     debug("Thread <%s:%d> released lock <%s:%p>",
         thread_name(running_thread()), running_thread(),
         lk->cond.name, lk);
 }
 
+static inline void rwlock_init(struct rwlock * rw, const char * name) {
+    trace("%s(<%s:%p>", __func__, name, rw);
+    condition_init(&rw->rd_cond, name);
+    condition_init(&rw->wr_cond, name);
+    rw->readers = 0;
+    rw->writer = -1;
+    rw->writers_waiting = 0;
+}
+
+static inline void rwlock_acquire_read(struct rwlock * rw) {
+    uint64_t wait_start;
+    int contended;
+
+    trace("%s(<%s:%p>", __func__, rw->rd_cond.name, rw);
+    assert (rw->writer != running_thread());
+
+    preempt_disable();
+
+    contended = (rw->writer != -1 || rw->writers_waiting != 0);
+    wait_start = LOCK_STATS ? csrr_time() : 0;
+
+    while (rw->writer != -1 || rw->writers_waiting != 0)
+        condition_wait(&rw->rd_cond);
+
+    rw->readers += 1;
+    lock_stats_acquired(&rw->stats, rw->rd_cond.name, contended, wait_start);
+
+    preempt_enable();
+}
+
+static inline void rwlock_release_read(struct rwlock * rw) {
+    trace("%s(<%s:%p>", __func__, rw->rd_cond.name, rw);
+    assert (0 < rw->readers);
+
+    preempt_disable();
+
+    lock_stats_released(&rw->stats);
+
+    if (--rw->readers == 0)
+        condition_signal(&rw->wr_cond);
+
+    preempt_enable();
+}
+
+static inline void rwlock_acquire_write(struct rwlock * rw) {
+    const int curr_tid = running_thread();
+    uint64_t wait_start;
+    int contended;
+
+    trace("%s(<%s:%p>", __func__, rw->wr_cond.name, rw);
+    assert (rw->writer != curr_tid);
+
+    preempt_disable();
+
+    contended = (rw->writer != -1 || rw->readers != 0);
+    wait_start = LOCK_STATS ? csrr_time() : 0;
+
+    while (rw->writer != -1 || rw->readers != 0) {
+        rw->writers_waiting += 1;
+        condition_wait(&rw->wr_cond);
+        rw->writers_waiting -= 1;
+    }
+
+    rw->writer = curr_tid;
+    lock_stats_acquired(&rw->stats, rw->wr_cond.name, contended, wait_start);
+
+    preempt_enable();
+}
+
+static inline void rwlock_release_write(struct rwlock * rw) {
+    trace("%s(<%s:%p>", __func__, rw->wr_cond.name, rw);
+    assert (rw->writer == running_thread());
+
+    preempt_disable();
+
+    lock_stats_released(&rw->stats);
+    rw->writer = -1;
+
+    if (rw->writers_waiting != 0)
+        condition_signal(&rw->wr_cond);
+    else
+        condition_broadcast(&rw->rd_cond);
+
+    preempt_enable();
+}
+
+static inline void lock_stats_acquired (
+    struct lock_stats * st, const char * name,
+    int contended, uint64_t wait_start)
+{
+    uint64_t now;
+
+    if (!LOCK_STATS)
+        return;
+
+    if (!st->listed)
+        lock_stats_list(st, name);
+
+    now = csrr_time();
+    st->acquired += 1;
+
+    if (contended) {
+        st->contended += 1;
+        st->wait_ticks += now - wait_start;
+    }
+
+    if (st->holders++ == 0)
+        st->hold_start = now;
+}
+
+static inline void lock_stats_released(struct lock_stats * st) {
+    uint64_t held;
+
+    if (!LOCK_STATS || --st->holders != 0)
+        return;
+
+    held = csrr_time() - st->hold_start;
+
+    if (st->max_hold < held)
+        st->max_hold = held;
+}
+
 #endif // _LOCK_H_
\ No newline at end of file
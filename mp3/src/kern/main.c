@@ -19,6 +19,7 @@
 #include "intr.h"
 #include "memory.h"
 #include "heap.h"
+#include "lock.h"
 #include "virtio.h"
 #include "halt.h"
 #include "elf.h"
@@ -36,12 +37,16 @@ void main(void) {
     int i;
 
     console_init();
+    boot_mark("console_init");
     memory_init();
+    boot_mark("memory_init");
     intr_init();
     devmgr_init();
     thread_init();
     procmgr_init();
     timer_init();
+    thread_start_harts();
+    boot_mark("core_init");
 
     // Attach NS16550a serial devices
 
@@ -59,6 +64,15 @@ void main(void) {
         virtio_attach(mmio_base, VIRT0_IRQNO+i);
     }
 
+#if HEAP_PROFILE
+    heap_profile_attach();
+#endif
+#if LOCK_STATS
+    lock_stats_attach();
+#endif
+    timer_stats_attach();
+
+    boot_mark("device_attach");
     intr_enable();
 
     result = device_open(&blkio, "blk", 0);
@@ -72,12 +86,18 @@ void main(void) {
 
     if (result != 0)
         panic("fs_mount failed");
+    
+    boot_mark("fs_mount");
 
     result = fs_open(INIT_PROC, &initio);
 
     if (result < 0)
         panic(INIT_PROC ": process image not found");
     
+    boot_log_print();
+#if HEAP_PROFILE
+    heap_profile_dump();
+#endif
     result = process_exec(initio);
     panic(INIT_PROC ": process_exec failed");
 }
@@ -47,11 +47,30 @@ extern char _kimg_data_start[];
 extern char _kimg_data_end[];
 extern char _kimg_end[];
 
+// Exception table, collected from the __ex_table sections by kernel.ld. Each
+// entry names a kernel instruction that may fault on a user address and the
+// address to resume at if the fault cannot be resolved.
+
+struct exception_table_entry {
+    uintptr_t insn;
+    uintptr_t fixup;
+};
+
+extern const struct exception_table_entry _ex_table_start[];
+extern const struct exception_table_entry _ex_table_end[];
+
+// Defined in uaccess.s. Returns the number of bytes not copied.
+
+extern size_t _copy_user(void * dst, const void * src, size_t n);
+
 // INTERNAL TYPE DEFINITIONS
 //
 
 union linked_page {
-    union linked_page * next;
+    struct {
+        union linked_page * next;
+        union linked_page * prev;
+    };
     char padding[PAGE_SIZE];
 };
 
@@ -70,8 +89,23 @@ struct pte {
 #define VPN2(vma) (((vma) >> (9+9+12)) & 0x1FF)
 #define VPN1(vma) (((vma) >> (9+12)) & 0x1FF)
 #define VPN0(vma) (((vma) >> 12) & 0x1FF)
+#define VPN(vma,level) (((vma) >> (12 + 9*(level))) & 0x1FF)
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+// Software-defined bit kept in the RSW field of a leaf PTE. A leaf with
+// PTE_RSW_COW set was writable before it was shared by memory_space_clone; the
+// first store to it copies the page (see memory_handle_page_fault).
+
+#define PTE_RSW_COW 0x1
+
+#define NFRAME (RAM_SIZE / PAGE_SIZE) // number of physical page frames in RAM
+#define MEGA_ORDER 9 // log2 of the number of pages in a megapage
+
+// Largest range memory_set_range_flags flushes from the TLB page by page.
+// Larger ranges flush the whole address space (ASID) instead.
+
+#define SFENCE_PAGES_MAX 32
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -102,11 +136,112 @@ static inline struct pte ptab_pte (
 static inline struct pte null_pte(void);
 
 static inline void sfence_vma(void);
+static inline void sfence_vma_addr(uintptr_t vma);
+static inline void sfence_vma_asid(uint_fast16_t asid);
+static void sfence_vma_range(uintptr_t start, uintptr_t end);
+static inline uint_fast16_t active_asid(void);
+static inline void tlb_mark_stale(void);
+static int asid_alloc(size_t root_frame);
+
+static struct pte * walk_pt_level (
+    struct pte * root, uintptr_t vma, int level, int create, int * levelptr);
+static void split_leaf(struct pte * pte, int level);
+static inline size_t leaf_frames(int level);
+
+// Called by visit_pt_range for every valid leaf PTE in the visited range. The
+// /level/ argument is the page table level of the leaf (0 for a 4 kB page).
+
+typedef void (*pte_visit_fn)(struct pte * leaf, uintptr_t vma, int level, void * aux);
+
+static void visit_pt_range (
+    struct pte * pt, int level, uintptr_t base,
+    uintptr_t start, uintptr_t end, int free_tables,
+    pte_visit_fn fn, void * aux);
+static int pt_empty(const struct pte * pt);
+
+static void clone_leaf(struct pte * leaf, uintptr_t vma, int level, void * aux);
+static void unmap_leaf(struct pte * leaf, uintptr_t vma, int level, void * aux);
+static void reclaim_leaf(struct pte * leaf, uintptr_t vma, int level, void * aux);
+static void set_leaf_flags(struct pte * leaf, uintptr_t vma, int level, void * aux);
+static void set_pte_flags(struct pte * leaf, uint_fast8_t rwxug_flags);
+
+static inline size_t pageptr_to_frame(const void * pp);
+static inline void * frame_to_pageptr(size_t frame);
+
+static void * buddy_alloc(int order);
+static int bump_carve(void);
+static void buddy_free(size_t frame, int order);
+static void free_area_insert(union linked_page * page, int order);
+static void free_area_remove(union linked_page * page, int order);
+static inline void page_ref_inc(const void * pp);
+static void page_ref_put(void * pp);
+static void handle_cow_fault(struct pte * leaf, int level, uintptr_t vma);
+static struct pte * walk_user_pt(struct pte * root, uintptr_t vma);
+static inline int user_range_ok(const void * vp, size_t n);
 
 // INTERNAL GLOBAL VARIABLES
 //
 
-static union linked_page * free_list; // the free pages in a linked list
+// Buddy allocator state. free_area[k] is a doubly linked list of free blocks
+// of 2^k contiguous pages, each aligned to its size (counted in frames from
+// RAM_START). The head frame of a free block has PAGE_FLAG_BUDDY set and its
+// order in frametab, which lets buddy_free find a free buddy in constant time.
+
+static union linked_page * free_area[BUDDY_MAX_ORDER+1];
+
+// Untouched tail of RAM. Frames from bump_frame up to NFRAME are free but not
+// on the free lists yet, so that memory_init does not touch every block of
+// RAM. buddy_alloc carves blocks off the front of this region when the free
+// lists run dry, and the idle thread links the rest a block at a time (see
+// memory_carve_free_blocks). bump_frame is aligned to 2^BUDDY_MAX_ORDER frames
+// except at the very end of RAM.
+
+static size_t bump_frame;
+
+// Frame descriptor table, one entry per physical frame of RAM. The refcnt of a
+// frame is the number of mappings referring to it: a frame returned by
+// memory_alloc_pages starts with one reference, and memory_space_clone adds one
+// for every user page it shares with the child.
+
+static struct page frametab[NFRAME];
+
+// ASID allocator. asid_owner[a] is the frame of the root page table of the
+// memory space that holds ASID a in the current generation, or 0 if no space
+// holds it (frame 0 is part of the kernel image, never a page table). ASIDs are
+// handed out in increasing order when a space is switched to; when they run
+// out, a new generation begins: every ASID is revoked and the TLB is flushed
+// once. A space remembers its ASID in the struct page of its root table and
+// keeps it as long as asid_owner agrees. ASID 0 belongs to the main space.
+
+static size_t asid_owner[MEMORY_NASID];
+static uint_fast16_t asid_limit; // ASIDs usable, at most MEMORY_NASID
+static uint_fast16_t asid_next;
+static unsigned long asid_generation;
+
+// The ASID generation for which each hart last flushed its TLB. A hart that
+// is behind flushes when it next switches spaces.
+
+static unsigned long hart_asid_generation[NHART];
+
+// Pool of pre-zeroed pages, filled by memory_refill_zero_pool from the idle
+// thread and drawn from by memory_alloc_zeroed_page. Pages in the pool are
+// allocated from the buddy lists and typed PAGE_TYPE_ZERO.
+
+static void * zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_cnt;
+static unsigned long zero_pool_hits; // zeroed allocations served by the pool
+static unsigned long zero_pool_misses; // zeroed allocations that had to zero
+
+static const char * const page_type_names[PAGE_TYPE_CNT] = {
+    [PAGE_TYPE_FREE] = "free",
+    [PAGE_TYPE_KERNEL] = "kernel",
+    [PAGE_TYPE_USER] = "user",
+    [PAGE_TYPE_PTAB] = "page table",
+    [PAGE_TYPE_HEAP] = "heap",
+    [PAGE_TYPE_STACK] = "stack",
+    [PAGE_TYPE_CACHE] = "cache",
+    [PAGE_TYPE_ZERO] = "zeroed"
+};
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096))); // the root page table
@@ -136,10 +271,10 @@ void memory_init(void) {
     const void * const rodata_start = _kimg_rodata_start;
     const void * const rodata_end = _kimg_rodata_end;
     const void * const data_start = _kimg_data_start;
-    union linked_page * page;
     void * heap_start;
     void * heap_end; // also user_start
     size_t page_cnt;
+    size_t frame;
     uintptr_t pma;
     const void * pp;
 
@@ -216,6 +351,18 @@ void memory_init(void) {
     csrw_satp(main_mtag);
     sfence_vma();
 
+    // Find out how many ASID bits the hart implements: unimplemented bits of
+    // the satp ASID field read back as zero.
+
+    csrw_satp(main_mtag | ((uintptr_t)0xFFFF << RISCV_SATP_ASID_shift));
+    asid_limit = MIN(MEMORY_NASID,
+        ((csrr_satp() >> RISCV_SATP_ASID_shift) & 0xFFFF) + 1);
+    csrw_satp(main_mtag);
+    sfence_vma();
+    asid_next = 1;
+
+    kprintf("          ASID: %u usable\n", (unsigned int)asid_limit);
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -237,34 +384,29 @@ void memory_init(void) {
     kprintf("Heap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    free_list = heap_end; // heap_end is page aligned
+    // Frames below heap_end are never freed: the kernel image, followed by the
+    // initial heap block.
+
+    for (frame = 0; frame < pageptr_to_frame(heap_end); frame++) {
+        pp = frame_to_pageptr(frame);
+        frametab[frame].refcnt = 1;
+        frametab[frame].type = (pp < round_down_ptr(heap_start, PAGE_SIZE)) ?
+            PAGE_TYPE_KERNEL : PAGE_TYPE_HEAP;
+    }
+
     page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
 
     kprintf("Page allocator: [%p,%p): %lu pages free\n",
-        free_list, RAM_END, page_cnt);
+        heap_end, RAM_END, page_cnt);
 
-    // Put free pages on the free page list
-    // TODO: FIXME implement this (must work with your implementation of
-    // memory_alloc_page and memory_free_page).
+    // Free pages go on the buddy free lists as the largest naturally aligned
+    // blocks that fit in [heap_end,RAM_END). Only the blocks up to the first
+    // 2^BUDDY_MAX_ORDER boundary are linked now; the rest is left to
+    // bump_carve, so the work here does not depend on RAM_SIZE.
 
-    // original version, failed with the arithmetics of ptrs
-    // free_list = (union linked_page*)(RAM_START + MEGA_SIZE);
-    // for (uint64_t pp = (uint64_t)free_list; pp < (uint64_t)(RAM_END - PAGE_SIZE); pp += PAGE_SIZE){
-    //     page = (union linked_page*) pp;
-    //     page->next = (union linked_page*)(pp+PAGE_SIZE);
-    // }
-    // union linked_page* last_free_pp = RAM_END - PAGE_SIZE;
-    // last_free_pp->next = NULL;
-
-    for(size_t i=0; i<page_cnt-1; i++){
-        // union linked_page* next;
-        page = free_list + 1;
-        page->next = free_list;
-        free_list = page;
-        if(i == 0){
-            page->next->next = NULL;
-        }
-    }
+    bump_frame = pageptr_to_frame(heap_end); // heap_end is page aligned
+    while (bump_frame % (1UL << BUDDY_MAX_ORDER) != 0 && bump_carve())
+        continue;
     
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling it when we are accessing user memory, and disable it at other
@@ -275,25 +417,41 @@ void memory_init(void) {
     memory_initialized = 1;
 }
 
+/**memory_hart_init
+ * 
+ * Enables paging in the main memory space on a hart other than hart 0 and
+ * allows S mode to access user memory, as memory_init did on hart 0.
+ * 
+ * Input: none
+ * Output: none
+ */
+void memory_hart_init(void){
+    csrw_satp(main_mtag);
+    sfence_vma();
+    hart_asid_generation[running_hart()] = asid_generation;
+    csrs_sstatus(RISCV_SSTATUS_SUM);
+}
+
 
 
 /**memory_space_create
  * 
- * Creates a new memory space and makes it the currently active space. Returns a
- * memory space tag (type uintptr_t) that may be used to refer to the memory
- * space. The created memory space contains the same identity mapping of MMIO
- * address space and RAM as the main memory space. This function never fails; if
- * there are not enough physical memory pages to create the new memory space, it
- * panics.
+ * Creates a new memory space. Returns a memory space tag (type uintptr_t) that
+ * may be used to refer to the memory space. The created memory space contains
+ * the same identity mapping of MMIO address space and RAM as the main memory
+ * space. This function never fails; if there are not enough physical memory
+ * pages to create the new memory space, it panics. The space gets an ASID when
+ * it is first switched to.
  * 
- * Input: asid - address space identifier
- * Output: the new mtag for the new memory space (has been stored in satp)
+ * Input: none
+ * Output: the new mtag for the new memory space
  */
-uintptr_t memory_space_create(uint_fast16_t asid){
-    trace("%s(asid=%d)", __func__, asid);
+uintptr_t memory_space_create(void){
+    trace("%s()", __func__);
 
     // allocate a new page for the root table
-    struct pte* new_pt2 = memory_alloc_page();
+    struct pte* new_pt2 = memory_alloc_zeroed_page();
+    memory_page(new_pt2)->type = PAGE_TYPE_PTAB;
 
     // Identity mapping of two gigabytes (as two gigapage mappings)
     for (uintptr_t pma = 0; pma < RAM_START_PMA; pma += GIGA_SIZE)
@@ -301,10 +459,8 @@ uintptr_t memory_space_create(uint_fast16_t asid){
     // map the RAM the same way as in main memory space
     new_pt2[VPN2(RAM_START_PMA)] = ptab_pte(main_pt1_0x80000, PTE_G);
 
-    // get the new mtag and switch to the new memory space
-    uintptr_t new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | ((uintptr_t)asid << RISCV_SATP_ASID_shift) | pageptr_to_pagenum(new_pt2);
-    // memory_space_switch(new_mtag);
-    sfence_vma();
+    // get the new mtag
+    uintptr_t new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | pageptr_to_pagenum(new_pt2);
 
     return new_mtag;
 }
@@ -316,14 +472,17 @@ uintptr_t memory_space_create(uint_fast16_t asid){
  * clone your memory space for current process and return the mtag of the new memory space.
  * Should be used in thread_fork_to_user to setup the memory space for the child process.
  * 
- * Input: asid - address space identifier
+ * The new space gets an ASID when it is first switched to.
+ * 
+ * Input: none
  * Output: the mtag of the new memory space
 */
-uintptr_t memory_space_clone(uint_fast16_t asid){
-    trace("%s(asid=%d)", __func__, asid);
+uintptr_t memory_space_clone(void){
+    trace("%s()", __func__);
 
     // allocate a new page for the root table
-    struct pte* new_pt2 = memory_alloc_page();
+    struct pte* new_pt2 = memory_alloc_zeroed_page();
+    memory_page(new_pt2)->type = PAGE_TYPE_PTAB;
 
     // Identity mapping of two gigabytes (as two gigapage mappings)
     for (uintptr_t pma = 0; pma < RAM_START_PMA; pma += GIGA_SIZE)
@@ -331,50 +490,16 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
     // map the RAM the same way as in main memory space
     new_pt2[VPN2(RAM_START_PMA)] = ptab_pte(main_pt1_0x80000, PTE_G);
 
-    // copy all user region tables
-    // get the original root table (now active)
-    struct pte* root = active_space_root();
-    // loop through the user space and copy every valid pte
-    for(uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE){
-        // get all indices for translation
-        // uintptr_t vpn2 = VPN2(vma);
-        // uintptr_t vpn1 = VPN1(vma);
-        // uintptr_t vpn0 = VPN0(vma);
-
-        // get the original level-0 pte
-        // check the flags to see if valid
-        // uint64_t flags2 = root[vpn2].flags;
-        // if(!(flags2 & PTE_V))
-        //     continue;
-        
-        // struct pte* pt1 = pagenum_to_pageptr(root[vpn2].ppn);
-        // uint64_t flags1 = pt1[vpn1].flags;
-        // if(!(flags1 & PTE_V))
-        //     continue;
-        
-        // struct pte* pt0 = pagenum_to_pageptr(pt1[vpn1].ppn);
-        // uint64_t flags0 = pt0[vpn0].flags;
-        // if(!(flags0 & PTE_V))
-        //     continue;
-        
-        struct pte* original_leaf = walk_pt(root, vma, 0); // 0: no create
-        if(original_leaf == NULL)
-            continue;
-        struct pte* new_leaf = walk_pt(new_pt2, vma, 1); // 1: create new pt enabled
-        new_leaf->flags = original_leaf->flags;
-        // copy the old page to new page
-        // allocate and setup new page
-        void* new_page = pagenum_to_pageptr(new_leaf->ppn);
-        void* orig_page = pagenum_to_pageptr(original_leaf->ppn);
-        memcpy(new_page, orig_page, PAGE_SIZE);
+    // share all user pages with the new space (copy-on-write). Only the
+    // subtrees that are actually populated are visited.
+    visit_pt_range(active_space_root(), 2, 0, USER_START_VMA, USER_END_VMA,
+        0, clone_leaf, new_pt2);
 
-        // // create the new pte
-        // *new_leaf = *original_leaf;
-        // new_leaf->ppn = pageptr_to_pagenum(new_page);
-    }
+    // the parent's writable mappings were downgraded, flush them
+    sfence_vma_asid(active_asid());
 
     // get the new mtag
-    uintptr_t new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | ((uintptr_t)asid << RISCV_SATP_ASID_shift) | pageptr_to_pagenum(new_pt2);
+    uintptr_t new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) | pageptr_to_pagenum(new_pt2);
 
     return new_mtag;
 }
@@ -389,112 +514,432 @@ uintptr_t memory_space_clone(uint_fast16_t asid){
  * not part of the global mapping are reclaimed.
  * 
  * Note: reclaim
- * free the allocated pages, mark the ptes as null
+ * free the allocated pages, free the user page tables and the root table
  * 
  * Input: none
  * Output: none
  * ASSUMPTION: Only the kernel page tables are global, and the user page tables are never global.
- * If this is not the case, a helper function is needed to check whether
- * the entries in the subtable is all global
+ * visit_pt_range does not descend into global tables.
  */
 void memory_space_reclaim(void){
     trace("%s()", __func__);
+    // not preempted while the space is being torn down: suspend_self would
+    // switch back to it
+    preempt_disable();
     // switch the active memory space to the main memory space
     uintptr_t active_mtag = memory_space_switch(main_mtag); /* what about the last active? Reclaim! */
-    sfence_vma();
 
-    // reclaim the memory space that was active on entry
+    // reclaim the memory space that was active on entry: free its user pages
+    // and the page tables that mapped them
     struct pte* curr_pt2 = mtag_to_root(active_mtag);
-    for (uint64_t i=0; i<PTE_CNT; i++){
-        // the flag of this pte
-        uint64_t flags2 = curr_pt2[i].flags;
-        // check if valid, if not, continue
-        if (!(flags2 & PTE_V)){
-            continue;
-        }
+    const size_t root_frame = pageptr_to_frame(curr_pt2);
+
+    // give up its ASID. No other space gets the ASID before the next
+    // generation, which starts with a full flush, so its TLB entries can stay.
+    if(asid_owner[frametab[root_frame].asid] == root_frame)
+        asid_owner[frametab[root_frame].asid] = 0;
+    visit_pt_range(curr_pt2, 2, 0, USER_START_VMA, USER_END_VMA,
+        1, reclaim_leaf, NULL);
+
+    // the root table itself, unless it is the main one
+    if(curr_pt2 != main_pt2)
+        memory_free_page(curr_pt2);
+    preempt_enable();
+}
 
-        // the page this pte is pointing at
-        struct pte* page1 = (struct pte*)pagenum_to_pageptr(curr_pt2[i].ppn);
-        // check if global, if not, reclaim
-        uint64_t flags2_G = flags2 & PTE_G;
-        if(!flags2_G){
-            // check if this entry links to another subtable
-            int64_t flags2_RWX = flags2 & (PTE_R | PTE_W | PTE_X);
-            if(!flags2_RWX){ // contains a level-1 subtable
-                for(uint64_t j=0; j<PTE_CNT; j++){
-                    uint64_t flags1 = page1[j].flags;
-                    // check if valid. continue if invalid.
-                    if (!(flags1 & PTE_V))
-                        continue;
-
-                    struct pte* page0 = (struct pte*)pagenum_to_pageptr(page1[j].ppn);
-                    // check if global. if not, reclaim.
-                    if(!(flags1 & PTE_G)){
-                        if(!(flags1 & (PTE_R | PTE_W | PTE_X))){
-                            // contains a level-0 subtable
-                            for(uint64_t k=0; k<PTE_CNT; k++){
-                                uint64_t flags0 = page0[k].flags;
-                                // check if valid. continue if invalid.
-                                if(!(flags0 & PTE_V))
-                                    continue;
-                                
-                                void* page = pagenum_to_pageptr(page0[k].ppn);
-                                
-                                if((uint64_t)page > (uint64_t)_kimg_end && (uint64_t)page < (uint64_t)RAM_END){
-                                    memory_free_page(page);
-                                    page0[k] = null_pte();
-                                }
-                            }
-                            // ASSUMPTION: Only the kernel page tables are global, and
-                            // the user page tables are never global. If this is not the case,
-                            // a helper function is needed to check whether the entries
-                            // in the subtable is all global
-                            page1[j] = null_pte();
-                        }
-                    }
-                }
-                curr_pt2[i] = null_pte();
-            }
+
+
+/**memory_space_switch
+ * 
+ * Switches to another memory space and returns the memory space tag of the
+ * previously active memory space. The TLB is not flushed: each memory space
+ * other than the main one runs under its own ASID, assigned here the first
+ * time the space is switched to, or again after a generation rollover. The
+ * ASID field of /mtag/ is ignored. If the hart has no ASIDs to spare, all
+ * spaces share ASID 0 and every switch flushes the TLB. The TLB is also
+ * flushed if another hart started a new ASID generation, and the space's ASID
+ * if another hart changed its page tables since this hart last ran it.
+ * 
+ * Input: mtag - the memory space tag to switch to
+ * Output: the memory space tag of the previously active space
+ */
+uintptr_t memory_space_switch(uintptr_t mtag){
+    struct pte* const root = mtag_to_root(mtag);
+    const size_t root_frame = pageptr_to_frame(root);
+    uint_fast16_t asid = 0;
+    int flush = 0;
+    uintptr_t old_mtag;
+    int hart;
+
+    preempt_disable();
+    hart = running_hart();
+
+    if(asid_limit <= 1)
+        flush = 1;
+    else if(root != main_pt2){
+        if(asid_owner[frametab[root_frame].asid] != root_frame)
+            flush = asid_alloc(root_frame);
+        asid = frametab[root_frame].asid;
+    }
+
+    mtag &= ~((uintptr_t)0xFFFF << RISCV_SATP_ASID_shift);
+    mtag |= (uintptr_t)asid << RISCV_SATP_ASID_shift;
+
+    if(hart_asid_generation[hart] != asid_generation){
+        hart_asid_generation[hart] = asid_generation;
+        flush = 1;
+    }
+
+    old_mtag = csrrw_satp(mtag);
+    if(flush)
+        sfence_vma();
+    else if(frametab[root_frame].tlb_stale & (1U << hart))
+        asm inline ("sfence.vma zero, %0" :: "r" (asid) : "memory");
+    frametab[root_frame].tlb_stale &= ~(1U << hart);
+
+    preempt_enable();
+    return old_mtag;
+}
+
+
+
+/**memory_asid_generation
+ * 
+ * Returns the number of times the ASIDs have run out and were reassigned.
+ * 
+ * Input: none
+ * Output: the ASID generation
+ */
+unsigned long memory_asid_generation(void){
+    return asid_generation;
+}
+
+
+
+/**memory_alloc_pages
+ * 
+ * Allocate 2^order physically contiguous pages from the buddy allocator.
+ * The block is aligned to its size. Larger blocks are split as needed.
+ * Panics if no block of the requested order is available.
+ * 
+ * Input: order - log2 of the number of pages, at most BUDDY_MAX_ORDER
+ * Output: a void* ptr, which is the virtual addr of the direct mapped block
+ */
+void * memory_alloc_pages(int order){
+    trace("%s(order=%d)", __func__, order);
+    preempt_disable();
+    void* block = buddy_alloc(order);
+
+    // the zeroed pool is only a cache of free pages: give it back before
+    // giving up
+    if(block == NULL && 0 < zero_pool_cnt){
+        while(0 < zero_pool_cnt)
+            memory_free_page(zero_pool[--zero_pool_cnt]);
+        block = buddy_alloc(order);
+    }
+
+    if(block == NULL){
+        panic("No free page available");
+    }
+    preempt_enable();
+    return block;
+}
+
+
+
+/**memory_alloc_zeroed_page
+ * 
+ * Allocates a page filled with zeroes. The page is taken from the pool of
+ * pages zeroed by the idle thread if it is not empty; otherwise a free page
+ * is zeroed here.
+ * 
+ * Input: none
+ * Output: a pointer to the direct-mapped address of the page
+ */
+void * memory_alloc_zeroed_page(void){
+    void* pp;
+
+    preempt_disable();
+
+    if(0 < zero_pool_cnt){
+        pp = zero_pool[--zero_pool_cnt];
+        frametab[pageptr_to_frame(pp)].type = PAGE_TYPE_KERNEL;
+        zero_pool_hits++;
+        preempt_enable();
+    }
+    else{
+        preempt_enable();
+        pp = memory_alloc_page();
+        memset(pp, 0, PAGE_SIZE);
+        zero_pool_misses++;
+    }
+
+    return pp;
+}
+
+
+
+/**memory_refill_zero_pool
+ * 
+ * Zeroes up to maxcnt free pages and adds them to the zeroed page pool, as
+ * long as the pool is not full and free pages remain. Called by the idle
+ * thread, so the amount of work per call is bounded by maxcnt.
+ * 
+ * Input: maxcnt - maximum number of pages to zero
+ * Output: the number of pages added to the pool
+ */
+int memory_refill_zero_pool(int maxcnt){
+    void* pp;
+    int cnt = 0;
+
+    // one page at a time, so the idle thread can be preempted in between
+    while(cnt < maxcnt && zero_pool_cnt < ZERO_POOL_SIZE){
+        preempt_disable();
+        pp = buddy_alloc(0);
+        if(pp == NULL){
+            preempt_enable();
+            break;
         }
+        
+        frametab[pageptr_to_frame(pp)].type = PAGE_TYPE_ZERO;
+        memset(pp, 0, PAGE_SIZE);
+        zero_pool[zero_pool_cnt++] = pp;
+        preempt_enable();
+        cnt++;
     }
+
+    return cnt;
+}
+
+
+
+/**memory_carve_free_blocks
+ * 
+ * Links up to maxcnt blocks of the untouched tail of RAM onto the buddy free
+ * lists. Called by the idle thread; allocations carve blocks on their own
+ * when the free lists are empty, so this only moves work out of their way.
+ * 
+ * Input: maxcnt - maximum number of blocks to link
+ * Output: the number of blocks linked, 0 once all of RAM is on the free lists
+ */
+int memory_carve_free_blocks(int maxcnt){
+    int cnt = 0;
+
+    preempt_disable();
+    while(cnt < maxcnt && bump_carve())
+        cnt++;
+    preempt_enable();
+    
+    return cnt;
+}
+
+
+
+/**memory_free_pages
+ * 
+ * Return a block of 2^order pages to the buddy allocator. The block must have
+ * been allocated by memory_alloc_pages with the same order. The block is
+ * merged with its free buddy, repeatedly, up to BUDDY_MAX_ORDER.
+ * 
+ * Input: pp - a pointer to the first page of the block
+ *        order - the order the block was allocated with
+ * output: none
+ */
+void memory_free_pages(void * pp, int order){
+    trace("%s(pp=%p,order=%d)", __func__, pp, order);
+    const size_t frame = pageptr_to_frame(pp);
+    preempt_disable();
+    for(size_t i = 0; i < (1UL << order); i++){
+        frametab[frame + i].refcnt = 0;
+        frametab[frame + i].type = PAGE_TYPE_FREE;
+    }
+    buddy_free(frame, order);
+    preempt_enable();
 }
 
 
 
 /**memory_alloc_page
  * 
- * Allocate a physical page of memory using the free pages list.
+ * Allocate a physical page of memory using the buddy allocator.
  * Returns the virtual address of the direct mapped page as a void*.
  * Panics if there are no free pages available.
- * ezheap.c will call this function when the heap is full.
+ * The slab allocator (slab.c) takes its slabs from here.
  * 
  * Input: none
  * Output: a void* ptr, which is the virtual addr of the direct mapped page
  */
 void * memory_alloc_page(void){
-    trace("%s()", __func__);
-    if(free_list == NULL){
-        panic("No free page available");
+    return memory_alloc_pages(0);
+}
+
+
+
+/**memory_alloc_page_at
+ * 
+ * Allocate the physical page at pp if it is free. The free block containing
+ * the page is taken off its free list and split, and the halves not holding
+ * the page go back on the lists. A page in the untouched tail of RAM is
+ * carved first.
+ * 
+ * Input: pp - the direct-mapped address of the page
+ * Output: pp, or NULL if the page is not free
+ */
+void * memory_alloc_page_at(void * pp){
+    const size_t frame = pageptr_to_frame(pp);
+    size_t head = frame;
+    int k;
+
+    trace("%s(pp=%p)", __func__, pp);
+
+    if(NFRAME <= frame)
+        return NULL;
+    
+    preempt_disable();
+
+    while(bump_frame <= frame && bump_carve())
+        continue;
+
+    // A free block is aligned to its size, so the only candidate head of
+    // order k is the frame rounded down to a multiple of 2^k.
+
+    for(k = 0; k <= BUDDY_MAX_ORDER; k++){
+        head = frame & ~((1UL << k) - 1);
+        if((frametab[head].flags & PAGE_FLAG_BUDDY) &&
+            frametab[head].order == k)
+        {
+            break;
+        }
     }
-    void* alloc_page = (void*)free_list;
-    free_list = free_list->next;
-    return alloc_page;
+
+    if(BUDDY_MAX_ORDER < k){
+        preempt_enable();
+        return NULL;
+    }
+    
+    free_area_remove(frame_to_pageptr(head), k);
+
+    while(0 < k){
+        k--;
+        if(head + (1UL << k) <= frame){
+            free_area_insert(frame_to_pageptr(head), k);
+            head += 1UL << k;
+        } else
+            free_area_insert(frame_to_pageptr(head + (1UL << k)), k);
+    }
+
+    frametab[frame].refcnt = 1;
+    frametab[frame].type = PAGE_TYPE_KERNEL;
+    preempt_enable();
+    return pp;
 }
 
 
 /**memory_free_page
  * 
- * Return a physical memory page to the physical page allocator (freepageslist).
+ * Return a physical memory page to the physical page allocator.
  * The page must have been previously allocated by memory_alloc_page.
  * 
  * Input: pp - a pointer to a page
  * output: none
  */
 void memory_free_page(void * pp){
-    trace("%s(pp=%p)", __func__, pp);
-    union linked_page* free_page = (union linked_page*) pp;
-    free_page->next = free_list;
-    free_list = free_page;
+    memory_free_pages(pp, 0);
+}
+
+
+
+/**memory_free_blocks
+ * 
+ * Returns the number of free blocks of exactly 2^order pages. Used to
+ * measure fragmentation.
+ * 
+ * Input: order - the block order to count
+ * Output: the number of free blocks on that order's list
+ */
+size_t memory_free_blocks(int order){
+    union linked_page* page;
+    size_t cnt = 0;
+
+    if(order < 0 || BUDDY_MAX_ORDER < order)
+        return 0;
+
+    for(page = free_area[order]; page != NULL; page = page->next)
+        cnt++;
+    
+    return cnt;
+}
+
+
+
+/**memory_page
+ * 
+ * Returns the frame descriptor of the physical page containing pp, or NULL if
+ * pp is not an address in RAM.
+ * 
+ * Input: pp - a direct-mapped pointer into a physical page
+ * Output: a pointer to the frame's struct page
+ */
+struct page * memory_page(const void * pp){
+    if(pp < RAM_START || RAM_END <= pp)
+        return NULL;
+    return &frametab[pageptr_to_frame(pp)];
+}
+
+
+
+/**memory_page_get / memory_page_put
+ * 
+ * Add or drop a reference to the frame /pp/, for holders other than the page
+ * tables, such as the page cache. Dropping the last reference frees the frame.
+ */
+void memory_page_get(void * pp){
+    page_ref_inc(pp);
+}
+
+void memory_page_put(void * pp){
+    page_ref_put(pp);
+}
+
+
+
+/**memory_dump_frames
+ * 
+ * Prints how many frames are in use for each owner type, how many frames are
+ * shared by more than one mapping, the ASID allocator state and the buddy free
+ * lists. Meant to be
+ * called from the debugger (see the "frames" command in .gdbinit).
+ * 
+ * Input: none
+ * Output: none
+ */
+void memory_dump_frames(void){
+    size_t counts[PAGE_TYPE_CNT] = { 0 };
+    size_t shared = 0;
+    size_t frame;
+    int order;
+
+    for(frame = 0; frame < NFRAME; frame++){
+        counts[frametab[frame].type]++;
+        if(1 < frametab[frame].refcnt)
+            shared++;
+    }
+
+    kprintf("Frame usage (%zu frames of %zu KB):\n", (size_t)NFRAME, PAGE_SIZE / 1024);
+    for(int type = 0; type < PAGE_TYPE_CNT; type++)
+        kprintf("  %10s: %zu\n", page_type_names[type], counts[type]);
+    kprintf("  %10s: %zu\n", "shared", shared);
+
+    kprintf("Zeroed pool: %d pages, %lu hits, %lu misses\n",
+        zero_pool_cnt, zero_pool_hits, zero_pool_misses);
+    kprintf("ASID generation %lu, %u of %u ASIDs used\n", asid_generation,
+        (unsigned int)asid_next, (unsigned int)asid_limit);
+
+    kprintf("Untouched frames: %zu\n", (size_t)NFRAME - bump_frame);
+    kprintf("Free blocks by order:");
+    for(order = 0; order <= BUDDY_MAX_ORDER; order++)
+        kprintf(" %zu", memory_free_blocks(order));
+    kprintf("\n");
 }
 
 
@@ -504,76 +949,24 @@ void memory_free_page(void * pp){
  * This function takes a pointer to your active root page table and a virtual memory address.
  * It walks down the page table structure using the VPN fields of vma, and
  * if create is non-zero, it will create the appropriate page tables to walk to the leaf page table (”level 0”).
- * It returns a pointer to the page table entry that represents the 4 kB page containing vma.
- * This function will only walk to a 4 kB page, not a megapage or gigapage.
+ * It returns a pointer to the page table entry that represents the page containing vma.
+ * Without create, this is the megapage leaf if vma is mapped by a megapage.
+ * With create set, a megapage on the way is split into 4 kB pages, so the
+ * returned entry is always a level 0 entry. It may be invalid; no page is
+ * allocated for it and the caller is expected to fill it in.
  * 
  * Input: root - ptr to the root table
  *        vma  - the virtual memory address
  *        create - specify whether to create a new page table entry or not
- * Output: a ptr to a leaf pte
- * ASSUMPTION: the vma will be translated to the address of a 4kB page
+ * Output: a ptr to a leaf pte, or NULL if create is zero and vma is unmapped
  */
 struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
     trace("%s(root=%p,vma=%p,create=%d)", __func__, root, vma, create);
-    // get all indices for translation
-    uintptr_t vpn2 = VPN2(vma);
-    uintptr_t vpn1 = VPN1(vma);
-    uintptr_t vpn0 = VPN0(vma);
-
-    // root page table
-    // check the flags to see if valid
-    uint64_t flags2 = root[vpn2].flags;
-    if(!(flags2 & PTE_V)){
-        // if not allowed to create PTE, panic
-        if (!create){
-            if(flags2&(PTE_R|PTE_W|PTE_X)){
-                panic("Invalid PTE at root page table");
-            }
-            return NULL;
-        }
-        // allowed, create
-        struct pte* curr_pt1 = memory_alloc_page();
-        memset(curr_pt1, 0, PAGE_SIZE);
-        root[vpn2] = ptab_pte(curr_pt1, 0); // all flags except PTE_V are set to 0
-    }
-
-    // level-1 page table
-    // Now root PTE is valid. Get level-1 PTE.
-    struct pte* pt1 = pagenum_to_pageptr(root[vpn2].ppn);
-    uint64_t flags1 = pt1[vpn1].flags;
-    if(!(flags1 & PTE_V)){
-        // if not allowed to create PTE, panic
-        if (!create){
-            if(flags1&(PTE_R|PTE_W|PTE_X)){
-                panic("Invalid PTE at root page table");
-            }
-            return NULL;
-        }
-        // allowed, create
-        struct pte* curr_pt0 = memory_alloc_page();
-        memset(curr_pt0, 0, PAGE_SIZE);
-        pt1[vpn1] = ptab_pte(curr_pt0, 0); // all flags except PTE_V are set to 0
-    }
-
-    // level-0 page table
-    struct pte* pt0 = pagenum_to_pageptr(pt1[vpn1].ppn);
-    uint64_t flags0 = pt0[vpn0].flags;
-    if(!(flags0 & PTE_V)){
-        // if not allowed to create PTE, panic
-        if (!create){
-            if(flags2&(PTE_R|PTE_W|PTE_X)){
-                panic("Invalid PTE at root page table");
-            }
-            return NULL;
-        }
-        // allowed, create a new page
-        void* page = memory_alloc_page();
-        memset(page, 0, PAGE_SIZE);
-        pt0[vpn0] = leaf_pte(page, 0); // all flags set to 0
-    }
+    struct pte* leaf = walk_pt_level(root, vma, 0, create, NULL);
 
-    // leaf pte
-    struct pte* leaf = &pt0[vpn0];
+    // without create, only valid leaves are returned
+    if(!create && leaf != NULL && !(leaf->flags & PTE_V))
+        return NULL;
 
     return leaf;
 }
@@ -582,7 +975,7 @@ struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
 
 /**memory_alloc_and_map_page
  * 
- * Allocate a single physical page and maps a virtual address to it with provided flags.
+ * Allocate a single zero-filled physical page and maps a virtual address to it with provided flags.
  * Returns the mapped virtual memory address.
  * 
  * Input: vma - the virtual memory address
@@ -592,7 +985,8 @@ struct pte* walk_pt(struct pte* root, uintptr_t vma, int create){
 void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
     trace("%s(vma=%p, rwxug_flags=%x)", __func__, vma, rwxug_flags);
     // allocate new page
-    uintptr_t new_page = (uintptr_t)memory_alloc_page();
+    uintptr_t new_page = (uintptr_t)memory_alloc_zeroed_page();
+    memory_page((void*)new_page)->type = PAGE_TYPE_USER;
     // get the root
     struct pte* root = active_space_root();
 
@@ -600,7 +994,34 @@ void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
     int create = 1; // a non-zero value meaning to create a new entry
     struct pte* new_entry = walk_pt(root, vma, create);
     *new_entry = leaf_pte((void*)new_page, rwxug_flags);
-    sfence_vma();
+    sfence_vma_addr(vma);
+
+    return (void*)vma;
+}
+
+
+
+/**memory_map_shared_page
+ * 
+ * Maps an existing physical page at a virtual address, e.g. a page cache
+ * frame of a mapped file. The caller's reference to the page becomes the
+ * reference of the mapping. A page mapped with the W flag is mapped read-only
+ * and copy-on-write, so that stores go to a private copy and never reach the
+ * shared frame.
+ * 
+ * Input: vma - the virtual memory address
+ *        pp - the physical page
+ *        rwxug_flags - the provided flags
+ * Output: the virtual memory address
+ */
+void * memory_map_shared_page(uintptr_t vma, void * pp, uint_fast8_t rwxug_flags){
+    trace("%s(vma=%p, pp=%p, rwxug_flags=%x)", __func__, vma, pp, rwxug_flags);
+    struct pte* leaf = walk_pt(active_space_root(), vma, 1);
+
+    *leaf = leaf_pte(pp, rwxug_flags & ~PTE_W);
+    if(rwxug_flags & PTE_W)
+        leaf->rsw |= PTE_RSW_COW;
+    sfence_vma_addr(vma);
 
     return (void*)vma;
 }
@@ -619,8 +1040,20 @@ void * memory_alloc_and_map_page(uintptr_t vma, uint_fast8_t rwxug_flags){
  */
 void * memory_alloc_and_map_range(uintptr_t vma, size_t size, uint_fast8_t rwxug_flags){
     trace("%s(vma=%p, size=%d, rwxug_flags=%x)", __func__, vma, size, rwxug_flags);
-    for(void* _vp = (void*) vma; _vp < (void*)(vma + size); _vp += PAGE_SIZE){
-        _vp = memory_alloc_and_map_page((uintptr_t)_vp, rwxug_flags); // _vp does not change
+    const uintptr_t end = round_up_addr(vma + size, PAGE_SIZE);
+    uintptr_t _vp = round_down_addr(vma, PAGE_SIZE);
+
+    while(_vp < end){
+        // 2 MB aligned parts of the range get a megapage when one is free
+        if(USER_MEGAPAGES && _vp % MEGA_SIZE == 0 && MEGA_SIZE <= end - _vp &&
+            memory_map_megapage(_vp, rwxug_flags))
+        {
+            _vp += MEGA_SIZE;
+        }
+        else{
+            memory_alloc_and_map_page(_vp, rwxug_flags);
+            _vp += PAGE_SIZE;
+        }
     }
 
     return (void*)vma;
@@ -628,10 +1061,50 @@ void * memory_alloc_and_map_range(uintptr_t vma, size_t size, uint_fast8_t rwxug
 
 
 
+/**memory_map_megapage
+ * 
+ * Maps a new 2 MB megapage at vma if nothing in [vma,vma+MEGA_SIZE) is mapped
+ * yet and the page allocator has a free 2 MB block. The contents of the
+ * megapage are not initialized.
+ * 
+ * Input: vma - a megapage-aligned virtual memory address
+ *        rwxug_flags - the provided flags
+ * Output: 1 if the megapage was mapped, 0 otherwise
+ */
+int memory_map_megapage(uintptr_t vma, uint_fast8_t rwxug_flags){
+    trace("%s(vma=%p, rwxug_flags=%x)", __func__, vma, rwxug_flags);
+    struct pte* slot;
+    void* pp;
+    size_t n;
+
+    if(BUDDY_MAX_ORDER < MEGA_ORDER || vma % MEGA_SIZE != 0)
+        return 0;
+    
+    // a valid entry is either a megapage or a table with some pages mapped
+    slot = walk_pt_level(active_space_root(), vma, 1, 1, NULL);
+    if(slot->flags & PTE_V)
+        return 0;
+
+    preempt_disable();
+    pp = buddy_alloc(MEGA_ORDER);
+    preempt_enable();
+    if(pp == NULL)
+        return 0;
+
+    for(n = 0; n < leaf_frames(1); n++)
+        frametab[pageptr_to_frame(pp) + n].type = PAGE_TYPE_USER;
+
+    *slot = leaf_pte(pp, rwxug_flags);
+    sfence_vma_addr(vma);
+    return 1;
+}
+
+
+
 /**memory_set_page_flags
  * 
- * Sets the flags of the PTE associated with vp.
- * Only works with 4kB pages.
+ * Sets the flags of the PTE associated with vp. A megapage containing vp is
+ * split first, so that only the 4 kB page changes.
  * 
  * Input: vp - a virtual pointer to a virtual page
  *        rwxug_flags - the provided flags
@@ -639,13 +1112,8 @@ void * memory_alloc_and_map_range(uintptr_t vma, size_t size, uint_fast8_t rwxug
  */
 void memory_set_page_flags(const void* vp, uint8_t rwxug_flags){
     trace("%s(vp=%p, rwxug_flags=%x)", __func__, vp, rwxug_flags);
-    // get the root
-    struct pte * root = active_space_root();
-    // get the leaf entry
-    int create = 1; // create new page if needed
-    struct pte* leaf_entry = walk_pt(root, (uintptr_t)vp, create);
-    leaf_entry->flags = rwxug_flags | PTE_A | PTE_D | PTE_V;
-    sfence_vma();
+    // only change pages that are mapped
+    memory_set_range_flags(vp, PAGE_SIZE, rwxug_flags);
 }
 
 
@@ -661,28 +1129,36 @@ void memory_set_page_flags(const void* vp, uint8_t rwxug_flags){
  */
 void memory_set_range_flags (const void * vp, size_t size, uint_fast8_t rwxug_flags){
     trace("%s(vma=%p, size=%d, rwxug_flags=%x)", __func__, vp, size, rwxug_flags);
-    for(void* _vp = (void*) vp; _vp < (void*)(vp + size); _vp += PAGE_SIZE){
-        memory_set_page_flags(_vp, rwxug_flags);
-    }
+    uintptr_t start = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    uintptr_t end = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
 
-    return;
+    visit_pt_range(active_space_root(), 2, 0, start, end,
+        0, set_leaf_flags, &rwxug_flags);
+    sfence_vma_range(start, end);
 }
 
 
-/**valid_check_pt
+
+/**memory_unmap_and_free_range
  * 
- * Check if a page table contains any valid PTE.
+ * Unmaps and drops the references to all pages in the specified range of
+ * the current memory space. Megapages partially covered by the range are
+ * split first. Page tables left empty are kept until the space is reclaimed:
+ * freeing them would need a flush of the whole ASID, since sfence.vma with an
+ * address need not drop cached non-leaf entries.
  * 
- * Input: a ptr to the page table to be checked
- * Output: 1 for containing valid PTE (V=1), 0 for not
+ * Input: vp - the start of the range, rounded down to a page boundary
+ *        size - the size of the range, rounded up to whole pages
+ * Output: none
  */
-int valid_check_pt(const struct pte* pt){
-    for(unsigned i=0; i<PTE_CNT; i++){
-        if(!(pt[i].flags & PTE_V))
-            return 0;
-    }
-
-    return 1;
+void memory_unmap_and_free_range(void * vp, size_t size){
+    trace("%s(vp=%p, size=%zu)", __func__, vp, size);
+    uintptr_t start = round_down_addr((uintptr_t)vp, PAGE_SIZE);
+    uintptr_t end = round_up_addr((uintptr_t)vp + size, PAGE_SIZE);
+
+    visit_pt_range(active_space_root(), 2, 0, start, end,
+        0, unmap_leaf, NULL);
+    sfence_vma_range(start, end);
 }
 
 
@@ -690,7 +1166,8 @@ int valid_check_pt(const struct pte* pt){
 /**memory_unmap_and_free_user
  * 
  * Unmaps and frees ALL user space pages (that is, all pages with
- * the U flag asserted) in the current memory space.
+ * the U flag asserted) in the current memory space. Page tables left
+ * empty are freed as well.
  * 
  * Input: none
  * Output: none
@@ -699,20 +1176,12 @@ void memory_unmap_and_free_user(void){
     // get the root
     struct pte* root = active_space_root();
 
-    // loop through the user address space
-    for(uintptr_t vma = USER_START_VMA; vma < USER_END_VMA; vma += PAGE_SIZE){
-        struct pte* leaf_pte=walk_pt(root,vma,0);
-        if(!leaf_pte) // invalid
-            continue;
-        else{
-            void* pp = pagenum_to_pageptr(leaf_pte->ppn);
-            memory_free_page(pp);
-            *leaf_pte=null_pte();
-        }
-   }
+    // visit the populated part of the user address space
+    visit_pt_range(root, 2, 0, USER_START_VMA, USER_END_VMA,
+        1, unmap_leaf, NULL);
    
-   // flush
-   sfence_vma();
+    // flush the user mappings of this space
+    sfence_vma_asid(active_asid());
 }
 
 
@@ -734,9 +1203,9 @@ int memory_validate_vptr_len (const void * vp, size_t len, uint_fast8_t rwxug_fl
     // get the root
     struct pte* root = active_space_root();
     const void* end = vp + len;
-    for(const void* vma = vp; vma < end; vma += PAGE_SIZE){
+    for(const void* vma = round_down_ptr((void*)vp, PAGE_SIZE); vma < end; vma += PAGE_SIZE){
         // get the leaf entry
-        struct pte* leaf = walk_pt(root, (uintptr_t)vma, 0); // 0: does not create any page table entry
+        struct pte* leaf = walk_user_pt(root, (uintptr_t)vma);
         // if entry invalid, return -1
         if(!leaf){
             return -1;
@@ -768,12 +1237,10 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
     // get the root
     struct pte* root = active_space_root();
     const void* vp = vs;
-    char* pma; // contains physical memory address of the string
+    const char* pma; // the character just validated
 
     do{
-        uintptr_t offset = (uintptr_t)vp & (0xFFF);
-
-        struct pte* leaf = walk_pt(root, (uintptr_t)vp, 0); // 0 for not create new pte
+        struct pte* leaf = walk_user_pt(root, (uintptr_t)vp);
         if(!leaf){
             return -1;
         }
@@ -784,8 +1251,8 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
         if (!(leaf->flags & ug_flags))
             return -1;
         
-        uintptr_t page = (uintptr_t)pagenum_to_pageptr((uintptr_t)leaf->ppn);
-        pma = (char*)(page + offset);
+        // the page is mapped and SUM is set, so read the character in place
+        pma = vp;
         vp++;
     } while(strcmp(pma, "\0"));
     
@@ -805,19 +1272,99 @@ int memory_validate_vstr (const char * vs, uint_fast8_t ug_flags){
  * Handle a page fault at a virtual address. May choose to panic or to allocate a new page, 
  * depending on if the address is within the user region.
  * You must call this function when a store page fault is triggered by a user program.
+ * A store to a copy-on-write page gets a private copy of that page. A fault on
+ * any other mapped page is a permission violation.
+ * Output: 0 if the fault was resolved and the access can be retried, or a
+ * negative error code (-EACCESS for a permission violation). The caller
+ * decides what to do with the process then.
  */
-void memory_handle_page_fault(const void * vptr){
+int memory_handle_page_fault(const void * vptr){
     trace("%s(vptr=%p)", __func__, vptr);
     // check if vptr is in the user range
     uintptr_t vma = (uintptr_t)vptr;
     if ((vma >= USER_START_VMA) && vma < USER_END_VMA){
-        // inside the user range, allocate a new page for user
-        memory_alloc_and_map_page(vma, PTE_R | PTE_W | PTE_U);
+        int level;
+        struct pte* leaf = walk_pt_level(active_space_root(), vma, 0, 0, &level);
+        if(leaf != NULL && !(leaf->flags & PTE_V))
+            leaf = NULL;
+        if(leaf == NULL){
+            // not mapped yet: let the area containing it fault it in. Without
+            // a current process, allocate a new page for user.
+            int result = process_load_page(vma);
+            if(result == -EINVAL)
+                memory_alloc_and_map_page(vma, PTE_R | PTE_W | PTE_U);
+            else if(result < 0)
+                return result;
+        }
+        else if(leaf->rsw & PTE_RSW_COW){
+            // first store to a page shared by fork
+            handle_cow_fault(leaf, level, vma);
+        }
+        else{
+            // mapped, but without the permission the access needs
+            return -EACCESS;
+        }
     }
     else{
         kprintf("vma = %p", vma);
         panic("Page fault: virtual address not in user range");
     }
+
+    return 0;
+}
+
+
+/**copy_from_user
+ * 
+ * Copies /n/ bytes from the user buffer /usrc/ to the kernel buffer /kdst/.
+ * The user buffer is not validated beforehand: a page that is not mapped yet
+ * is faulted in by the page fault handler during the copy, and an access it
+ * cannot resolve is caught through the exception table (see uaccess.s).
+ * Output: 0 on success, -EFAULT if the user buffer is outside the user range
+ * or not readable. On -EFAULT, /kdst/ may have been partially written.
+ */
+long copy_from_user(void * kdst, const void * usrc, size_t n){
+    trace("%s(kdst=%p,usrc=%p,n=%zu)", __func__, kdst, usrc, n);
+    if (!user_range_ok(usrc, n))
+        return -EFAULT;
+    
+    return (_copy_user(kdst, usrc, n) == 0) ? 0 : -EFAULT;
+}
+
+
+/**copy_to_user
+ * 
+ * Copies /n/ bytes from the kernel buffer /ksrc/ to the user buffer /udst/.
+ * Stores to copy-on-write pages are resolved by the page fault handler as
+ * usual.
+ * Output: 0 on success, -EFAULT if the user buffer is outside the user range
+ * or not writable. On -EFAULT, /udst/ may have been partially written.
+ */
+long copy_to_user(void * udst, const void * ksrc, size_t n){
+    trace("%s(udst=%p,ksrc=%p,n=%zu)", __func__, udst, ksrc, n);
+    if (!user_range_ok(udst, n))
+        return -EFAULT;
+    
+    return (_copy_user(udst, ksrc, n) == 0) ? 0 : -EFAULT;
+}
+
+
+/**memory_exception_fixup
+ * 
+ * Looks up the kernel instruction at /pc/ in the exception table built from
+ * the __ex_table sections (see kernel.ld).
+ * Output: the address to resume at if the instruction is allowed to fault on
+ * a user address, 0 otherwise.
+ */
+uintptr_t memory_exception_fixup(uintptr_t pc){
+    const struct exception_table_entry * ent;
+
+    for (ent = _ex_table_start; ent < _ex_table_end; ent++) {
+        if (ent->insn == pc)
+            return ent->fixup;
+    }
+
+    return 0;
 }
 
 
@@ -917,3 +1464,483 @@ static inline struct pte null_pte(void) {
 static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
+
+// Flushes the translation of /vma/ in the active space. Global (kernel)
+// mappings are not affected. Other harts flush later (see tlb_mark_stale).
+
+static inline void sfence_vma_addr(uintptr_t vma) {
+    preempt_disable();
+    asm inline ("sfence.vma %0, %1" :: "r" (vma), "r" (active_asid()) : "memory");
+    tlb_mark_stale();
+    preempt_enable();
+}
+
+// Flushes all non-global translations tagged with /asid/, which must be the
+// ASID of the active space.
+
+static inline void sfence_vma_asid(uint_fast16_t asid) {
+    preempt_disable();
+    asm inline ("sfence.vma zero, %0" :: "r" (asid) : "memory");
+    tlb_mark_stale();
+    preempt_enable();
+}
+
+// Marks the translations of the active space in the TLB of every other hart
+// as stale; memory_space_switch flushes them. Called right after a flush on
+// this hart, with preemption disabled in between, so that if the thread moved
+// to another hart since it changed the page tables, the flush was there.
+
+static inline void tlb_mark_stale(void) {
+    const size_t root_frame = pageptr_to_frame(active_space_root());
+
+    frametab[root_frame].tlb_stale = (uint8_t)~(1U << running_hart());
+}
+
+// Flushes the translations of [start,end) in the active space, page by page if
+// the range is small, otherwise the whole ASID.
+
+static void sfence_vma_range(uintptr_t start, uintptr_t end) {
+    if ((end - start) / PAGE_SIZE <= SFENCE_PAGES_MAX) {
+        for (; start < end; start += PAGE_SIZE)
+            sfence_vma_addr(start);
+    } else
+        sfence_vma_asid(active_asid());
+}
+
+static inline uint_fast16_t active_asid(void) {
+    return (csrr_satp() >> RISCV_SATP_ASID_shift) & 0xFFFF;
+}
+
+// Assigns the next free ASID to the space whose root table is in frame
+// /root_frame/. Starts a new generation if the ASIDs have run out. Returns 1
+// if the caller must flush the TLB after switching to the space, which is the
+// case after a rollover: entries tagged with the active ASID may be created
+// until satp changes.
+
+static int asid_alloc(size_t root_frame) {
+    int rollover = 0;
+
+    if (asid_next == asid_limit) {
+        memset(asid_owner, 0, sizeof(asid_owner));
+        asid_next = 1;
+        asid_generation++;
+        rollover = 1;
+        sfence_vma();
+    }
+
+    // No hart has used the ASID in this generation
+
+    asid_owner[asid_next] = root_frame;
+    frametab[root_frame].asid = asid_next++;
+    frametab[root_frame].tlb_stale = 0;
+    return rollover;
+}
+
+// Walks the page table rooted at /root/ down to the entry at /level/ for /vma/.
+// A larger leaf above /level/ ends the walk and is returned, unless /create/ is
+// set, in which case it is split so that the walk continues. Missing tables are
+// created if /create/ is set; otherwise NULL is returned. The level of the
+// returned entry is stored in *levelptr if /levelptr/ is not NULL.
+
+static struct pte * walk_pt_level (
+    struct pte * root, uintptr_t vma, int level, int create, int * levelptr)
+{
+    struct pte * pt = root;
+    struct pte * pte;
+    struct pte * subpt;
+    int lvl;
+
+    for (lvl = 2; ; lvl--) {
+        pte = &pt[VPN(vma, lvl)];
+
+        if (lvl == level)
+            break;
+
+        if (pte->flags & PTE_V) {
+            if (pte->flags & (PTE_R | PTE_W | PTE_X)) {
+                if (!create)
+                    break;
+                split_leaf(pte, lvl);
+            }
+        } else {
+            if (!create)
+                return NULL;
+            subpt = memory_alloc_zeroed_page();
+            memory_page(subpt)->type = PAGE_TYPE_PTAB;
+            *pte = ptab_pte(subpt, 0); // all flags except PTE_V are set to 0
+        }
+
+        pt = pagenum_to_pageptr(pte->ppn);
+    }
+
+    if (levelptr != NULL)
+        *levelptr = lvl;
+    
+    return pte;
+}
+
+// Replaces the leaf /pte/ at /level/ by a table of leaves one level down that
+// map the same frames with the same flags, e.g. a megapage by 512 4 kB pages.
+// The frame references are unchanged: each frame already holds its own.
+
+static void split_leaf(struct pte * pte, int level) {
+    struct pte * const subpt = memory_alloc_page();
+    const size_t step = leaf_frames(level-1);
+
+    assert (!(pte->flags & PTE_G));
+
+    memory_page(subpt)->type = PAGE_TYPE_PTAB;
+
+    for (size_t i = 0; i < PTE_CNT; i++) {
+        subpt[i] = *pte;
+        subpt[i].ppn = pte->ppn + i * step;
+    }
+
+    // The translation is unchanged, so cached entries for the old leaf
+    // remain correct until the caller changes one of the new leaves and
+    // flushes it.
+    *pte = ptab_pte(subpt, 0);
+}
+
+// Number of 4 kB frames mapped by a leaf at /level/.
+
+static inline size_t leaf_frames(int level) {
+    return (size_t)1 << (9 * level);
+}
+
+// Visits every valid leaf PTE mapping an address in [start,end) in the page
+// table /pt/ at /level/, whose first entry maps /base/. Invalid entries are
+// skipped without descending, so the cost is proportional to the number of
+// populated page tables rather than to the size of the range. A megapage only
+// partly inside the range is split into 4 kB pages first, so /fn/ only sees
+// leaves that lie wholly inside [start,end). If /free_tables/ is non-zero,
+// non-global subtables left empty after the visit are freed.
+
+static void visit_pt_range (
+    struct pte * pt, int level, uintptr_t base,
+    uintptr_t start, uintptr_t end, int free_tables,
+    pte_visit_fn fn, void * aux)
+{
+    const uintptr_t span = (uintptr_t)PAGE_SIZE << (9 * level);
+    struct pte * subpt;
+    uintptr_t vma;
+    size_t i;
+
+    i = (start <= base) ? 0 : (start - base) / span;
+
+    for (; i < PTE_CNT; i++) {
+        vma = base + i * span;
+
+        if (end <= vma)
+            break;
+
+        if (!(pt[i].flags & PTE_V))
+            continue;
+
+        if (pt[i].flags & (PTE_R | PTE_W | PTE_X)) {
+            if (level == 0 || (start <= vma && vma + span <= end)) {
+                fn(&pt[i], vma, level, aux);
+                continue;
+            }
+
+            split_leaf(&pt[i], level);
+        }
+
+        // Pointer to the next level table. The kernel's global tables are
+        // never visited; the user range does not overlap them.
+
+        if (level == 0 || (pt[i].flags & PTE_G))
+            continue;
+
+        subpt = pagenum_to_pageptr(pt[i].ppn);
+        visit_pt_range(subpt, level-1, vma, start, end, free_tables, fn, aux);
+
+        if (free_tables && pt_empty(subpt)) {
+            pt[i] = null_pte();
+            memory_free_page(subpt);
+        }
+    }
+}
+
+static int pt_empty(const struct pte * pt) {
+    for (size_t i = 0; i < PTE_CNT; i++) {
+        if (pt[i].flags & PTE_V)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Shares a leaf of the active space with the space whose root is /aux/.
+// Writable pages become read-only copy-on-write pages in both spaces.
+
+static void clone_leaf(struct pte * leaf, uintptr_t vma, int level, void * aux) {
+    struct pte * const new_root = aux;
+
+    if (leaf->flags & PTE_W) {
+        leaf->flags &= ~PTE_W;
+        leaf->rsw |= PTE_RSW_COW;
+    }
+
+    *walk_pt_level(new_root, vma, level, 1, NULL) = *leaf;
+
+    // every frame of a megapage carries its own reference, so that the two
+    // spaces can later split it independently
+    for (size_t n = 0; n < leaf_frames(level); n++)
+        page_ref_inc(pagenum_to_pageptr(leaf->ppn + n));
+}
+
+static void unmap_leaf(struct pte * leaf, uintptr_t vma, int level, void * aux) {
+    for (size_t n = 0; n < leaf_frames(level); n++)
+        page_ref_put(pagenum_to_pageptr(leaf->ppn + n));
+
+    *leaf = null_pte();
+}
+
+static void reclaim_leaf(struct pte * leaf, uintptr_t vma, int level, void * aux) {
+    void * page;
+    const struct page * desc;
+
+    for (size_t n = 0; n < leaf_frames(level); n++) {
+        page = pagenum_to_pageptr(leaf->ppn + n);
+        desc = memory_page(page);
+
+        if (desc != NULL && (desc->type == PAGE_TYPE_USER ||
+            desc->type == PAGE_TYPE_CACHE))
+        {
+            page_ref_put(page);
+        }
+    }
+    
+    *leaf = null_pte();
+}
+
+static void set_leaf_flags(struct pte * leaf, uintptr_t vma, int level, void * aux) {
+    set_pte_flags(leaf, *(const uint_fast8_t *)aux);
+}
+
+// Changes the permissions of a valid leaf. A copy-on-write page stays
+// read-only when W is requested; the fault handler grants W on the first store.
+
+static void set_pte_flags(struct pte * leaf, uint_fast8_t rwxug_flags) {
+    if (leaf->rsw & PTE_RSW_COW) {
+        if (rwxug_flags & PTE_W)
+            rwxug_flags &= ~PTE_W;
+        else
+            leaf->rsw &= ~PTE_RSW_COW;
+    }
+
+    leaf->flags = rwxug_flags | PTE_A | PTE_D | PTE_V;
+}
+
+static inline size_t pageptr_to_frame(const void * pp) {
+    return ((uintptr_t)pp - RAM_START_PMA) / PAGE_SIZE;
+}
+
+static inline void * frame_to_pageptr(size_t frame) {
+    return RAM_START + frame * PAGE_SIZE;
+}
+
+// Removes a block of at least 2^order pages from the free lists, splitting a
+// larger block if needed. Returns NULL if no such block exists. Every frame of
+// the returned block starts with one reference.
+
+static void * buddy_alloc(int order) {
+    union linked_page * block;
+    size_t frame;
+    int k;
+
+    assert (0 <= order && order <= BUDDY_MAX_ORDER);
+
+    for (;;) {
+        for (k = order; k <= BUDDY_MAX_ORDER; k++) {
+            if (free_area[k] != NULL)
+                break;
+        }
+
+        if (k <= BUDDY_MAX_ORDER)
+            break;
+        
+        if (!bump_carve())
+            return NULL;
+    }
+    
+    block = free_area[k];
+    free_area_remove(block, k);
+
+    // Return the upper halves to the free lists until the block has the
+    // requested size.
+
+    while (order < k) {
+        k--;
+        free_area_insert((void*)block + (PAGE_SIZE << k), k);
+    }
+
+    frame = pageptr_to_frame(block);
+    for (size_t i = 0; i < (1UL << order); i++) {
+        frametab[frame + i].refcnt = 1;
+        frametab[frame + i].type = PAGE_TYPE_KERNEL;
+    }
+
+    return block;
+}
+
+// Links the largest naturally aligned block at the front of the untouched
+// region onto the free lists. Returns 0 if the region is empty.
+
+static int bump_carve(void) {
+    int order = BUDDY_MAX_ORDER;
+
+    if (bump_frame == NFRAME)
+        return 0;
+    
+    while (bump_frame % (1UL << order) != 0 ||
+        NFRAME < bump_frame + (1UL << order))
+    {
+        order--;
+    }
+
+    free_area_insert(frame_to_pageptr(bump_frame), order);
+    bump_frame += 1UL << order;
+    return 1;
+}
+
+// Puts a block back on the free lists, merging it with its buddy for as long as
+// the buddy is free and of the same order.
+
+static void buddy_free(size_t frame, int order) {
+    size_t buddy;
+
+    assert (0 <= order && order <= BUDDY_MAX_ORDER);
+    assert (!(frametab[frame].flags & PAGE_FLAG_BUDDY));
+
+    while (order < BUDDY_MAX_ORDER) {
+        buddy = frame ^ (1UL << order);
+
+        if (NFRAME <= buddy || !(frametab[buddy].flags & PAGE_FLAG_BUDDY) ||
+            frametab[buddy].order != order)
+        {
+            break;
+        }
+
+        free_area_remove(frame_to_pageptr(buddy), order);
+
+        if (buddy < frame)
+            frame = buddy;
+        order++;
+    }
+
+    free_area_insert(frame_to_pageptr(frame), order);
+}
+
+static void free_area_insert(union linked_page * page, int order) {
+    page->prev = NULL;
+    page->next = free_area[order];
+    if (page->next != NULL)
+        page->next->prev = page;
+    free_area[order] = page;
+    frametab[pageptr_to_frame(page)].flags |= PAGE_FLAG_BUDDY;
+    frametab[pageptr_to_frame(page)].order = order;
+}
+
+static void free_area_remove(union linked_page * page, int order) {
+    if (page->prev != NULL)
+        page->prev->next = page->next;
+    else
+        free_area[order] = page->next;
+    
+    if (page->next != NULL)
+        page->next->prev = page->prev;
+    
+    frametab[pageptr_to_frame(page)].flags &= ~PAGE_FLAG_BUDDY;
+}
+
+// Reference counts of shared frames are updated by other threads too, so
+// the read-modify-write must not be preempted.
+
+static inline void page_ref_inc(const void * pp) {
+    preempt_disable();
+    frametab[pageptr_to_frame(pp)].refcnt++;
+    preempt_enable();
+}
+
+// Drops one reference to a user page and frees the page when the last mapping
+// of it goes away.
+
+static void page_ref_put(void * pp) {
+    const size_t frame = pageptr_to_frame(pp);
+
+    assert (frametab[frame].refcnt != 0);
+
+    preempt_disable();
+    if (--frametab[frame].refcnt == 0)
+        memory_free_page(pp);
+    preempt_enable();
+}
+
+// Like walk_pt(root, vma, 0), but an unmapped user page is first faulted in
+// the way an access from U mode would be, so that pages of the executable not
+// yet read in validate as mapped.
+
+static struct pte * walk_user_pt(struct pte * root, uintptr_t vma) {
+    struct pte * leaf = walk_pt(root, vma, 0);
+
+    if (leaf == NULL && USER_START_VMA <= vma && vma < USER_END_VMA) {
+        if (memory_handle_page_fault((void*)vma) != 0)
+            return NULL;
+        leaf = walk_pt(root, vma, 0);
+    }
+
+    return leaf;
+}
+
+// Checks that [vp,vp+n) lies within the user range without overflowing.
+
+static inline int user_range_ok(const void * vp, size_t n) {
+    const uintptr_t vma = (uintptr_t)vp;
+
+    return (USER_START_VMA <= vma && vma <= USER_END_VMA &&
+            n <= USER_END_VMA - vma);
+}
+
+// Resolves a store to a copy-on-write leaf at /level/ mapping /vma/. If other
+// spaces still map the frame, the store goes to a private copy; if this is the
+// last mapping, the page is simply made writable again. A megapage still
+// shared with another space is split, and only the 4 kB page stored to is
+// copied.
+
+static void handle_cow_fault(struct pte * leaf, int level, uintptr_t vma) {
+    void * old_page = pagenum_to_pageptr(leaf->ppn);
+    const uint_fast8_t rwxug_flags =
+        (leaf->flags & (PTE_R | PTE_X | PTE_U | PTE_G)) | PTE_W;
+    void * new_page;
+    size_t n;
+
+    if (0 < level) {
+        for (n = 0; n < leaf_frames(level); n++) {
+            if (frametab[pageptr_to_frame(old_page) + n].refcnt != 1)
+                break;
+        }
+
+        if (n == leaf_frames(level)) {
+            *leaf = leaf_pte(old_page, rwxug_flags);
+            sfence_vma_addr(vma);
+            return;
+        }
+
+        leaf = walk_pt_level(active_space_root(), vma, 0, 1, NULL);
+        old_page = pagenum_to_pageptr(leaf->ppn);
+    }
+
+    if (frametab[pageptr_to_frame(old_page)].refcnt == 1) {
+        *leaf = leaf_pte(old_page, rwxug_flags);
+    } else {
+        new_page = memory_alloc_page();
+        memory_page(new_page)->type = PAGE_TYPE_USER;
+        memcpy(new_page, old_page, PAGE_SIZE);
+        page_ref_put(old_page);
+        *leaf = leaf_pte(new_page, rwxug_flags);
+    }
+
+    sfence_vma_addr(vma);
+}
@@ -33,6 +33,47 @@
 #define HEAP_INIT_MIN 256
 #endif
 
+// Largest block handed out by the physical page allocator, as log2 of the
+// number of pages. The default is one megapage (2 MB).
+
+#ifndef BUDDY_MAX_ORDER
+#define BUDDY_MAX_ORDER 9
+#endif
+
+// If non-zero, memory_alloc_and_map_range maps the 2 MB aligned parts of a
+// range with megapages when the page allocator has 2 MB blocks free.
+
+#ifndef USER_MEGAPAGES
+#define USER_MEGAPAGES 1
+#endif
+
+// Number of address space identifiers (ASIDs) handed out to memory spaces,
+// including ASID 0 of the main space. Fewer are used if the hart implements
+// fewer. Running out starts a new ASID generation (see memory_space_switch).
+
+#ifndef MEMORY_NASID
+#define MEMORY_NASID 256
+#endif
+
+// Capacity of the pool of pre-zeroed pages, and the number of pages the idle
+// thread zeroes before checking for runnable threads again.
+
+#ifndef ZERO_POOL_SIZE
+#define ZERO_POOL_SIZE 32
+#endif
+
+#ifndef ZERO_POOL_CHUNK
+#define ZERO_POOL_CHUNK 2
+#endif
+
+// Number of max-order blocks of untouched RAM the idle thread links onto the
+// free lists before checking for runnable threads again. Linking a block only
+// writes its first page, so this can be larger than ZERO_POOL_CHUNK.
+
+#ifndef CARVE_CHUNK
+#define CARVE_CHUNK 16
+#endif
+
 // CONSTANT DEFINITIONS
 //
 
@@ -44,6 +85,37 @@
 // EXPORTED TYPE DEFINITIONS
 //
 
+// Owner of a physical frame, recorded in its struct page.
+
+enum page_type {
+    PAGE_TYPE_FREE = 0, // on a buddy free list
+    PAGE_TYPE_KERNEL,   // kernel image or other kernel use
+    PAGE_TYPE_USER,     // mapped into a user memory space
+    PAGE_TYPE_PTAB,     // page table
+    PAGE_TYPE_HEAP,     // kmalloc heap block
+    PAGE_TYPE_STACK,    // kernel thread stack
+    PAGE_TYPE_CACHE,    // file page cache
+    PAGE_TYPE_ZERO,     // in the pre-zeroed page pool
+    PAGE_TYPE_CNT
+};
+
+// struct page flags
+
+#define PAGE_FLAG_BUDDY (1 << 0) // heads a free block of 2^order frames
+#define PAGE_FLAG_CONT  (1 << 1) // continues the kmalloc block of the previous frame
+
+// Frame descriptor. There is one for every 4 kB frame of RAM. The /refcnt/ of
+// a frame is the number of users (mappings) of the frame.
+
+struct page {
+    uint16_t refcnt;
+    uint8_t type; // enum page_type
+    uint8_t flags;
+    uint8_t order; // only meaningful with PAGE_FLAG_BUDDY
+    uint8_t tlb_stale; // root table: harts that must flush the space's ASID
+    uint16_t asid; // only meaningful for the root table of a memory space
+};
+
 // EXPORTED VARIABLE DECLARATIONS
 //
 
@@ -58,22 +130,30 @@ extern uintptr_t main_mtag;
 extern void memory_init(void);
 extern char memory_initialized;
 
+// void memory_hart_init(void)
+// Sets up the paging and SUM state of a hart started after memory_init, which
+// does this for hart 0. Each hart has a TLB of its own: when one hart changes
+// the page tables of a space, the others flush their translations for it the
+// next time they switch to it.
+extern void memory_hart_init(void);
 
 
-// uintptr_t memory_space_create(uint_fast16_t asid)
-// Creates a new memory space and makes it the currently active space. Returns a
-// memory space tag (type uintptr_t) that may be used to refer to the memory
-// space. The created memory space contains the same identity mapping of MMIO
-// address space and RAM as the main memory space. This function never fails; if
-// there are not enough physical memory pages to create the new memory space, it
-// panics.
-extern uintptr_t memory_space_create(uint_fast16_t asid);
 
+// uintptr_t memory_space_create(void)
+// Creates a new memory space. Returns a memory space tag (type uintptr_t) that
+// may be used to refer to the memory space. The created memory space contains
+// the same identity mapping of MMIO address space and RAM as the main memory
+// space. This function never fails; if there are not enough physical memory
+// pages to create the new memory space, it panics.
+extern uintptr_t memory_space_create(void);
 
-// memory_space_clone(uint_fast16_t asid)
+
+// memory_space_clone(void)
 // clone your memory space for current process and return the mtag of the new memory space.
 // Should be used in thread_fork_to_user to setup the memory space for the child process.
-extern uintptr_t memory_space_clone(uint_fast16_t asid);
+// User pages are not copied: both spaces map the same frames, and writable pages
+// are made read-only copy-on-write until one side stores to them.
+extern uintptr_t memory_space_clone(void);
 
 
 
@@ -93,36 +173,121 @@ static inline uintptr_t active_memory_space(void);
 
 // uintptr_t memory_space_switch(uintptr_t mtag)
 // Switches to another memory space and returns the memory space tag of the
-// previously active memory space.
-static inline uintptr_t memory_space_switch(uintptr_t mtag);
+// previously active memory space. Memory spaces are tagged with ASIDs, so the
+// TLB is not flushed; the ASID is assigned by the memory manager and may change
+// over time, so the tag returned by active_memory_space() may differ from
+// /mtag/ in its ASID field.
+extern uintptr_t memory_space_switch(uintptr_t mtag);
+
+
+
+// unsigned long memory_asid_generation(void)
+// Returns the number of ASID generation rollovers so far.
+extern unsigned long memory_asid_generation(void);
+
+
+
+// void * memory_alloc_pages(int order)
+// Allocates 2^order physically contiguous pages, aligned to their size, for
+// 0 <= order <= BUDDY_MAX_ORDER. Returns a pointer to the direct-mapped address
+// of the first page. Does not fail; panics if no such block is available.
+extern void * memory_alloc_pages(int order);
+
+
+
+// void memory_free_pages(void * pp, int order)
+// Returns a block allocated by memory_alloc_pages(order) to the allocator,
+// which coalesces it with free neighboring blocks.
+extern void memory_free_pages(void * pp, int order);
 
 
 
 // void * memory_alloc_page(void)
 // Allocates a physical page of memory. Returns a pointer to the direct-mapped
 // address of the page. Does not fail; panics if there are no free pages available.
+// Equivalent to memory_alloc_pages(0).
 extern void * memory_alloc_page(void);
 
 
 
+// void * memory_alloc_page_at(void * pp)
+// Allocates the page at direct-mapped address pp if it is free, splitting the
+// free block that contains it. Returns pp, or NULL if the page is in use. Used
+// to grow a block of pages in place.
+extern void * memory_alloc_page_at(void * pp);
+
+
+
 // void memory_free_page(void * ptr)
 // Returns a physical memory page to the physical page allocator. The page must
 // have been previously allocated by memory_alloc_page.
 extern void memory_free_page(void * pp);
 
 
+
+// void * memory_alloc_zeroed_page(void)
+// Allocates a zero-filled page, preferably from the pool of pages zeroed ahead
+// of time by the idle thread. Like memory_alloc_page, the page is typed
+// PAGE_TYPE_KERNEL and the function panics if no memory is left.
+extern void * memory_alloc_zeroed_page(void);
+
+// int memory_refill_zero_pool(int maxcnt)
+// Zeroes up to maxcnt free pages for the zeroed page pool. Returns the number
+// of pages added, 0 if the pool is full or no free pages are left.
+extern int memory_refill_zero_pool(int maxcnt);
+
+
+
+// int memory_carve_free_blocks(int maxcnt)
+// Links up to maxcnt blocks of RAM not yet handed to the page allocator onto
+// its free lists. Returns the number of blocks linked, 0 when none are left.
+extern int memory_carve_free_blocks(int maxcnt);
+
+
+
+// size_t memory_free_blocks(int order)
+// Returns the number of free blocks of exactly 2^order pages on the free
+// lists, not counting RAM that memory_init left untouched.
+extern size_t memory_free_blocks(int order);
+
+
+
+// struct page * memory_page(const void * pp)
+// Returns the descriptor of the frame containing the direct-mapped address pp,
+// or NULL if pp is not in RAM. Pages from memory_alloc_page(s) are typed
+// PAGE_TYPE_KERNEL; the caller may change the type to record the owner.
+extern struct page * memory_page(const void * pp);
+
+
+
+// void memory_page_get(void * pp)
+// void memory_page_put(void * pp)
+// Add or drop a reference to the frame /pp/ held outside the page tables (e.g.
+// by the page cache). Dropping the last reference frees the frame.
+extern void memory_page_get(void * pp);
+extern void memory_page_put(void * pp);
+
+
+
+// void memory_dump_frames(void)
+// Prints frame usage by type and the state of the free lists.
+extern void memory_dump_frames(void);
+
+
 // struct pte* walk_pt(struct pte* root, uintptr_t vma, int create)
 // This function takes a pointer to your active root page table and a virtual memory address.
 // It walks down the page table structure using the VPN fields of vma, and
 // if create is non-zero, it will create the appropriate page tables to walk to the leaf page table (”level 0”).
-// It returns a pointer to the page table entry that represents the 4 kB page containing vma.
-// This function will only walk to a 4 kB page, not a megapage or gigapage.
+// It returns a pointer to the page table entry that represents the page containing vma,
+// which is a megapage leaf if vma is mapped by a megapage and create is zero.
+// With create set, megapages on the way are split, so the walk always reaches a
+// 4 kB leaf; it may be invalid and must be filled in by the caller.
 extern struct pte* walk_pt(struct pte* root, uintptr_t vma, int create);
 
 
 // void * memory_alloc_and_map_page (
 //        uintptr_t vma, uint_fast8_t rwxug_flags)
-// Allocates and maps a physical page.
+// Allocates and maps a zero-filled physical page.
 // Maps a virtual page to a physical page in the current memory space. The /vma/
 // argument gives the virtual address of the page to map. The /pp/ argument is a
 // pointer to the physical page to map. The /rwxug_flags/ argument is an OR of
@@ -136,15 +301,36 @@ extern void * memory_alloc_and_map_page (
 
 
 
+// void * memory_map_shared_page (
+//        uintptr_t vma, void * pp, uint_fast8_t rwxug_flags)
+
+// Maps the existing physical page /pp/ at /vma/; the caller's reference to
+// /pp/ passes to the mapping. With the W flag, the page is mapped copy-on-write
+// so that /pp/ itself is never written through this mapping.
+extern void * memory_map_shared_page (
+    uintptr_t vma, void * pp, uint_fast8_t rwxug_flags);
+
+
+
 // void * memory_alloc_and_map_range (
 //        uintptr_t vma, size_t size, uint_fast8_t rwxug_flags)
 
 // Allocates and maps multiple physical pages in an address range. Equivalent to
-// calling memory_alloc_and_map_page for every page in the range.
+// calling memory_alloc_and_map_page for every page in the range, except that
+// 2 MB aligned parts of the range are mapped with megapages where possible.
 extern void * memory_alloc_and_map_range (
     uintptr_t vma, size_t size, uint_fast8_t rwxug_flags);
 
+// int memory_map_megapage(uintptr_t vma, uint_fast8_t rwxug_flags)
+// Maps a new (uninitialized) 2 MB megapage at the megapage-aligned address vma
+// if nothing in the 2 MB range is mapped yet. Returns 1 if the megapage was
+// mapped, or 0 if the range is in use or no 2 MB block is free.
+extern int memory_map_megapage(uintptr_t vma, uint_fast8_t rwxug_flags);
+
 // void memory_unmap_and_free_range(void * vp, size_t size)
+// Unmaps all pages in the range and drops the references to their frames. A
+// frame is freed when no other memory space maps it.
+extern void memory_unmap_and_free_range(void * vp, size_t size);
 
 
 
@@ -154,7 +340,8 @@ extern void memory_unmap_and_free_user(void);
 
 
 // void memory_set_page_flags(const void* vp, uint8_t rwxug_flags)
-// Sets the flags of the PTE associated with vp. Only works with 4kB pages.
+// Sets the flags of the PTE associated with vp. A megapage containing vp is
+// split, so that only the 4 kB page containing vp changes.
 extern void memory_set_page_flags(const void* vp, uint8_t rwxug_flags);
 
 
@@ -189,8 +376,30 @@ extern int memory_validate_vstr (
 
 
 // Called from excp.c to handle a page fault at the specified address. Either
-// maps a page containing the faulting address, or calls process_exit().
-extern void memory_handle_page_fault(const void * vptr);
+// faults in the page through the area of the current process containing the
+// address (see process_load_page), or copies a copy-on-write page on the
+// first store to it.
+// Returns 0 if the fault was resolved, or a negative error code; the caller
+// then terminates the process or applies an exception fixup.
+extern int memory_handle_page_fault(const void * vptr);
+
+
+
+// long copy_from_user(void * kdst, const void * usrc, size_t n)
+// long copy_to_user(void * udst, const void * ksrc, size_t n)
+// Copy /n/ bytes between a kernel buffer and a user buffer in the active memory
+// space. The user buffer need not be validated first: pages are faulted in as
+// they are touched. Return 0 on success or -EFAULT if the user buffer is not
+// entirely accessible, in which case part of the destination may be written.
+extern long copy_from_user(void * kdst, const void * usrc, size_t n);
+extern long copy_to_user(void * udst, const void * ksrc, size_t n);
+
+
+
+// uintptr_t memory_exception_fixup(uintptr_t pc)
+// Returns the fixup address for a kernel instruction at /pc/ that is allowed to
+// fault on a user address (see uaccess.s), or 0 if there is none.
+extern uintptr_t memory_exception_fixup(uintptr_t pc);
 
 
 
@@ -201,8 +410,4 @@ static inline uintptr_t active_memory_space(void) {
     return csrr_satp();
 }
 
-static inline uintptr_t memory_space_switch(uintptr_t mtag) {
-    return csrrw_satp(mtag);
-}
-
 #endif // _MEMORY_H_
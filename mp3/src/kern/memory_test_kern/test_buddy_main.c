@@ -0,0 +1,155 @@
+// main.c - Main function: buddy allocator fragmentation/throughput benchmark
+//
+
+#ifdef MAIN_TRACE
+#define TRACE
+#endif
+
+#ifdef MAIN_DEBUG
+#define DEBUG
+#endif
+
+#include "console.h"
+#include "memory.h"
+#include "halt.h"
+#include "config.h"
+
+#include <stdint.h>
+
+#define NBLOCKS 256 // live blocks in the mixed-order churn test
+#define NROUNDS 4096 // alloc/free operations per timed test
+
+static void * pages[RAM_SIZE / PAGE_SIZE];
+static struct {
+    void * pp;
+    int order;
+} blocks[NBLOCKS];
+
+static inline uint64_t rdtime(void) {
+    uint64_t t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+static size_t free_page_count(void) {
+    size_t cnt = 0;
+    int order;
+
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+        cnt += memory_free_blocks(order) << order;
+    
+    return cnt;
+}
+
+static int largest_free_order(void) {
+    int order;
+
+    for (order = BUDDY_MAX_ORDER; 0 <= order; order--)
+        if (memory_free_blocks(order) != 0)
+            return order;
+    
+    return -1;
+}
+
+void main(void) {
+    uint64_t start, elapsed;
+    uint32_t seed = 391;
+    size_t free_cnt, free0, half, i;
+    void * base;
+    int order;
+
+    console_init();
+    memory_init();
+
+    // Link all of RAM onto the free lists first, so that the counts below
+    // are not skewed by blocks carved on demand during the test.
+
+    while (memory_carve_free_blocks(CARVE_CHUNK) != 0)
+        continue;
+
+    free_cnt = free_page_count();
+    kprintf("buddy: %zu pages free, largest block order %d\n",
+        free_cnt, largest_free_order());
+
+    // Throughput: single-page alloc/free pairs
+
+    start = rdtime();
+    for (i = 0; i < NROUNDS; i++)
+        memory_free_page(memory_alloc_page());
+    elapsed = rdtime() - start;
+    kprintf("order-0 alloc+free: %lu ticks for %d pairs\n",
+        elapsed, NROUNDS);
+
+    // Throughput: random mixed-order churn with up to NBLOCKS live blocks
+
+    start = rdtime();
+    for (i = 0; i < NROUNDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        const size_t slot = (seed >> 8) % NBLOCKS;
+
+        if (blocks[slot].pp != NULL) {
+            memory_free_pages(blocks[slot].pp, blocks[slot].order);
+            blocks[slot].pp = NULL;
+        } else {
+            order = (seed >> 20) % 4;
+            blocks[slot].pp = memory_alloc_pages(order);
+            blocks[slot].order = order;
+        }
+    }
+    elapsed = rdtime() - start;
+    kprintf("mixed order 0-3 churn: %lu ticks for %d operations\n",
+        elapsed, NROUNDS);
+
+    for (i = 0; i < NBLOCKS; i++) {
+        if (blocks[i].pp != NULL)
+            memory_free_pages(blocks[i].pp, blocks[i].order);
+        blocks[i].pp = NULL;
+    }
+
+    // Fragmentation: take half of the free pages one at a time, then free
+    // every other one, which leaves single free pages scattered through the
+    // allocated half. Once the rest is freed, coalescing must restore the
+    // initial free page count and block sizes.
+
+    half = free_page_count() / 2;
+    for (i = 0; i < half; i++)
+        pages[i] = memory_alloc_page();
+    for (i = 0; i < half; i += 2)
+        memory_free_page(pages[i]);
+    
+    kprintf("checkerboard: %zu pages free, largest block order %d\n",
+        free_page_count(), largest_free_order());
+    
+    for (i = 1; i < half; i += 2)
+        memory_free_page(pages[i]);
+    
+    kprintf("after coalescing: %zu pages free, largest block order %d\n",
+        free_page_count(), largest_free_order());
+    
+    if (free_page_count() != free_cnt)
+        panic("buddy: pages lost");
+    
+    // The counts alone do not show that buddies merged back into the blocks
+    // they came from. Free one largest block page by page, every other page
+    // first: the block must come back whole, at the head of its free list.
+
+    base = memory_alloc_pages(BUDDY_MAX_ORDER);
+    free0 = memory_free_blocks(0);
+
+    for (i = 0; i < (1UL << BUDDY_MAX_ORDER); i += 2)
+        memory_free_page(base + i * PAGE_SIZE);
+    
+    if (memory_free_blocks(0) != free0 + (1UL << (BUDDY_MAX_ORDER-1)))
+        panic("buddy: checkerboard pages merged");
+    
+    for (i = 1; i < (1UL << BUDDY_MAX_ORDER); i += 2)
+        memory_free_page(base + i * PAGE_SIZE);
+    
+    if (memory_alloc_pages(BUDDY_MAX_ORDER) != base)
+        panic("buddy: block not coalesced at its base address");
+    
+    memory_free_pages(base, BUDDY_MAX_ORDER);
+    kprintf("order-%d block at %p coalesced\n", BUDDY_MAX_ORDER, base);
+
+    halt_success();
+}
@@ -0,0 +1,106 @@
+// main.c - Main function: time slicing of CPU-bound kernel threads
+//
+
+#ifdef MAIN_TRACE
+#define TRACE
+#endif
+
+#ifdef MAIN_DEBUG
+#define DEBUG
+#endif
+
+#include "console.h"
+#include "memory.h"
+#include "intr.h"
+#include "device.h"
+#include "thread.h"
+#include "timer.h"
+#include "halt.h"
+#include "config.h"
+
+#include <stdint.h>
+
+#define NSPIN 3 // CPU-bound threads besides main
+#define RUN_TIME (TIMER_FREQ) // how long they compete, in mtime ticks
+
+static volatile int stop;
+static volatile uint64_t spins[NSPIN];
+static uint64_t max_gap[NSPIN];
+
+static inline uint64_t rdtime(void) {
+    uint64_t t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+// Never blocks or yields, so it only gives up the CPU when preempted. The
+// longest gap between two looks at the clock is how long it was switched out.
+
+static void spin_func(void * arg) {
+    const int i = (int)(uintptr_t)arg;
+    uint64_t prev, now;
+
+    prev = rdtime();
+
+    while (!stop) {
+        now = rdtime();
+        if (max_gap[i] < now - prev)
+            max_gap[i] = now - prev;
+        prev = now;
+        spins[i] += 1;
+    }
+}
+
+void main(void) {
+    uint64_t start, snap[NSPIN];
+    int i;
+
+    console_init();
+    memory_init();
+    intr_init();
+    devmgr_init();
+    thread_init();
+    timer_init();
+    intr_enable();
+
+    for (i = 0; i < NSPIN; i++)
+        thread_spawn("spin", spin_func, (void*)(uintptr_t)i);
+
+    // Main is CPU-bound as well: the spinners only run if main is preempted
+
+    start = rdtime();
+    while (rdtime() - start < RUN_TIME)
+        continue;
+
+    // With preemption disabled, no spinner may run, however long main takes
+
+    preempt_disable();
+
+    for (i = 0; i < NSPIN; i++)
+        snap[i] = spins[i];
+
+    start = rdtime();
+    while (rdtime() - start < RUN_TIME / 4)
+        continue;
+
+    for (i = 0; i < NSPIN; i++) {
+        if (spins[i] != snap[i])
+            panic("thread ran with preemption disabled");
+    }
+
+    preempt_enable();
+
+    stop = 1;
+    for (i = 0; i < NSPIN; i++)
+        thread_join_any();
+
+    for (i = 0; i < NSPIN; i++) {
+        kprintf("spin %d: %lu iterations, longest off-CPU gap %lu us\n",
+            i, spins[i], max_gap[i] / (TIMER_FREQ / 1000000));
+
+        if (spins[i] == 0)
+            panic("CPU-bound thread starved");
+    }
+
+    halt_success();
+}
@@ -0,0 +1,149 @@
+// main.c - Main function: slab allocator churn and krealloc benchmark
+//
+
+#ifdef MAIN_TRACE
+#define TRACE
+#endif
+
+#ifdef MAIN_DEBUG
+#define DEBUG
+#endif
+
+#include "console.h"
+#include "memory.h"
+#include "heap.h"
+#include "halt.h"
+#include "config.h"
+
+#include <stdint.h>
+
+#define NLIVE 512 // live objects in the churn tests
+#define NROUNDS 65536 // alloc/free operations per timed test
+#define OBJ_SIZE 200 // object size of the fixed-size cache test
+#define GROW_PAGES 64 // final size in pages of the krealloc growth test
+
+static void * objs[NLIVE];
+
+static inline uint64_t rdtime(void) {
+    uint64_t t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+static size_t free_page_count(void) {
+    size_t cnt = 0;
+    int order;
+
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+        cnt += memory_free_blocks(order) << order;
+
+    return cnt;
+}
+
+void main(void) {
+    struct kmem_cache * cache;
+    uint64_t start, elapsed;
+    char * buf, * prev;
+    int moves;
+    uint32_t seed = 391;
+    size_t free_cnt, size, i;
+
+    console_init();
+    memory_init();
+
+    while (memory_carve_free_blocks(CARVE_CHUNK) != 0)
+        continue;
+
+    cache = kmem_cache_create("bench", OBJ_SIZE);
+    free_cnt = free_page_count();
+
+    // Throughput: alloc/free pairs of one size, which stay inside one slab
+
+    start = rdtime();
+    for (i = 0; i < NROUNDS; i++)
+        kfree(kmalloc(64));
+    elapsed = rdtime() - start;
+    kprintf("kmalloc+kfree 64: %lu ticks for %d pairs\n", elapsed, NROUNDS);
+
+    // Throughput: random mixed-size churn with up to NLIVE live objects
+
+    start = rdtime();
+    for (i = 0; i < NROUNDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        const size_t slot = (seed >> 8) % NLIVE;
+
+        if (objs[slot] != NULL) {
+            kfree(objs[slot]);
+            objs[slot] = NULL;
+        } else {
+            size = 8 + (seed >> 20) % 2040;
+            objs[slot] = kmalloc(size);
+            *(char*)objs[slot] = 1; // touch it
+        }
+    }
+    elapsed = rdtime() - start;
+    kprintf("mixed size 8-2047 churn: %lu ticks for %d operations\n",
+        elapsed, NROUNDS);
+
+    for (i = 0; i < NLIVE; i++) {
+        kfree(objs[i]);
+        objs[i] = NULL;
+    }
+
+    // Throughput: fixed-size cache, filled and drained in waves the way
+    // threads and processes come and go
+
+    start = rdtime();
+    for (i = 0; i < NROUNDS / NLIVE; i++) {
+        for (size = 0; size < NLIVE; size++)
+            objs[size] = kmem_cache_alloc(cache);
+        for (size = 0; size < NLIVE; size++)
+            kmem_cache_free(cache, objs[size]);
+    }
+    elapsed = rdtime() - start;
+    kprintf("kmem_cache %d-byte waves: %lu ticks for %d pairs\n",
+        OBJ_SIZE, elapsed, NROUNDS / NLIVE * NLIVE);
+
+    // krealloc: grow a buffer a page at a time. Growth moves the data only
+    // when the pages after the buffer are taken, here by the small blocks
+    // allocated in between.
+
+    buf = kmalloc(PAGE_SIZE + 1);
+    buf[0] = 'x';
+    moves = 0;
+
+    start = rdtime();
+    for (i = 2; i <= GROW_PAGES; i++) {
+        prev = buf;
+        buf = krealloc(buf, i * PAGE_SIZE);
+        moves += (buf != prev);
+        objs[i] = (i % 8 == 0) ? kmalloc(3 * PAGE_SIZE) : NULL;
+    }
+    elapsed = rdtime() - start;
+    kprintf("krealloc to %d pages: %lu ticks, %d moves\n",
+        GROW_PAGES, elapsed, moves);
+
+    if (buf[0] != 'x')
+        panic("krealloc: contents lost");
+
+    buf = krealloc(buf, 100); // shrinks in place
+    kfree(buf);
+
+    for (i = 0; i < NLIVE; i++) {
+        kfree(objs[i]);
+        objs[i] = NULL;
+    }
+
+    heap_dump();
+
+    // Every cache may hold on to one empty slab (there are fewer than 16
+    // caches); everything else must have gone back to the page allocator.
+
+    kprintf("pages free: %zu before, %zu after\n",
+        free_cnt, free_page_count());
+
+    if (free_page_count() + 16 < free_cnt)
+        panic("slab: pages leaked");
+
+    halt_success();
+}
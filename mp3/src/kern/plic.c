@@ -3,6 +3,7 @@
 
 #include "plic.h"
 #include "console.h"
+#include "thread.h"
 
 #include <stdint.h>
 
@@ -37,7 +38,11 @@
 #endif
 
 #define PLIC_SRCCNT 0x400
-#define PLIC_CTXCNT 1
+#define PLIC_CTXCNT (2*NHART)
+
+// The S mode context of a hart (context 2*h is M mode on hart h)
+
+#define PLIC_SCTX(hart) (2*(hart)+1)
 
 // define various size for enable register, threshold value address and claim register
 #define ADDRESS_SIZE 32
@@ -59,9 +64,9 @@ extern void plic_set_context_threshold(uint32_t ctxno, uint32_t level);
 extern uint32_t plic_claim_context_interrupt(uint32_t ctxno);
 extern void plic_complete_context_interrupt(uint32_t ctxno, uint32_t srcno);
 
-// Currently supports only single-hart operation. The low-level PLIC functions
-// already understand contexts, so we only need to modify the high-level
-// functions (plic_init, plic_claim, plic_complete).
+// Every hart takes interrupts in its S mode context. The high-level functions
+// (plic_claim_irq, plic_close_irq) use the context of the hart they run on,
+// which must not change in between; they are called from an ISR.
 
 // EXPORTED FUNCTION DEFINITIONS
 // 
@@ -69,13 +74,21 @@ extern void plic_complete_context_interrupt(uint32_t ctxno, uint32_t srcno);
 void plic_init(void) {
     int i;
 
-    // Disable all sources by setting priority to 0,
-    // and enable all sources for context 1 (S mode on hart 0).
+    // Disable all sources by setting priority to 0
 
-    for (i = 0; i < PLIC_SRCCNT; i++) {
+    for (i = 0; i < PLIC_SRCCNT; i++)
         plic_set_source_priority(i, 0);
-        plic_enable_source_for_context(1, i); // context 1 for S mode on hart 0
-    }
+}
+
+void plic_hart_init(int hart) {
+    int i;
+
+    // Enable all sources for the S mode context of the hart
+
+    for (i = 0; i < PLIC_SRCCNT; i++)
+        plic_enable_source_for_context(PLIC_SCTX(hart), i);
+    
+    plic_set_context_threshold(PLIC_SCTX(hart), 0);
 }
 
 extern void plic_enable_irq(int irqno, int prio) {
@@ -91,15 +104,13 @@ extern void plic_disable_irq(int irqno) {
 }
 
 extern int plic_claim_irq(void) {
-    // Hardwired context 1 (S mode on hart 0)
     trace("%s()", __func__);
-    return plic_claim_context_interrupt(1);
+    return plic_claim_context_interrupt(PLIC_SCTX(running_hart()));
 }
 
 extern void plic_close_irq(int irqno) {
-    // Hardwired context 1 (S mode on hart 0)
     trace("%s(irqno=%d)", __func__, irqno);
-    plic_complete_context_interrupt(1, irqno);
+    plic_complete_context_interrupt(PLIC_SCTX(running_hart()), irqno);
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -10,6 +10,7 @@
 #define PLIC_PRIO_MAX 7
 
 extern void plic_init(void);
+extern void plic_hart_init(int hart);
 
 extern void plic_enable_irq(int irqno, int prio);
 extern void plic_disable_irq(int irqno);
@@ -19,19 +19,13 @@
 #include "halt.h"
 #include "elf.h"
 #include "heap.h"
-
-// COMPILE-TIME PARAMETERS
-//
-
-// NPROC is the maximum number of processes
-
-#ifndef NPROC
-#define NPROC 16
-#endif
+#include "timer.h"
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
+static void process_init_areas(struct process * proc);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -43,14 +37,9 @@
 
 static struct process main_proc;
 
-// The process content table
-int process_count = 1;
-
-// A table of pointers to all user processes in the system
+// Cache of struct process for forked processes
 
-struct process * proctab[NPROC] = {
-    [MAIN_PID] = &main_proc
-};
+static struct kmem_cache * process_cache;
 
 // EXPORTED GLOBAL VARIABLES
 //
@@ -61,7 +50,7 @@ char procmgr_initialized = 0;
 //
 
 /**
- * Initializes the process manager. Sets up the main process and prepares the process table.
+ * Initializes the process manager. Sets up the main process.
  * 
  * Input -- None
  * 
@@ -81,6 +70,8 @@ extern void procmgr_init(void){
     main_proc.mtag = active_memory_space();  // Set the memory space identifier
     thread_set_process(main_proc.tid, &main_proc);
 
+    process_cache = kmem_cache_create("process", sizeof(struct process));
+
     // Set the I/O interface table of the process
     for (int i = 0; i < PROCESS_IOMAX; i++){
         main_proc.iotab[i] = NULL;
@@ -110,6 +101,8 @@ extern int process_exec(struct io_intf * exeio){
     }
 
     void (*entry)(void);  // Create an entry pointer of the executable file
+    struct elf_image old_image;
+    uint64_t start_time = csrr_time();
 
     struct process* curr_proc = current_process();  // Get the current process
     if(curr_proc == NULL){
@@ -127,11 +120,21 @@ extern int process_exec(struct io_intf * exeio){
 
     // memory_space_switch(new_mtag);  // Switch memory space
 
-    // II. Load the executable from the I/O interface
-    int result = elf_load(exeio, &entry);
+    // II. Record the executable's segments; pages are read in as they fault.
+    // The old image is released after the new one takes its reference, since
+    // both may be the same file.
+    old_image = curr_proc->image;
+    int result = elf_map(exeio, &curr_proc->image, &entry);
+    elf_release(&old_image);
     if(result < 0){
+        curr_proc->image.io = NULL;
+        curr_proc->image.nseg = 0;
+        vm_map_clear(&curr_proc->vmap);
         return result;
     }
+    process_init_areas(curr_proc);
+    curr_proc->pages_loaded = 0;
+    curr_proc->exec_time = csrr_time() - start_time;
 
     // III. Jump to User Mode and start the thread
     intr_disable();  // Disable interrupt
@@ -163,25 +166,13 @@ extern int process_fork(const struct trap_frame * tfr){
         panic("Failed to get current process.");
     }
 
-    // Create a new process
-    // if the process count is greater than or equal to the maximum number of processes
-    if (process_count >= NPROC){
-        return -EINVAL; //there are too many processes
-    }
-
-    int id;
-    for(id = 0; id < NPROC && proctab[id] != NULL; id++);
-    if(id == NPROC) panic("There's too many processes.");
-
-    struct process* new_proc = kmalloc(sizeof(struct process));
+    // Create a new process. Its id is the id of its thread, which
+    // thread_fork_to_user assigns; the thread table is the process table.
+    struct process* new_proc = kmem_cache_alloc(process_cache);
     if(new_proc == NULL){
-        return -12; // ENOMEM for no memory ENOMEM = 12
+        return -ENOMEM;
     }
 
-    // Set the new process id and insert it into the process table
-    new_proc->id = id;
-    proctab[id] = new_proc;
-
     //Copy the memory space
     // uintptr_t copied_mtag = memory_space_clone(0);
     // new_proc->mtag = copied_mtag;
@@ -195,7 +186,11 @@ extern int process_fork(const struct trap_frame * tfr){
     // }
 
     // Return the process id of the child process
-    return thread_fork_to_user(new_proc, tfr);
+    int pid = thread_fork_to_user(new_proc, tfr);
+    if(pid < 0){
+        kmem_cache_free(process_cache, new_proc);
+    }
+    return pid;
 }
 
 
@@ -207,7 +202,7 @@ extern int process_fork(const struct trap_frame * tfr){
  * Return -- None.
  * 
  * This function reclaims the current process's memory space, closes any open I/O interfaces, 
- * removes the process from the global process table, and deallocates its resources. 
+ * detaches the process from its thread, and deallocates its resources. 
  * It also unassigns the thread associated with the process and terminates the thread.
  */
 extern void __attribute__ ((noreturn)) process_exit(void){
@@ -219,14 +214,21 @@ extern void __attribute__ ((noreturn)) process_exit(void){
         panic("Failed to get current process.");
     }
     kprintf("here the %d process is exited\n", proc->id);
+    debug("process %d: exec %lu us, %lu image pages loaded", proc->id,
+        (unsigned long)(proc->exec_time / (TIMER_FREQ / 1000000)),
+        proc->pages_loaded);
     // Get the thread id of the process
     int tid = proc->tid;
 
     // Release with the items listed below:
-    // I. Reclaim process memory space
+    // I. Reclaim process memory space. Until the thread drops the process,
+    // switching back to the thread must not switch to the freed space.
     memory_space_reclaim();
+    proc->mtag = main_mtag;
 
-    // II. Close I/O interfaces
+    // II. Close I/O interfaces, including mapped files
+    elf_release(&proc->image);
+    vm_map_clear(&proc->vmap);
     for(int j = 0; j < PROCESS_IOMAX; j++){
         if(proc->iotab[j] != NULL){
             ioclose(proc->iotab[j]);
@@ -234,14 +236,12 @@ extern void __attribute__ ((noreturn)) process_exit(void){
         }
     }
 
-    // III. Remove the process and free it
+    // III. Detach the process from its thread and free it
+    thread_set_process(tid, NULL);
     if(proc->id != MAIN_PID){
-        proctab[proc->id] = NULL;
-        kfree(proc);
+        kmem_cache_free(process_cache, proc);
     }
 
-    // Set the associated process of the thread to none
-    thread_set_process(tid, NULL);
     // Exit from the thread
     thread_exit();
 }
@@ -254,18 +254,16 @@ extern void __attribute__ ((noreturn)) process_exit(void){
  * 
  * Return -- None.
  * 
- * This function locates the process in the process table by its ID (`pid`). 
- * It reclaims its memory space, closes its I/O interfaces, removes it from the global process table, 
+ * This function locates the process by its ID (`pid`), the ID of its thread. 
+ * It reclaims its memory space, closes its I/O interfaces, detaches it from its thread, 
  * deallocates its resources, and unassigns the thread associated with the process. 
  */
 extern void process_terminate(int pid){
-    // Check if the pid is available
-    if(pid < 0 || pid >= NPROC || proctab[pid] == NULL){
+    // Get the process. Its id is the id of its thread.
+    struct process* proc = thread_process(pid);
+    if(proc == NULL){
         return;
     }
-
-    // Get the process
-    struct process* proc = proctab[pid];
     // Get the thread id of the process
     int tid = proc->tid;
 
@@ -273,7 +271,9 @@ extern void process_terminate(int pid){
     // I. Process memory space
     memory_space_reclaim();
 
-    // II. Open I/O interfaces
+    // II. Open I/O interfaces, including mapped files
+    elf_release(&proc->image);
+    vm_map_clear(&proc->vmap);
     for(int j = 0; j < PROCESS_IOMAX; j++){
         if(proc->iotab[j] != NULL){
             ioclose(proc->iotab[j]);
@@ -281,12 +281,87 @@ extern void process_terminate(int pid){
         }
     }
 
-    // III. Remove the process and free it
+    // III. Detach the process from its thread and free it
+    thread_set_process(tid, NULL);
     if(proc->id != MAIN_PID){
-        proctab[proc->id] = NULL;
-        kfree(proc);
+        kmem_cache_free(process_cache, proc);
     }
+}
 
-    // Set the associated process of the thread to none
-    thread_set_process(tid, NULL);
-}
\ No newline at end of file
+
+/**
+ * Reads in a page of the current process's executable on its first access.
+ * 
+ * Input -- vma: The faulting user virtual address.
+ * 
+ * Return -- 0 if the page was mapped;
+ *        -- -EFAULT if vma is in no area of the process;
+ *        -- -EINVAL if vma is not part of the executable;
+ *        -- Other negative value if the page could not be read;
+ * 
+ * Called from memory_handle_page_fault for unmapped user addresses. An address
+ * outside every area of the process is a stray pointer and is not mapped.
+ * Counts the image pages loaded so the cost of demand paging shows up in
+ * process_exit (built with PROCESS_DEBUG).
+ */
+extern int process_load_page(uintptr_t vma){
+    struct process* proc = current_process();
+    if(proc == NULL){
+        return -EINVAL;
+    }
+
+    const struct vm_area* area = vm_map_find(&proc->vmap, vma);
+    if(area == NULL){
+        return -EFAULT;
+    }
+    if(area->type != VM_AREA_IMAGE){
+        return vm_area_fault(area, vma);
+    }
+
+    int result = elf_load_page(&proc->image, vma);
+    if(result == 0){
+        proc->pages_loaded++;
+    }
+    return result;
+}
+
+
+/**
+ * Sets up the areas of a freshly exec'd address space.
+ * 
+ * Input -- proc: The process whose image was just mapped.
+ * 
+ * Return -- None.
+ * 
+ * Each segment of the image gets an area, the heap starts empty right after
+ * the last segment, and the stack area lies below USER_STACK_VMA. ELF requires
+ * the segments to be sorted by address; a page shared by two segments belongs
+ * to the area of the first.
+ */
+static void process_init_areas(struct process * proc){
+    const struct elf_segment* seg;
+    uintptr_t start, end;
+    uintptr_t brk = USER_START_VMA;
+
+    vm_map_clear(&proc->vmap);
+
+    for(int i = 0; i < proc->image.nseg; i++){
+        seg = &proc->image.seg[i];
+        start = seg->vma & ~(uintptr_t)(PAGE_SIZE-1);
+        end = (seg->vma + seg->memsz + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1);
+        if(start < brk){
+            start = brk;
+        }
+        if(start < end){
+            vm_map_insert(&proc->vmap, start, end,
+                seg->flags & (PTE_R | PTE_W | PTE_X | PTE_U), VM_AREA_IMAGE);
+            brk = end;
+        }
+    }
+
+    proc->vmap.brk_start = brk;
+    proc->vmap.brk = brk;
+
+    vm_map_insert(&proc->vmap, USER_STACK_VMA - USER_STACK_SIZE, USER_STACK_VMA,
+        PTE_R | PTE_W | PTE_U, VM_AREA_STACK);
+}
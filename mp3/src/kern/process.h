@@ -11,6 +11,8 @@
 #include "config.h"
 #include "io.h"
 #include "thread.h"
+#include "elf.h"
+#include "vmarea.h"
 #include <stdint.h>
 
 // EXPORTED TYPE DEFINITIONS
@@ -21,15 +23,16 @@ struct process {
     int tid; // thread id of associated thread
     uintptr_t mtag; // memory space identifier
     struct io_intf * iotab[PROCESS_IOMAX];
+    struct elf_image image; // executable, paged in on demand
+    struct vm_map vmap; // areas of the user address space
+    uint64_t exec_time; // timer ticks spent in process_exec
+    unsigned long pages_loaded; // pages of image read in so far
 };
 
 // EXPORTED VARIABLES DECLARATIONS
 //
 
 extern char procmgr_initialized;
-extern struct process * proctab[];
-extern struct process proctab_content[];
-extern int process_count;
 
 // EXPORTED FUNCTION DECLARATIONS
 //
@@ -42,6 +45,14 @@ extern void __attribute__ ((noreturn)) process_exit(void);
 
 extern void process_terminate(int pid);
 
+// Called on a fault at an unmapped user address. Looks up the area of the
+// current process containing /vma/ and reads in the page of the executable or
+// maps a zero-filled page there. Returns 0 if the page was mapped, -EFAULT if
+// /vma/ is in no area, -EINVAL if there is no current process, or another
+// negative error code if loading failed.
+
+extern int process_load_page(uintptr_t vma);
+
 static inline struct process * current_process(void);
 static inline int current_pid(void);
 
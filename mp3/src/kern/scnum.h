@@ -20,6 +20,11 @@
 
 #define SYSCALL_USLEEP  40
 #define SYSCALL_WAIT    41
+#define SYSCALL_SETPRIORITY 42
+
+#define SYSCALL_BRK     50
+#define SYSCALL_MMAP    51
+#define SYSCALL_MUNMAP  52
 
 
 #endif // _SCNUM_H_
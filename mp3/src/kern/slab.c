@@ -0,0 +1,763 @@
+// slab.c - Slab allocator for kernel objects
+//
+// Objects of one size are allocated from a cache (struct kmem_cache). A cache
+// takes whole pages from the page allocator, called slabs, and splits each
+// into equal objects after a small header. Free objects of a slab are kept on
+// a list threaded through their first word, so allocation and freeing are a
+// few pointer updates. A slab whose last object is freed is given back to the
+// page allocator, except for one empty slab per cache that is kept to absorb
+// alloc/free churn at a slab boundary.
+//
+// kmalloc serves requests from a fixed set of size-class caches. Requests
+// larger than the biggest class get a run of contiguous pages of their own;
+// kfree tells the two apart by the alignment of the pointer, since slab
+// objects are never page aligned. The first frame of a run is typed
+// PAGE_TYPE_HEAP and every following frame is marked PAGE_FLAG_CONT, so the
+// length of a run is found from the frame table.
+//
+// Caches are shared by all threads. Every entry point disables preemption
+// while it works on them, which is enough on one hart as no ISR allocates.
+//
+
+#ifndef TRACE
+#ifdef HEAP_TRACE
+#define TRACE
+#endif
+#endif
+
+#ifndef DEBUG
+#ifdef HEAP_DEBUG
+#define DEBUG
+#endif
+#endif
+
+#include "heap.h"
+
+#include "console.h"
+#include "string.h"
+#include "halt.h"
+#include "memory.h"
+#include "thread.h"
+#include "device.h"
+#include "error.h"
+
+#include <stdint.h>
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+// Header at the start of every slab page. Slabs with both free and allocated
+// objects are on their cache's partial list; full slabs are on no list.
+
+struct slab {
+    struct slab * next;
+    struct slab * prev;
+    struct kmem_cache * cache;
+    void * free;        // first free object
+    uint16_t inuse;     // allocated objects
+};
+
+struct kmem_cache {
+    const char * name;
+    size_t size;            // object size, a multiple of KMALLOC_ALIGN
+    uint16_t per_slab;      // objects per slab
+    struct slab * partial;  // slabs with free and allocated objects
+    struct slab * empty;    // empty slab kept for reuse, or NULL
+    struct kmem_cache * next; // next cache on cache_list
+    size_t nslabs;          // slabs held, including the empty one
+    size_t inuse;           // allocated objects
+};
+
+#if HEAP_PROFILE
+
+// Header in front of every kmalloc block of a profiling build. It records the
+// call site charged for the block, and keeps the block 16-byte aligned.
+
+struct prof_hdr {
+    struct heap_prof_entry * site;
+    size_t size;
+};
+
+#endif
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define KMALLOC_ALIGN 16
+#define ROUND_UP(n,k) (((n) + (k)-1) / (k) * (k))
+
+#define SLAB_HDR_SIZE ROUND_UP(sizeof(struct slab), KMALLOC_ALIGN)
+
+// Largest object a slab holds two of. Anything bigger wastes at least half a
+// page per object, so kmalloc gives it whole pages instead.
+
+#define SLAB_OBJ_MAX ((PAGE_SIZE - SLAB_HDR_SIZE) / 2 / KMALLOC_ALIGN * KMALLOC_ALIGN)
+
+#define KMALLOC_NCLASS 8
+
+// EXPORTED GLOBAL VARIABLES
+//
+
+char heap_initialized = 0;
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// The initial heap block from memory_init. Cache descriptors are never freed,
+// so kmem_cache_create carves them from here while it lasts.
+
+static void * heap_start;
+static void * heap_end;
+
+static const size_t kmalloc_sizes[KMALLOC_NCLASS] = {
+    16, 32, 64, 128, 256, 512, 1024, SLAB_OBJ_MAX
+};
+
+static const char * const kmalloc_names[KMALLOC_NCLASS] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-max"
+};
+
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASS];
+static struct kmem_cache * cache_list;
+
+#if HEAP_PROFILE
+
+// Call sites, hashed by caller with linear probing. Sites that find the table
+// full are lumped together in prof_other (caller 0).
+
+static struct heap_prof_entry prof_sites[HEAP_PROF_SITES];
+static struct heap_prof_entry prof_other;
+
+static struct io_intf prof_io;
+
+#endif
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void cache_setup (
+    struct kmem_cache * cache, const char * name, size_t size);
+
+static struct slab * slab_create(struct kmem_cache * cache);
+static void slab_destroy(struct slab * slab);
+
+static void slab_link(struct slab ** list, struct slab * slab);
+static void slab_unlink(struct slab ** list, struct slab * slab);
+
+static void * kmalloc_from(size_t size, void * caller);
+static void * heap_alloc(size_t size);
+static void * heap_realloc(void * ptr, size_t size);
+static void heap_free(void * ptr);
+
+static void * large_alloc(size_t npages);
+static size_t large_npages(void * pp);
+static int large_grow(void * pp, size_t npages, size_t new_npages);
+static void pages_free(void * pp, size_t npages);
+
+#if HEAP_PROFILE
+static void * prof_account(struct prof_hdr * hdr, size_t size, void * caller);
+static struct prof_hdr * prof_release(void * ptr);
+static int prof_untracked(void * ptr);
+static struct heap_prof_entry * prof_lookup(void * caller);
+static int prof_open(struct io_intf ** ioptr, void * aux);
+static int prof_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static const struct io_ops prof_io_ops = {
+    .ctl = prof_ioctl
+};
+#endif
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void heap_init(void * start, void * end) {
+    int i;
+
+    trace("%s(%p,%p)", __func__, start, end);
+    assert (start < end);
+
+    heap_start = (void*)ROUND_UP((uintptr_t)start, sizeof(void*));
+    heap_end = end;
+
+    for (i = 0; i < KMALLOC_NCLASS; i++)
+        cache_setup(&kmalloc_caches[i], kmalloc_names[i], kmalloc_sizes[i]);
+
+    heap_initialized = 1;
+}
+
+struct kmem_cache * kmem_cache_create(const char * name, size_t size) {
+    struct kmem_cache * cache;
+
+    trace("%s(\"%s\",%zu)", __func__, name, size);
+
+    if (SLAB_OBJ_MAX < ROUND_UP(size, KMALLOC_ALIGN))
+        panic("kmem_cache_create: object too large");
+
+    preempt_disable();
+
+    if (sizeof(struct kmem_cache) <= heap_end - heap_start) {
+        cache = heap_start;
+        heap_start += sizeof(struct kmem_cache);
+    } else
+        cache = kmalloc(sizeof(struct kmem_cache));
+
+    cache_setup(cache, name, size);
+    preempt_enable();
+    return cache;
+}
+
+void * kmem_cache_alloc(struct kmem_cache * cache) {
+    struct slab * slab;
+    void * obj;
+
+    preempt_disable();
+    slab = cache->partial;
+
+    if (slab == NULL) {
+        if (cache->empty != NULL) {
+            slab = cache->empty;
+            cache->empty = NULL;
+        } else
+            slab = slab_create(cache);
+
+        slab_link(&cache->partial, slab);
+    }
+
+    obj = slab->free;
+    slab->free = *(void**)obj;
+    slab->inuse += 1;
+    cache->inuse += 1;
+
+    if (slab->inuse == cache->per_slab)
+        slab_unlink(&cache->partial, slab);
+
+    preempt_enable();
+    debug("%s: allocated %p", cache->name, obj);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache * cache, void * obj) {
+    struct slab * const slab =
+        (void*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE-1));
+
+    debug("%s: freeing %p", cache->name, obj);
+
+    assert (slab->cache == cache && 0 < slab->inuse);
+
+    // A full slab is on no list; it becomes partial again
+
+    preempt_disable();
+
+    if (slab->inuse == cache->per_slab)
+        slab_link(&cache->partial, slab);
+
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    slab->inuse -= 1;
+    cache->inuse -= 1;
+
+    if (slab->inuse == 0) {
+        slab_unlink(&cache->partial, slab);
+
+        if (cache->empty == NULL)
+            cache->empty = slab;
+        else {
+            slab_destroy(slab);
+            cache->nslabs -= 1;
+        }
+    }
+
+    preempt_enable();
+}
+
+void * kmalloc(size_t size) {
+    trace("%s(%zu)", __func__, size);
+    return kmalloc_from(size, __builtin_return_address(0));
+}
+
+void * kcalloc(size_t n, size_t size) {
+    void * ptr;
+
+    trace("%s(%zu,%zu)", __func__, n, size);
+
+    if (size != 0 && SIZE_MAX / size < n)
+        panic("heap alloc request too large");
+
+    ptr = kmalloc_from(n * size, __builtin_return_address(0));
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+void * krealloc(void * ptr, size_t size) {
+#if HEAP_PROFILE
+    struct prof_hdr * hdr;
+#endif
+
+    trace("%s(%p,%zu)", __func__, ptr, size);
+
+    if (ptr == NULL)
+        return kmalloc_from(size, __builtin_return_address(0));
+
+#if HEAP_PROFILE
+    preempt_disable();
+    hdr = prof_release(ptr);
+    hdr = heap_realloc(hdr, sizeof(struct prof_hdr) + size);
+    ptr = prof_account(hdr, size, __builtin_return_address(0));
+#else
+    preempt_disable();
+    ptr = heap_realloc(ptr, size);
+#endif
+
+    preempt_enable();
+    return ptr;
+}
+
+void kfree(void * ptr) {
+    trace("%s(%p)", __func__, ptr);
+
+    if (ptr == NULL)
+        return;
+
+    preempt_disable();
+#if HEAP_PROFILE
+    if (prof_untracked(ptr))
+        heap_free(ptr);
+    else
+        heap_free(prof_release(ptr));
+#else
+    heap_free(ptr);
+#endif
+    preempt_enable();
+}
+
+void heap_dump(void) {
+    const struct kmem_cache * cache;
+
+    kprintf("%16s %6s %6s %8s %8s\n",
+        "cache", "size", "slabs", "inuse", "free");
+
+    for (cache = cache_list; cache != NULL; cache = cache->next) {
+        kprintf("%16s %6zu %6zu %8zu %8zu\n",
+            cache->name, cache->size, cache->nslabs, cache->inuse,
+            cache->nslabs * cache->per_slab - cache->inuse);
+    }
+}
+
+#if HEAP_PROFILE
+
+void heap_profile_dump(void) {
+    const struct heap_prof_entry * top[HEAP_PROF_TOP];
+    const struct heap_prof_entry * site;
+    int ntop = 0;
+    int i, j;
+
+    // Keep the HEAP_PROF_TOP sites with the most live bytes in top[], sorted
+
+    for (i = 0; i <= HEAP_PROF_SITES; i++) {
+        site = (i < HEAP_PROF_SITES) ? &prof_sites[i] : &prof_other;
+        if (site->alloc_cnt == 0)
+            continue;
+
+        if (ntop < HEAP_PROF_TOP)
+            j = ntop++;
+        else if (top[HEAP_PROF_TOP-1]->live_bytes < site->live_bytes)
+            j = HEAP_PROF_TOP-1;
+        else
+            continue;
+
+        while (0 < j && top[j-1]->live_bytes < site->live_bytes) {
+            top[j] = top[j-1];
+            j--;
+        }
+
+        top[j] = site;
+    }
+
+    kprintf("%10s %8s %10s %8s %10s\n",
+        "caller", "live", "bytes", "allocs", "peak");
+
+    for (i = 0; i < ntop; i++) {
+        kprintf("%p %8lu %10lu %8lu %10lu\n",
+            (void*)top[i]->caller, top[i]->live_cnt, top[i]->live_bytes,
+            top[i]->alloc_cnt, top[i]->peak_bytes);
+    }
+}
+
+void heap_profile_attach(void) {
+    prof_io.ops = &prof_io_ops;
+    device_register("heapprof", &prof_open, NULL);
+}
+
+#endif
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// kmalloc for /caller/, which the profiler charges for the allocation
+
+static void * kmalloc_from(size_t size, void * caller) {
+#if HEAP_PROFILE
+    struct prof_hdr * hdr;
+#endif
+    void * ptr;
+
+    preempt_disable();
+#if HEAP_PROFILE
+    hdr = heap_alloc(sizeof(struct prof_hdr) + size);
+    ptr = prof_account(hdr, size, caller);
+#else
+    ptr = heap_alloc(size);
+#endif
+    preempt_enable();
+    return ptr;
+}
+
+// heap_alloc, heap_realloc and heap_free do the work of kmalloc, krealloc and
+// kfree, without profiling.
+
+static void * heap_alloc(size_t size) {
+    int i;
+
+    for (i = 0; i < KMALLOC_NCLASS; i++) {
+        if (size <= kmalloc_sizes[i])
+            return kmem_cache_alloc(&kmalloc_caches[i]);
+    }
+
+    return large_alloc(ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE);
+}
+
+static void * heap_realloc(void * ptr, size_t size) {
+    struct slab * slab;
+    size_t npages, new_npages;
+    size_t old_size;
+    void * new_ptr;
+
+    if (((uintptr_t)ptr & (PAGE_SIZE-1)) != 0) {
+        // A slab object can grow up to the size of its class in place
+
+        slab = (void*)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE-1));
+        old_size = slab->cache->size;
+
+        if (size <= old_size)
+            return ptr;
+    } else {
+        // A page run shrinks by freeing its tail, and grows by taking the
+        // pages after it if they are free.
+
+        npages = large_npages(ptr);
+        new_npages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+        old_size = npages * PAGE_SIZE;
+
+        if (new_npages == 0)
+            new_npages = 1;
+
+        if (new_npages <= npages) {
+            pages_free(ptr + new_npages * PAGE_SIZE, npages - new_npages);
+            return ptr;
+        }
+
+        if (large_grow(ptr, npages, new_npages) == 0)
+            return ptr;
+    }
+
+    new_ptr = heap_alloc(size);
+    memcpy(new_ptr, ptr, old_size);
+    heap_free(ptr);
+    return new_ptr;
+}
+
+static void heap_free(void * ptr) {
+    struct slab * slab;
+
+    if (((uintptr_t)ptr & (PAGE_SIZE-1)) == 0) {
+        pages_free(ptr, large_npages(ptr));
+        return;
+    }
+
+    slab = (void*)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE-1));
+    kmem_cache_free(slab->cache, ptr);
+}
+
+static void cache_setup (
+    struct kmem_cache * cache, const char * name, size_t size)
+{
+    size = ROUND_UP(size, KMALLOC_ALIGN);
+    if (size == 0)
+        size = KMALLOC_ALIGN;
+
+    cache->name = name;
+    cache->size = size;
+    cache->per_slab = (PAGE_SIZE - SLAB_HDR_SIZE) / size;
+    cache->partial = NULL;
+    cache->empty = NULL;
+    cache->nslabs = 0;
+    cache->inuse = 0;
+
+    cache->next = cache_list;
+    cache_list = cache;
+}
+
+// Takes a page from the page allocator and threads all of its objects onto
+// the slab's free list in address order.
+
+static struct slab * slab_create(struct kmem_cache * cache) {
+    struct slab * slab;
+    void ** link;
+    void * obj;
+    int i;
+
+    slab = memory_alloc_page();
+    memory_page(slab)->type = PAGE_TYPE_HEAP;
+
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->cache = cache;
+    slab->inuse = 0;
+
+    link = &slab->free;
+    obj = (void*)slab + SLAB_HDR_SIZE;
+
+    for (i = 0; i < cache->per_slab; i++) {
+        *link = obj;
+        link = obj;
+        obj += cache->size;
+    }
+
+    *link = NULL;
+    cache->nslabs += 1;
+
+    debug("%s: new slab %p", cache->name, slab);
+    return slab;
+}
+
+static void slab_destroy(struct slab * slab) {
+    debug("%s: releasing slab %p", slab->cache->name, slab);
+    memory_free_page(slab);
+}
+
+static void slab_link(struct slab ** list, struct slab * slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_unlink(struct slab ** list, struct slab * slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Allocates a run of /npages/ contiguous pages. The run comes from a
+// power-of-two block, whose tail beyond /npages/ is given back at once.
+
+static void * large_alloc(size_t npages) {
+    size_t i;
+    void * pp;
+    int order;
+
+    for (order = 0; (1UL << order) < npages; order++)
+        continue;
+
+    if (BUDDY_MAX_ORDER < order)
+        panic("heap alloc request too large");
+
+    pp = memory_alloc_pages(order);
+    pages_free(pp + npages * PAGE_SIZE, (1UL << order) - npages);
+
+    memory_page(pp)->type = PAGE_TYPE_HEAP;
+    for (i = 1; i < npages; i++) {
+        memory_page(pp + i * PAGE_SIZE)->type = PAGE_TYPE_HEAP;
+        memory_page(pp + i * PAGE_SIZE)->flags |= PAGE_FLAG_CONT;
+    }
+
+    return pp;
+}
+
+static size_t large_npages(void * pp) {
+    struct page * page;
+    size_t cnt = 1;
+
+    for (;;) {
+        page = memory_page(pp + cnt * PAGE_SIZE);
+        if (page == NULL || !(page->flags & PAGE_FLAG_CONT))
+            return cnt;
+        cnt++;
+    }
+}
+
+// Extends the run at /pp/ from /npages/ to /new_npages/ pages by taking the
+// pages right after it. Returns 0 on success, or -1 with the run unchanged if
+// one of them is in use.
+
+static int large_grow(void * pp, size_t npages, size_t new_npages) {
+    size_t i;
+
+    for (i = npages; i < new_npages; i++) {
+        if (memory_alloc_page_at(pp + i * PAGE_SIZE) == NULL) {
+            pages_free(pp + npages * PAGE_SIZE, i - npages);
+            return -1;
+        }
+    }
+
+    for (i = npages; i < new_npages; i++) {
+        memory_page(pp + i * PAGE_SIZE)->type = PAGE_TYPE_HEAP;
+        memory_page(pp + i * PAGE_SIZE)->flags |= PAGE_FLAG_CONT;
+    }
+
+    return 0;
+}
+
+// Returns /npages/ pages starting at /pp/ to the page allocator as the
+// largest naturally aligned blocks that fit, clearing PAGE_FLAG_CONT.
+
+static void pages_free(void * pp, size_t npages) {
+    const size_t first = (uintptr_t)pp / PAGE_SIZE;
+    size_t i = 0;
+    size_t j;
+    int order;
+
+    for (j = 0; j < npages; j++)
+        memory_page(pp + j * PAGE_SIZE)->flags &= ~PAGE_FLAG_CONT;
+
+    while (i < npages) {
+        order = 0;
+        while (order < BUDDY_MAX_ORDER &&
+            (first + i) % (2UL << order) == 0 &&
+            i + (2UL << order) <= npages)
+        {
+            order++;
+        }
+
+        memory_free_pages(pp + i * PAGE_SIZE, order);
+        i += 1UL << order;
+    }
+}
+
+#if HEAP_PROFILE
+
+// Charges the block at /hdr/ to the call site of /caller/ and returns the
+// address handed to the caller, just past the header.
+
+static void * prof_account(struct prof_hdr * hdr, size_t size, void * caller) {
+    struct heap_prof_entry * const site = prof_lookup(caller);
+
+    hdr->site = site;
+    hdr->size = size;
+
+    site->live_cnt += 1;
+    site->live_bytes += size;
+    site->alloc_cnt += 1;
+    if (site->peak_bytes < site->live_bytes)
+        site->peak_bytes = site->live_bytes;
+
+    return hdr + 1;
+}
+
+// Takes the block at /ptr/ off its call site and returns its header, which is
+// the address the allocator handed out.
+
+static struct prof_hdr * prof_release(void * ptr) {
+    struct prof_hdr * const hdr = (struct prof_hdr *)ptr - 1;
+
+    hdr->site->live_cnt -= 1;
+    hdr->site->live_bytes -= hdr->size;
+    return hdr;
+}
+
+// Tells whether /ptr/ is an object of a kmem_cache_create cache, which has no
+// header. Every kmalloc block either starts a page run, with the header at the
+// start of the page, or is in a slab of one of the kmalloc caches.
+
+static int prof_untracked(void * ptr) {
+    const struct slab * const slab =
+        (void*)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE-1));
+
+    if (((uintptr_t)((struct prof_hdr *)ptr - 1) & (PAGE_SIZE-1)) == 0)
+        return 0;
+
+    return (slab->cache < kmalloc_caches ||
+        kmalloc_caches + KMALLOC_NCLASS <= slab->cache);
+}
+
+static struct heap_prof_entry * prof_lookup(void * caller) {
+    const uintptr_t key = (uintptr_t)caller;
+    struct heap_prof_entry * site;
+    size_t i, n;
+
+    i = (key >> 1) * 2654435761UL % HEAP_PROF_SITES;
+
+    for (n = 0; n < HEAP_PROF_SITES; n++) {
+        site = &prof_sites[(i + n) % HEAP_PROF_SITES];
+
+        if (site->caller == key)
+            return site;
+
+        if (site->caller == 0) {
+            site->caller = key;
+            return site;
+        }
+    }
+
+    return &prof_other;
+}
+
+static int prof_open(struct io_intf ** ioptr, void * aux) {
+    prof_io.refcnt += 1;
+    *ioptr = &prof_io;
+    return 0;
+}
+
+// Copies the call-site table to the user buffer described by the struct
+// io_heapprof at /arg/. The table is copied to a kernel buffer first, since
+// faulting in the user buffer may allocate and change it.
+
+static int prof_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct heap_prof_entry * snap;
+    struct io_heapprof req;
+    uint64_t cnt = 0;
+    int result = 0;
+    int i;
+
+    if (cmd != IOCTL_HEAPPROF)
+        return -ENOTSUP;
+
+    if (copy_from_user(&req, arg, sizeof(req)) != 0)
+        return -EFAULT;
+
+    preempt_disable();
+    snap = heap_alloc((HEAP_PROF_SITES + 1) * sizeof(*snap));
+
+    for (i = 0; i < HEAP_PROF_SITES && cnt < req.cnt; i++) {
+        if (prof_sites[i].caller != 0)
+            snap[cnt++] = prof_sites[i];
+    }
+
+    if (prof_other.alloc_cnt != 0 && cnt < req.cnt)
+        snap[cnt++] = prof_other;
+
+    preempt_enable();
+    req.cnt = cnt;
+
+    if (copy_to_user(req.buf, snap, cnt * sizeof(*snap)) != 0 ||
+        copy_to_user(arg, &req, sizeof(req)) != 0)
+    {
+        result = -EFAULT;
+    }
+
+    preempt_disable();
+    heap_free(snap);
+    preempt_enable();
+    return result;
+}
+
+#endif
@@ -0,0 +1,42 @@
+// spinlock.h - A spin lock for mutual exclusion between harts
+//
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+// A spin lock busy-waits until the lock is free, so it must only be held for
+// short stretches and never across a context switch. It does not disable
+// interrupts: a lock also taken by an ISR must be acquired with interrupts
+// disabled, or the ISR would spin forever on the hart holding it.
+
+struct spinlock {
+    volatile int locked;
+    const char * name;
+};
+
+static inline void spinlock_init(struct spinlock * lk, const char * name);
+static inline void spin_lock(struct spinlock * lk);
+static inline void spin_unlock(struct spinlock * lk);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+static inline void spinlock_init(struct spinlock * lk, const char * name) {
+    lk->locked = 0;
+    lk->name = name;
+}
+
+static inline void spin_lock(struct spinlock * lk) {
+    // Only try the (bus-locking) swap when the lock looks free
+
+    while (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (lk->locked)
+            continue;
+    }
+}
+
+static inline void spin_unlock(struct spinlock * lk) {
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif // _SPINLOCK_H_
@@ -1,5 +1,17 @@
         .section	.text
-        
+
+        # Every hart starts here. The M mode setup below is per hart; then
+        # hart 0 boots the kernel, while the other harts wait in M mode until
+        # thread_start_harts (in thread.c) gives them an idle thread to run.
+        # Harts beyond the first MAX_HARTS are parked for good.
+
+        .equ    MAX_HARTS, 8
+        .equ    CLINT_MSIP, 0x2000000
+
+        csrr    s1, mhartid
+        li      t0, MAX_HARTS
+        bgeu    s1, t0, park
+
         # Delegate to S mode all S mode interrupts and all exceptions except
         # ecall from S mode and M mode; ecalls from S mode are used to provide
         # access to the timer to S mode. Enable M mode interrupts.
@@ -8,7 +20,17 @@
         csrw    medeleg, t0
         li      t0, 0x222
         csrw    mideleg, t0
-        csrs    mstatus, 4 # MIE
+
+        # The M mode trap handler (in trapasm.s) saves registers to a scratch
+        # area of its own hart, to which mscratch points. M mode software
+        # interrupts are how harts signal each other (see hart_kick in
+        # thread.c).
+
+        la      t0, _mmode_scratch
+        slli    t1, s1, 5
+        add     t0, t0, t1
+        csrw    mscratch, t0
+        csrsi   mie, 8 # MSIE
 
         # Give S mode access to the entire physical address space
 
@@ -16,6 +38,32 @@
         csrw    pmpaddr0, t0
         csrsi   pmpcfg0, 0xf
 
+        # If timer.c asks for it (timer_use_sstc), enable the Sstc extension,
+        # which lets S mode program its timer with the stimecmp CSR instead of
+        # through the M mode trap handler. A hart without Sstc either ignores
+        # the STCE bit of menvcfg or traps on menvcfg, which takes us to the
+        # probe's end. Bit /h/ of _hart_sstc is set if hart /h/ has Sstc.
+
+        lw      t0, timer_use_sstc
+        beqz    t0, 1f
+
+        la      t0, 1f
+        csrw    mtvec, t0
+        li      t0, 1
+        slli    t0, t0, 63 # menvcfg.STCE
+        csrs    0x30a, t0 # menvcfg
+        csrr    t1, 0x30a
+        bgez    t1, 1f
+
+        li      t0, -1
+        csrw    0x14d, t0 # stimecmp
+        li      t0, 1
+        sll     t0, t0, s1
+        la      t1, _hart_sstc
+        amoor.d zero, t0, (t1)
+
+        .balign 4
+1:
         # Set trap handler address (defined in trapasm.s)
 
         la      t0, _mmode_trap_entry
@@ -28,6 +76,10 @@
         csrs    mcounteren, 7
         csrs    scounteren, 7
 
+        bnez    s1, secondary
+
+        csrs    mstatus, 4 # MIE
+
         # Switch to S mode
 
         li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
@@ -45,12 +97,61 @@
         la	sp, _main_stack_anchor
         mv      fp, zero
 
+        # The thread pointer points to the running thread (see thread.c), so
+        # that preempt_disable works before thread_init.
+
+        la      tp, main_thread
+
         # If main returns 0, jump to halt_success, otherwise to halt_failure
 
         call    main
         bnez    a0, halt_failure
         j       halt_success
 
+        # Tell hart 0 we are here, and wait with M mode interrupts disabled
+        # (mstatus.MIE is clear at reset), so that the software interrupt that
+        # starts us stays pending and wakes wfi even if it is sent before we
+        # get there. Once in S mode, M mode interrupts are always enabled.
+
+secondary:
+        li      t0, 1
+        sll     t0, t0, s1
+        la      t1, _hart_present
+        amoor.d zero, t0, (t1)
+
+        la      t1, _hart_boot_anchor
+        slli    t0, s1, 3
+        add     t1, t1, t0
+1:      ld      sp, 0(t1)
+        bnez    sp, 2f
+        wfi
+        j       1b
+
+2:      li      t0, CLINT_MSIP  # clear our software interrupt
+        slli    t1, s1, 2
+        add     t0, t0, t1
+        sw      zero, 0(t0)
+
+        li      t0, 0x1080 # bits to clear in mstatus (MPP=01,MPIE=0)
+        li      t1, 0x0800 # bits to set in mstatus (MPP=01)
+        csrc    mstatus, t0
+        csrs    mstatus, t1
+        la      t0, 3f
+        csrw    mepc, t0
+        mret
+3:
+
+        # The boot anchor is the base of the stack of the hart's idle thread,
+        # which is where the thread pointer is.
+
+        ld      tp, 0(sp)
+        mv      fp, zero
+        call    thread_hart_main # does not return
+
+park:
+        wfi
+        j       park
+
         .section        .data.stack, "wa", @progbits
         .balign		16
         
@@ -72,4 +173,25 @@ _main_stack_anchor:
         .dword  main_thread
         .fill   8
 
+        # Secondary hart startup: bit /h/ of _hart_present is set when hart
+        # /h/ is waiting, _hart_boot_anchor[h] is the stack anchor it starts
+        # on. M mode scratch areas are four dwords per hart. _hart_sstc is
+        # described above.
+
+        .section        .bss
+        .balign         8
+
+        .global         _hart_present
+        .global         _hart_boot_anchor
+        .global         _hart_sstc
+
+_hart_present:
+        .fill   8
+_hart_boot_anchor:
+        .fill   MAX_HARTS*8
+_hart_sstc:
+        .fill   8
+_mmode_scratch:
+        .fill   MAX_HARTS*4*8
+
         .end
@@ -135,6 +135,25 @@ void * memcpy(void * restrict dst, const void * restrict src, size_t n) {
 	return dst;
 }
 
+void * memmove(void * dst, const void * src, size_t n) {
+	char * p = dst;
+	const char * q = src;
+
+	size_t i;
+
+	// copy backwards if dst overlaps the end of src
+
+	if (p <= q) {
+		for (i = 0; i < n; i++)
+			p[i] = q[i];
+	} else {
+		for (i = n; i != 0; i--)
+			p[i-1] = q[i-1];
+	}
+
+	return dst;
+}
+
 int memcmp(const void * p1, const void * p2, size_t n) {
 	const uint8_t * const u1 = p1;
 	const uint8_t * const u2 = p2;
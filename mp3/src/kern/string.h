@@ -15,6 +15,7 @@ extern char * strncat(char *dest, const char *src, size_t n);
 
 extern void * memset(void * s, int c, size_t n);
 extern void * memcpy(void * restrict dst, const void * restrict src, size_t n);
+extern void * memmove(void * dst, const void * src, size_t n);
 extern int memcmp(const void * p1, const void * p2, size_t n);
 
 extern size_t snprintf(char * buf, size_t bufsz, const char * fmt, ...);
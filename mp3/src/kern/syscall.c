@@ -13,9 +13,21 @@
 #include "heap.h"
 #include "intr.h"
 #include "syscall.h"
+#include "mman.h"
+#include "vmarea.h"
 
 #define ECHILD  10
-#define NPROC 16
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define PAGE_ROUND_UP(n) (((n) + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1))
+
+// With SYSCALL_PREVALIDATE=1, sysread and syswrite take the old path instead,
+// for comparison: memory_validate_vptr_len checks every page of the buffer,
+// which must already be mapped, and the driver then reads or writes it in
+// place.
+
+#ifndef SYSCALL_PREVALIDATE
+#define SYSCALL_PREVALIDATE 0
+#endif
 
 
 static int sysexit(void) {
@@ -148,50 +160,113 @@ static int sysclose(int fd) {
     }
 }
 
+// sysread and syswrite do not validate the user buffer up front. Data moves
+// through a kernel bounce buffer with copy_to_user and copy_from_user, which
+// fault user pages in as they are touched and fail with -EFAULT on a bad
+// buffer. A device driver therefore never touches user memory: drivers hold
+// locks and sleep in the middle of a transfer, and only the copy routines have
+// exception fixups. The buffer is a single page, so taking it never needs
+// contiguous memory, and larger transfers go through it a page at a time.
+
 static long sysread(int fd, void *buf, size_t bufsz) {
-    // Memory Range Validation
-    int validate_result;
+    struct io_intf * io;
+    void * kbuf;
+    size_t pos = 0;
+    size_t n;
+    long rcnt;
+    long result;
 
-    validate_result = memory_validate_vptr_len(buf, bufsz, PTE_W|PTE_U);
-    if(validate_result != 1) {
-        return validate_result;
+    // validate the file descriptor
+    if (fd < 0 || fd >= PROCESS_IOMAX)
+        return -EBADFD;
+    
+    io = current_process()->iotab[fd];
+    if (io == NULL)
+        return -EINVAL;
+    
+    if (SYSCALL_PREVALIDATE) {
+        result = memory_validate_vptr_len(buf, bufsz, PTE_W|PTE_U);
+        return (result == 1) ? ioread_full(io, buf, bufsz) : result;
     }
 
-    // validate the file descriptor
-    if (fd >= 0 && fd < PROCESS_IOMAX) {
-        // check if the file descriptor is valid
-        if(current_process()->iotab[fd] == NULL) {
-            return -EINVAL;
+    kbuf = memory_alloc_page();
+
+    while (pos < bufsz) {
+        n = MIN(bufsz - pos, PAGE_SIZE);
+
+        rcnt = ioread_full(io, kbuf, n);
+        if (rcnt <= 0) {
+            result = (pos != 0) ? pos : rcnt;
+            goto done;
         }
-        // return the result of device_read
-        else return ioread_full(current_process()->iotab[fd], buf, bufsz);
-    }
-    else {
-        return -EBADFD;
+
+        if (copy_to_user((char*)buf + pos, kbuf, rcnt) != 0) {
+            result = -EFAULT;
+            goto done;
+        }
+        
+        pos += rcnt;
+
+        // short read: end of file
+        if (rcnt < n)
+            break;
     }
+
+    result = pos;
+
+done:
+    memory_free_page(kbuf);
+    return result;
 }
 
 static long syswrite(int fd, const void *buf, size_t len) {
-    // Memory Range Validation
-    int validate_result;
+    struct io_intf * io;
+    void * kbuf;
+    size_t pos = 0;
+    size_t n;
+    long wcnt;
+    long result;
 
-    validate_result = memory_validate_vptr_len(buf, len, PTE_R |PTE_U);
-    if(validate_result != 1) {
-        return validate_result;
+    // validate the file descriptor
+    if (fd < 0 || fd >= PROCESS_IOMAX)
+        return -EBADFD;
+    
+    io = current_process()->iotab[fd];
+    if (io == NULL)
+        return -EINVAL;
+    
+    if (SYSCALL_PREVALIDATE) {
+        result = memory_validate_vptr_len(buf, len, PTE_R|PTE_U);
+        return (result == 1) ? iowrite(io, buf, len) : result;
     }
 
-    // validate the file descriptor
-    if (fd >= 0 && fd < PROCESS_IOMAX) {
-        // check if the file descriptor is valid
-        if(current_process()->iotab[fd] == NULL) {
-            return -EINVAL;
+    kbuf = memory_alloc_page();
+
+    while (pos < len) {
+        n = MIN(len - pos, PAGE_SIZE);
+
+        if (copy_from_user(kbuf, (const char*)buf + pos, n) != 0) {
+            result = -EFAULT;
+            goto done;
         }
-        // return the result of device_write
-        return iowrite(current_process()->iotab[fd], buf, len);
-    }
-    else {
-        return -EBADFD;
+
+        wcnt = iowrite(io, kbuf, n);
+        if (wcnt <= 0) {
+            result = (pos != 0) ? pos : wcnt;
+            goto done;
+        }
+
+        pos += wcnt;
+
+        if (wcnt < n)
+            break;
     }
+
+    result = pos;
+
+done:
+    memory_free_page(kbuf);
+    return result;
 }
 
 static int sysioctl(int fd, int cmd, void *arg) {
@@ -201,6 +276,10 @@ static int sysioctl(int fd, int cmd, void *arg) {
         if(current_process()->iotab[fd] == NULL) {
             return -EINVAL;
         }
+        // IOCTL_GETPAGE hands out kernel frames, it is not for user programs
+        if(cmd == IOCTL_GETPAGE) {
+            return -ENOTSUP;
+        }
         // return the result of device_ioctl
         return ioctl(current_process()->iotab[fd], cmd, arg);
     }
@@ -290,6 +369,10 @@ uint64_t syscall(struct trap_frame *tfr) {
             return sysusleep((unsigned long) a[0]);
             break;
 
+        case SYSCALL_SETPRIORITY:
+            return syssetpriority((int) a[0]);
+            break;
+
         case SYSCALL_EXIT:
             sysexit();
             return 0;
@@ -299,6 +382,19 @@ uint64_t syscall(struct trap_frame *tfr) {
             return sysfork(tfr);
             break;
 
+        case SYSCALL_BRK:
+            return sysbrk((void *)a[0]);
+            break;
+
+        case SYSCALL_MMAP:
+            return sysmmap((void *)a[0], (size_t)a[1], (int)a[2], (int)a[3],
+                (int)a[4], (long)a[5]);
+            break;
+
+        case SYSCALL_MUNMAP:
+            return sysmunmap((void *)a[0], (size_t)a[1]);
+            break;
+
         default :
             return -ENOTSUP;
     };
@@ -339,4 +435,124 @@ static int sysusleep(unsigned long us){
     alarm_sleep_us(&al, us);
 
     return 0;
-}
\ No newline at end of file
+}
+
+
+static int syssetpriority(int prio){
+    trace("%s(%d)", __func__, prio);
+
+    // A process may only lower its priority; otherwise one that was started
+    // at a low priority could raise itself above all others.
+
+    if (0 <= prio && prio < thread_get_priority())
+        return -EACCESS;
+
+    return thread_set_priority(prio);
+}
+
+
+static long sysbrk(void *addr){
+    trace("%s(%p)", __func__, addr);
+
+    return vm_map_brk(&current_process()->vmap, (uintptr_t)addr);
+}
+
+
+static long sysmmap(void *addr, size_t len, int prot, int flags, int fd, long offset){
+    trace("%s(%p,%zu,%d,%d,%d,%ld)", __func__, addr, len, prot, flags, fd, offset);
+
+    struct vm_map* map = &current_process()->vmap;
+    uintptr_t start = (uintptr_t)addr;
+    uint_fast8_t pte_flags = PTE_U;
+    struct io_intf* io = NULL;
+    int result;
+
+    // Check the length and the mapping type
+    if(len == 0 || USER_END_VMA - USER_START_VMA < len){
+        return -EINVAL;
+    }
+    len = PAGE_ROUND_UP(len);
+
+    if((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 ||
+       (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE)){
+        return -EINVAL;
+    }
+
+    // A shared anonymous mapping would have to survive fork without
+    // copy-on-write, and a shared writable file mapping would need write-back;
+    // neither is supported.
+    if((flags & MAP_SHARED) && ((flags & MAP_ANONYMOUS) || (prot & PROT_WRITE))){
+        return -ENOTSUP;
+    }
+
+    // A file is mapped from its page cache, page by page
+    if(!(flags & MAP_ANONYMOUS)){
+        if(fd < 0 || fd >= PROCESS_IOMAX || current_process()->iotab[fd] == NULL){
+            return -EBADFD;
+        }
+        if(offset < 0 || offset % PAGE_SIZE != 0){
+            return -EINVAL;
+        }
+        io = current_process()->iotab[fd];
+    }
+
+    if(prot & PROT_READ) pte_flags |= PTE_R;
+    if(prot & PROT_WRITE) pte_flags |= PTE_R | PTE_W;
+    if(prot & PROT_EXEC) pte_flags |= PTE_X;
+
+    // Pick the address: a fixed mapping replaces whatever is mapped there,
+    // otherwise take the highest free range below the stack.
+    if(flags & MAP_FIXED){
+        if(start % PAGE_SIZE != 0 || start < USER_START_VMA ||
+           USER_END_VMA - start < len){
+            return -EINVAL;
+        }
+        result = vm_map_remove(map, start, start + len);
+        if(result < 0){
+            return result;
+        }
+        memory_unmap_and_free_range(addr, len);
+    }
+    else{
+        start = vm_map_find_gap(map, len, PAGE_ROUND_UP(map->brk), USER_END_VMA);
+        if(start == 0){
+            return -ENOMEM;
+        }
+    }
+
+    // Pages are mapped on first access
+    if(io != NULL){
+        result = vm_map_insert_file(map, start, start + len, pte_flags, io, offset);
+    }
+    else{
+        result = vm_map_insert(map, start, start + len, pte_flags, VM_AREA_ANON);
+    }
+    if(result < 0){
+        return result;
+    }
+
+    return start;
+}
+
+
+static int sysmunmap(void *addr, size_t len){
+    trace("%s(%p,%zu)", __func__, addr, len);
+
+    const uintptr_t start = (uintptr_t)addr;
+    int result;
+
+    // Check the range
+    if(start % PAGE_SIZE != 0 || start < USER_START_VMA ||
+       start > USER_END_VMA || USER_END_VMA - start < len){
+        return -EINVAL;
+    }
+    len = PAGE_ROUND_UP(len);
+
+    result = vm_map_remove(&current_process()->vmap, start, start + len);
+    if(result < 0){
+        return result;
+    }
+
+    memory_unmap_and_free_range(addr, len);
+    return 0;
+}
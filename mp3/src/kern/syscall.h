@@ -107,6 +107,47 @@ static int syswait(int tid);
  */
 static int sysusleep(unsigned long us);
 
+/**
+ * @brief Sets the scheduling priority of the current process.
+ * 
+ * @param prio The new priority, from 0 (highest) to THREAD_NPRIO-1.
+ * @return int Returns 0 on success, -EINVAL if prio is out of range, or
+ * -EACCESS if it is higher than the current priority.
+ */
+static int syssetpriority(int prio);
+
+/**
+ * @brief Sets the program break.
+ * 
+ * @param addr The new end of the heap, or NULL to query the current one.
+ * @return long Returns the new program break, or the current one if the heap
+ *         cannot be moved to addr.
+ */
+static long sysbrk(void *addr);
+
+/**
+ * @brief Maps memory into the address space of the current process.
+ * 
+ * @param addr The address to map at if MAP_FIXED is given, otherwise ignored.
+ * @param len The length of the mapping, rounded up to whole pages.
+ * @param prot The protection of the mapping (PROT_ flags in mman.h).
+ * @param flags The kind of mapping (MAP_ flags in mman.h).
+ * @param fd The file descriptor of the file to map.
+ * @param offset The offset in the file of the first page mapped.
+ * @return long Returns the address of the mapping, or a negative error code.
+ *         Pages are mapped on first access.
+ */
+static long sysmmap(void *addr, size_t len, int prot, int flags, int fd, long offset);
+
+/**
+ * @brief Unmaps a range of the address space of the current process.
+ * 
+ * @param addr The page-aligned start of the range.
+ * @param len The length of the range, rounded up to whole pages.
+ * @return int Returns 0 on success, or a negative error code on failure.
+ */
+static int sysmunmap(void *addr, size_t len);
+
 /**
  * @brief Handles a system call.
  * 
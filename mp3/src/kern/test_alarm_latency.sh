@@ -0,0 +1,16 @@
+#!/bin/bash
+# Runs the alarm latency benchmark as init. Run with TIMER_SSTC=0 to compare
+# against re-arming the timer through M mode.
+cd ../user
+make clean
+make 
+cp bin/init_alarm_latency bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel TIMER_SSTC=${TIMER_SSTC:-1}
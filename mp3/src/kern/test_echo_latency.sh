@@ -0,0 +1,16 @@
+#!/bin/bash
+# Runs the keypress-to-echo benchmark as init. Connect to the pty QEMU
+# reports for the second serial port (e.g. screen /dev/pts/N) and type there.
+cd ../user
+make clean
+make 
+cp bin/init_echo_latency bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel
@@ -0,0 +1,14 @@
+#!/bin/bash
+cd ../user
+make clean
+make 
+cp bin/init_fork_bench bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme ../user/bin/nop
+
+cd ../kern
+make clean
+make run-kernel
@@ -0,0 +1,14 @@
+#!/bin/bash
+cd ../user
+make clean
+make 
+cp bin/init_fork_many bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel RAM_SIZE_MB=32
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Builds the kernel with per-call-site kmalloc accounting and runs the
+# heapprof tool as init.
+cd ../user
+make clean
+make 
+cp bin/heapprof bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel HEAP_PROFILE=1
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Builds the kernel with per-lock contention statistics and runs the
+# lockstat tool as init.
+cd ../user
+make clean
+make 
+cp bin/lockstat bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel LOCK_STATS=1
@@ -0,0 +1,14 @@
+#!/bin/bash
+cd ../user
+make clean
+make 
+cp bin/test_mmap bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme ../user/bin/trek
+
+cd ../kern
+make clean
+make run-kernel
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Pass SYSCALL_PREVALIDATE=1 as the first argument to measure the old path,
+# which validates the user buffer before the I/O.
+cd ../user
+make clean
+make 
+cp bin/init_syscall_bench bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme ../user/bin/trek
+
+cd ../kern
+make clean
+make run-kernel $1
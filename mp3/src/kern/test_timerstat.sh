@@ -0,0 +1,16 @@
+#!/bin/bash
+# Runs the timerstat tool as init on two harts, to compare the timer interrupt
+# rate of an idle and a busy hart.
+cd ../user
+make clean
+make 
+cp bin/timerstat bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel SMP=2
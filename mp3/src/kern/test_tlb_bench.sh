@@ -0,0 +1,16 @@
+#!/bin/bash
+# The benchmark walks 8 MB, so the machine gets 32 MB of RAM. Pass
+# USER_MEGAPAGES=0 as the first argument to measure with 4 kB pages only.
+cd ../user
+make clean
+make 
+cp bin/init_tlb_bench bin/runme
+
+cd ../util
+make clean
+make 
+./mkfs ../kern/kfs.raw ../user/bin/runme
+
+cd ../kern
+make clean
+make run-kernel RAM_SIZE_MB=32 $1
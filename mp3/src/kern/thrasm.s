@@ -149,6 +149,11 @@ _thread_finish_jump:
 # begin execution in the same function as the parent, receiving the same
 # arguments. The child will return from _thread_finish_fork to the parent
 # function, which will return to the child function.
+#
+# Called with interrupts disabled and the kernel lock held, which we release
+# once the parent's context is saved: from then on another hart may resume the
+# parent, so /parent_tfr/ must be a copy that the parent does not touch, just
+# below the child's stack anchor.
 
         .global _thread_finish_fork
         .type   _thread_finish_fork, @function
@@ -178,16 +183,21 @@ _thread_finish_fork:
         # Switch to the child thread's context
         mv      tp, a0       
 
+        # Load the child thread's stack anchor and set it as sscratch
+        ld      t0, SP_ANCHOR*8(tp)  
+        csrw    sscratch, t0  
+
+        # Release the kernel lock on the child's stack, below the trap frame
+        mv      sp, a1
+        mv      s0, a1
+        call    kernel_lock_release
+
         # Set trap vector for user mode
         la      a0, _trap_entry_from_umode  
         csrw    stvec, a0   
 
         # Load parent's trap frame (tfr)
-        mv      x31, a1       
-
-        # Load the child thread's stack anchor and set it as sscratch
-        ld      sp, SP_ANCHOR*8(tp)  
-        csrw    sscratch, sp  
+        mv      x31, s0       
         
         # Restore sstatus register from the parent trap frame
         ld      a0, MSTATUS_TRAP_FRAME*8(x31)  
@@ -199,7 +209,7 @@ _thread_finish_fork:
         
         # Restore general-purpose registers from the parent's trap frame
         ld      x1, 1*8(x31)       
-        nop                        # No operation (placeholder to avoid timing hazard)
+        ld      x2, 2*8(x31)       # user stack pointer
         ld      x3, 3*8(x31)       
         ld      x4, 4*8(x31)       
         ld      x5, 5*8(x31)       
@@ -237,8 +247,106 @@ _thread_finish_fork:
         sret                       
 
 
+        .global _thread_fp_save
+        .type   _thread_fp_save, @function
+
+# void _thread_fp_save(struct thread_fpstate * fp)
+# void _thread_fp_restore(const struct thread_fpstate * fp)
+#
+# Save the f registers and fcsr of the hart to /fp/, and load them from /fp/.
+# FP instructions are illegal while sstatus.FS is Off, so both first set FS to
+# at least Clean (restoring makes it Dirty). The caller sets the FS field the
+# thread returns to U mode with.
+
+_thread_fp_save:
+        li      t0, 2 << 13     # sstatus.FS = Clean or Dirty
+        csrs    sstatus, t0
+
+        fsd     f0, 0*8(a0)
+        fsd     f1, 1*8(a0)
+        fsd     f2, 2*8(a0)
+        fsd     f3, 3*8(a0)
+        fsd     f4, 4*8(a0)
+        fsd     f5, 5*8(a0)
+        fsd     f6, 6*8(a0)
+        fsd     f7, 7*8(a0)
+        fsd     f8, 8*8(a0)
+        fsd     f9, 9*8(a0)
+        fsd     f10, 10*8(a0)
+        fsd     f11, 11*8(a0)
+        fsd     f12, 12*8(a0)
+        fsd     f13, 13*8(a0)
+        fsd     f14, 14*8(a0)
+        fsd     f15, 15*8(a0)
+        fsd     f16, 16*8(a0)
+        fsd     f17, 17*8(a0)
+        fsd     f18, 18*8(a0)
+        fsd     f19, 19*8(a0)
+        fsd     f20, 20*8(a0)
+        fsd     f21, 21*8(a0)
+        fsd     f22, 22*8(a0)
+        fsd     f23, 23*8(a0)
+        fsd     f24, 24*8(a0)
+        fsd     f25, 25*8(a0)
+        fsd     f26, 26*8(a0)
+        fsd     f27, 27*8(a0)
+        fsd     f28, 28*8(a0)
+        fsd     f29, 29*8(a0)
+        fsd     f30, 30*8(a0)
+        fsd     f31, 31*8(a0)
+
+        frcsr   t0
+        sd      t0, 32*8(a0)
+        ret
+
+        .global _thread_fp_restore
+        .type   _thread_fp_restore, @function
+
+_thread_fp_restore:
+        li      t0, 2 << 13     # sstatus.FS = Clean or Dirty
+        csrs    sstatus, t0
+
+        fld     f0, 0*8(a0)
+        fld     f1, 1*8(a0)
+        fld     f2, 2*8(a0)
+        fld     f3, 3*8(a0)
+        fld     f4, 4*8(a0)
+        fld     f5, 5*8(a0)
+        fld     f6, 6*8(a0)
+        fld     f7, 7*8(a0)
+        fld     f8, 8*8(a0)
+        fld     f9, 9*8(a0)
+        fld     f10, 10*8(a0)
+        fld     f11, 11*8(a0)
+        fld     f12, 12*8(a0)
+        fld     f13, 13*8(a0)
+        fld     f14, 14*8(a0)
+        fld     f15, 15*8(a0)
+        fld     f16, 16*8(a0)
+        fld     f17, 17*8(a0)
+        fld     f18, 18*8(a0)
+        fld     f19, 19*8(a0)
+        fld     f20, 20*8(a0)
+        fld     f21, 21*8(a0)
+        fld     f22, 22*8(a0)
+        fld     f23, 23*8(a0)
+        fld     f24, 24*8(a0)
+        fld     f25, 25*8(a0)
+        fld     f26, 26*8(a0)
+        fld     f27, 27*8(a0)
+        fld     f28, 28*8(a0)
+        fld     f29, 29*8(a0)
+        fld     f30, 30*8(a0)
+        fld     f31, 31*8(a0)
+
+        ld      t0, 32*8(a0)
+        fscsr   t0
+        ret
+
+
 
-# Statically allocated stack for the idle thread.
+# Statically allocated stack for the idle thread of hart 0. The idle threads
+# of other harts get a page each.
 
         .section        .data.stack, "wa", @progbits
         .balign          16
@@ -15,14 +15,49 @@
 #include "process.h"
 #include "memory.h"
 #include "process.h"
+#include "error.h"
+#include "timer.h"
+#include "spinlock.h"
 
 // COMPILE-TIME PARAMETERS
 //
 
-// NTHR is the maximum number of threads
+// NTHR is the maximum number of threads. The thread table is allocated in
+// chunks of THRTAB_CHUNK entries as threads are created, so a large NTHR only
+// costs a pointer per chunk. A free-TID bitmap per chunk, and a bitmap of the
+// chunks with free TIDs, make allocating a TID constant-time; hence NTHR may
+// be at most THRTAB_CHUNK * 64.
 
 #ifndef NTHR
-#define NTHR 16
+#define NTHR 4096
+#endif
+
+#define THRTAB_CHUNK 64
+#define THRTAB_NCHUNK ((NTHR + THRTAB_CHUNK-1) / THRTAB_CHUNK)
+
+#if 64 < THRTAB_NCHUNK
+#error "NTHR too large"
+#endif
+
+// THREAD_QUANTUM is the length of a time slice in timer ticks (TICK_PERIOD in
+// timer.c) at the highest priority; each lower priority doubles it. A thread
+// that has run for a whole slice drops a priority, and is preempted at the
+// next interrupt that finds a thread of the same or higher priority ready and
+// preemption enabled.
+
+#ifndef THREAD_QUANTUM
+#define THREAD_QUANTUM 2
+#endif
+
+#define QUANTUM(prio) (THREAD_QUANTUM << (prio))
+
+// THREAD_BOOST is the period of the priority boost in timer ticks. Every
+// THREAD_BOOST ticks charged on a hart, the running thread and the threads
+// ready on that hart go back to their base priority, so CPU-bound threads that
+// drifted down are not starved by a steady stream of higher-priority ones.
+
+#ifndef THREAD_BOOST
+#define THREAD_BOOST 50
 #endif
 
 // EXPORTED GLOBAL VARIABLES
@@ -48,6 +83,13 @@ struct thread_context {
     void * sp;
 };
 
+// FP registers of a user thread (see thread_handle_fp_fault)
+
+struct thread_fpstate {
+    uint64_t f[32];
+    uint64_t fcsr;
+};
+
 struct thread {
     struct thread_context context; // must be first member (thrasm.s)
     const char * name;
@@ -57,39 +99,132 @@ struct thread {
     int id;
     struct process * proc;
     struct thread * parent;
+    struct thread * children; // first child, linked through sibling
+    struct thread * sibling; // next child of parent
     struct thread * list_next;
     struct condition * wait_cond;
     struct condition child_exit;
+    int preempt_cnt; // preempt_disable nesting depth
+    int slice; // timer ticks left in the time slice
+    int prio; // current priority, 0 is the highest
+    int base_prio; // priority set by thread_set_priority, restored on wakeup
+    struct hart * hart; // hart it runs on, or last ran on if not running
+    struct thread_fpstate * fp; // NULL until the first FP instruction
+};
+
+// Scheduler state of a hart. The last ready queue only ever holds the hart's
+// own idle thread, which is not counted in nready.
+
+struct hart {
+    int id; // mhartid
+    struct thread * thread; // running thread
+    struct thread * idle;
+    struct thread_list ready_list[THREAD_NPRIO+1];
+    int nready; // threads on ready_list other than idle
+    int boost_ticks; // ticks charged since the last priority boost
+    char need_resched;
+    struct thread * fp_owner; // thread whose FP state is in the f registers
 };
 
 // INTERNAL GLOBAL VARIABLES
 //
 
 #define MAIN_TID 0
-#define IDLE_TID (NTHR-1)
+#define IDLE_TID 1
+
+// The idle thread has a priority of its own, below all others
+
+#define IDLE_PRIO THREAD_NPRIO
+
+static struct hart harts[NHART];
 
 struct thread main_thread = {
     .name = "main",
     .id = MAIN_TID,
     .state = THREAD_RUNNING,
+    .slice = QUANTUM(0),
     .child_exit = {
         .name = "main.child_exit"
-    }
+    },
+    .hart = &harts[0]
 };
 
+// The idle thread of hart 0; other harts get theirs in thread_start_harts
+
 struct thread idle_thread = {
     .name = "idle",
     .id = IDLE_TID,
     .state = THREAD_READY,
-    .parent = &main_thread
+    .parent = &main_thread,
+    .prio = IDLE_PRIO,
+    .base_prio = IDLE_PRIO,
+    .hart = &harts[0]
 };
 
-static struct thread * thrtab[NTHR] = {
-    [MAIN_TID] = &main_thread,
-    [IDLE_TID] = &idle_thread
+// The thread table maps a TID to its struct thread. Chunk /c/ holds TIDs
+// c*THRTAB_CHUNK and up; bit /i/ of its free mask is set if TID
+// c*THRTAB_CHUNK+i is free. Bit /c/ of thrtab_free is set if chunk /c/ has a
+// free TID or has not been allocated yet. Chunks are never freed, so a lookup
+// needs no locking.
+
+struct thrtab_chunk {
+    struct thread * thr[THRTAB_CHUNK];
+    uint64_t free;
 };
 
-static struct thread_list ready_list;
+static struct thrtab_chunk thrtab_chunk0 = {
+    .thr = {
+        [MAIN_TID] = &main_thread,
+        [IDLE_TID] = &idle_thread
+    },
+    .free = ~((1UL << MAIN_TID) | (1UL << IDLE_TID))
+};
+
+static struct thrtab_chunk * thrtab[THRTAB_NCHUNK] = {
+    [0] = &thrtab_chunk0
+};
+
+static uint64_t thrtab_free = ~(uint64_t)0;
+
+// Each hart has its own ready-to-run threads, one FIFO per priority, in
+// ready_list. The running thread is on none of them. A thread goes on the
+// queues of the hart it last ran on, unless that hart is busy and another is
+// idle (see rqplace); a hart that runs out takes threads from the hart with
+// the most (see rqsteal). All of this is under the kernel lock.
+//
+// need_resched is set when the running thread should give up the hart at the
+// next safe point: by thread_tick when its time slice is used up, and by
+// rqplace when a thread of higher priority wakes up. Cleared whenever a thread
+// is switched to.
+
+static struct hart harts[NHART] = {
+    [0] = {
+        .id = 0,
+        .thread = &main_thread,
+        .idle = &idle_thread
+    }
+};
+
+// Bit /h/ is set if hart /h/ has been started
+
+static unsigned int hart_online = 1;
+
+// The kernel lock (see thread.h). Hart 0 holds it from boot on.
+
+static struct spinlock kernel_lock = {
+    .locked = 1,
+    .name = "kernel"
+};
+
+// From start.s: harts waiting to be started, and the stack anchor of the idle
+// thread each is to start on
+
+extern volatile uint64_t _hart_present;
+extern void * volatile _hart_boot_anchor[];
+
+// Cache of struct thread for spawned threads (main and idle are static)
+
+static struct kmem_cache * thread_cache;
 
 // INTERNAL MACRO DEFINITIONS
 // 
@@ -108,6 +243,14 @@ static struct thread_list ready_list;
 
 #define CURTHR ((struct thread*)__builtin_thread_pointer())
 
+// Hart the current thread runs on
+
+#define CURHART (CURTHR->hart)
+
+// CLINT software interrupt registers, one per hart (see trapasm.s)
+
+#define CLINT_MSIP_ADDR 0x2000000UL
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -130,11 +273,18 @@ static const char * thread_state_name(enum thread_state state)
     __attribute__ ((unused));
 
 // void recycle_thread(int tid)
-// Reclaims a thread's slot in thrtab and makes its parent the parent of its
-// children. Frees the struct thread of the thread.
+// Frees a thread's TID and struct thread, takes it off its parent's list of
+// children and makes its parent the parent of its children.
 
 static void recycle_thread(int tid);
 
+// struct thread * create_thread(const char * name)
+// Allocates a TID, struct thread and stack for a new child of the current
+// thread. The thread is READY but on no ready queue and has no context yet.
+// Returns NULL if there are NTHR threads already.
+
+static struct thread * create_thread(const char * name);
+
 // void suspend_self(void)
 // Suspends the currently running thread and resumes the next thread on the
 // ready-to-run list using _thread_swtch (in threasm.s). Must be called with
@@ -147,7 +297,7 @@ static void suspend_self(void);
 
 // The following functions manipulate a thread list (struct thread_list). Note
 // that threads form a linked list via the list_next member of each thread
-// structure. Thread lists are used for the ready-to-run list (ready_list) and
+// structure. Thread lists are used for the ready queues (ready_list) and
 // for the list of waiting threads of each condition variable. These functions
 // are not interrupt-safe! The caller must disable interrupts before calling any
 // thread list function that may modify a list that is used in an ISR.
@@ -156,9 +306,71 @@ static void tlclear(struct thread_list * list);
 static int tlempty(const struct thread_list * list);
 static void tlinsert(struct thread_list * list, struct thread * thr);
 static struct thread * tlremove(struct thread_list * list);
-static void tlappend(struct thread_list * l0, struct thread_list * l1);
 
-static void idle_thread_func(void * arg);
+// The ready queues: rqinsert appends a thread to the queue of its priority on
+// its hart, rqremove takes the first thread of the highest non-empty queue of
+// the current hart, and rqtop returns the priority of that queue (IDLE_PRIO+1
+// if all are empty). rqplace puts a thread that became ready on a hart (see
+// above) and makes the hart reschedule if the thread has a higher priority
+// than the one running there. rqsteal moves the first of the highest-priority
+// threads of the hart with the most ready threads to the current hart, and
+// returns 1, or 0 if no other hart has any. Idle harts only wake up for
+// interrupts, so when a busy hart gets a thread to spare, rqinsert kicks an
+// idle one to steal it. rqboost puts the threads ready on the current hart
+// back on the queue of their base priority. Like the thread list functions,
+// these must be called with interrupts disabled if an ISR may wake threads.
+
+static void rqinsert(struct thread * thr);
+static struct thread * rqremove(void);
+static int rqtop(void);
+static int rqempty(void);
+static void rqplace(struct thread * thr);
+static int rqsteal(void);
+static void rqboost(void);
+
+// Makes a thread taken off the wait list of /cond/ runnable. Called with
+// interrupts disabled.
+
+static void wake_thread(struct thread * thr, struct condition * cond);
+
+// Raises a software interrupt on a hart, which makes it check need_resched.
+// hart_kick_idle kicks an online hart other than /busy/ and the current one
+// that is idle with nothing ready, if there is one.
+
+static void hart_kick(const struct hart * hart);
+static void hart_kick_idle(const struct hart * busy);
+
+// The thread table: thrtab_insert assigns the lowest free TID of the first
+// chunk with one to /thr/ and returns it (or -EBUSY if all NTHR TIDs are in
+// use), thrtab_remove frees a TID, and thrtab_lookup returns the thread with
+// a TID, or NULL. Modifications must be made with preemption disabled.
+
+static int thrtab_insert(struct thread * thr);
+static void thrtab_remove(int tid);
+static struct thread * thrtab_lookup(int tid);
+
+static int lowest_bit(uint64_t x);
+
+// FP state is switched lazily, with the FS field of the sstatus a user thread
+// returns to U mode with. A thread's f registers are loaded on its first FP
+// instruction after it was switched to, which traps while FS is Off (see
+// thread_handle_fp_fault), and saved when it is switched away from with FS
+// Dirty. A hart's f registers hold the state of its fp_owner, and a thread is
+// the fp_owner of at most one hart. fp_switch does the switch-time part: it
+// saves the registers of /prev/ if they changed, and turns FP off for /next/
+// unless the hart's registers are still its own. fp_disown makes sure no
+// hart's registers are taken for those of /thr/, and fp_release also frees its
+// FP state. fp_switch must be called with interrupts disabled.
+
+static void fp_switch(struct thread * prev, struct thread * next);
+static void fp_disown(const struct thread * thr);
+static void fp_release(struct thread * thr);
+
+// Trap frame of a thread that entered the kernel from U mode
+
+static struct trap_frame * user_tfr(const struct thread * thr);
+
+static void idle_thread_func(void * arg) __attribute__ ((noreturn));
 
 // IMPORTED FUNCTION DECLARATIONS
 // defined in thrasm.s
@@ -175,6 +387,9 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
 
 extern void _thread_finish_fork(struct thread * child, const struct trap_frame * parent_tfr);
 
+extern void _thread_fp_save(struct thread_fpstate * fp);
+extern void _thread_fp_restore(const struct thread_fpstate * fp);
+
 // EXPORTED FUNCTION DEFINITIONS
 //
 
@@ -182,67 +397,134 @@ int running_thread(void) {
     return CURTHR->id;
 }
 
+int running_hart(void) {
+    return CURHART->id;
+}
+
+int thread_hart_count(void) {
+    unsigned int online = hart_online;
+    int cnt = 0;
+
+    while (online != 0) {
+        cnt += online & 1;
+        online >>= 1;
+    }
+
+    return cnt;
+}
+
+void kernel_lock_acquire(void) {
+    spin_lock(&kernel_lock);
+}
+
+void kernel_lock_release(void) {
+    assert (intr_disabled());
+    spin_unlock(&kernel_lock);
+}
+
 void thread_init(void) {
     init_main_thread();
     init_idle_thread();
+    thread_cache = kmem_cache_create("thread", sizeof(struct thread));
     set_running_thread(&main_thread);
     thrmgr_initialized = 1;
 }
 
-// This thread_spawn function should replace youre existing thread_spawn function in thread.c
-int thread_spawn(const char * name, void (*start)(void *), void * arg) {
+void thread_start_harts(void) {
     struct thread_stack_anchor * stack_anchor;
+    struct thread * idle;
+    struct hart * hart;
     void * stack_page;
-    struct thread * child;
-    int saved_intr_state;
-    int tid;
+    int h;
 
-    trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
+    // Harts announce themselves right after reset, long before hart 0 gets
+    // here.
 
-    // Find a free thread slot.
+    for (h = 1; h < NHART; h++) {
+        if ((_hart_present & (1UL << h)) == 0)
+            continue;
 
-    tid = 0;
-    while (++tid < NTHR)
-        if (thrtab[tid] == NULL)
-            break;
-    
-    if (tid == NTHR)
-        panic("Too many threads");
-    
-    // Allocate a struct thread and a stack
+        idle = kmem_cache_alloc(thread_cache);
+        memset(idle, 0, sizeof(struct thread));
 
-    child = kmalloc(sizeof(struct thread));
+        preempt_disable();
+        idle->id = thrtab_insert(idle);
+        preempt_enable();
 
-    stack_page = memory_alloc_page();
-    stack_anchor = stack_page + PAGE_SIZE;
-    stack_anchor -= 1;
-    stack_anchor->thread = child;
-    stack_anchor->reserved = 0;
+        if (idle->id < 0)
+            panic("Too many threads");
+        
+        stack_page = memory_alloc_page();
+        memory_page(stack_page)->type = PAGE_TYPE_STACK;
+        stack_anchor = stack_page + PAGE_SIZE;
+        stack_anchor -= 1;
+        stack_anchor->thread = idle;
+        stack_anchor->reserved = 0;
+
+        hart = &harts[h];
+        hart->id = h;
+        hart->thread = idle;
+        hart->idle = idle;
+
+        idle->name = "idle";
+        idle->parent = &main_thread;
+        idle->stack_base = stack_anchor;
+        idle->stack_size = idle->stack_base - stack_page;
+        idle->prio = IDLE_PRIO;
+        idle->base_prio = IDLE_PRIO;
+        idle->hart = hart;
+        set_thread_state(idle, THREAD_RUNNING);
+
+        // The hart waits for its boot anchor, then for the kernel lock
+
+        hart_online |= 1U << h;
+        __atomic_store_n(&_hart_boot_anchor[h], stack_anchor, __ATOMIC_RELEASE);
+        hart_kick(hart);
+    }
 
+    kprintf("          Harts: %d online\n", thread_hart_count());
+}
 
-    thrtab[tid] = child;
+void thread_hart_main(void) {
+    kernel_lock_acquire();
 
-    child->id = tid;
-    child->name = name;
-    child->parent = CURTHR;
-    child->proc = CURTHR->proc;
-    child->stack_base = stack_anchor;
-    child->stack_size = child->stack_base - stack_page;
-    set_thread_state(child, THREAD_READY);
+    memory_hart_init();
+    intr_hart_init();
+    timer_hart_init();
 
-    saved_intr_state = intr_disable();
-    tlinsert(&ready_list, CURTHR);
-    intr_restore(saved_intr_state);
+    trace("Hart %d running", running_hart());
+
+    intr_enable();
+    idle_thread_func(NULL);
+}
+
+// This thread_spawn function should replace youre existing thread_spawn function in thread.c
+int thread_spawn(const char * name, void (*start)(void *), void * arg) {
+    struct thread * child;
+    int saved_intr_state;
+
+    trace("%s(name=\"%s\") in %s", __func__, name, CURTHR->name);
 
+    child = create_thread(name);
+    if (child == NULL)
+        return -EBUSY;
+    
     _thread_setup(child, child->stack_base, start, arg);
+
+    saved_intr_state = intr_disable();
+    rqplace(child);
+    intr_restore(saved_intr_state);
     
-    return tid;
+    return child->id;
 }
 
 void thread_exit(void) {
     if (CURTHR == &main_thread)
         halt_success();
     
+    // Not preempted once EXITED: suspend_self would not put us back anyway
+
+    preempt_disable();
     set_thread_state(CURTHR, THREAD_EXITED);
 
     // Signal parent in case it is waiting for us to exit
@@ -255,6 +537,13 @@ void thread_exit(void) {
 }
 
 void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
+    // The new image starts with FP off and without FP state. Leaving the
+    // kernel, so give up the kernel lock.
+
+    intr_disable();
+    fp_release(CURTHR);
+    csrc_sstatus(RISCV_SSTATUS_FS);
+    kernel_lock_release();
     _thread_finish_jump(CURTHR->stack_base, usp, upc);
 }
 
@@ -267,57 +556,124 @@ void thread_yield(void) {
     suspend_self();
 }
 
-int thread_join_any(void) {
-    int childcnt = 0;
-    int tid;
+void preempt_disable(void) {
+    CURTHR->preempt_cnt += 1;
+    asm volatile ("" ::: "memory");
+}
 
-    trace("%s() in %s", __func__, CURTHR->name);
+void preempt_enable(void) {
+    asm volatile ("" ::: "memory");
+    assert (0 < CURTHR->preempt_cnt);
+    CURTHR->preempt_cnt -= 1;
 
-    // See if there are any children of the current thread, and if they have
-    // already exited. If so, call thread_wait_one() to finish up.
+    // Catch up on a preemption that came due while it was disabled
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL && thrtab[tid]->parent == CURTHR) {
-            if (thrtab[tid]->state == THREAD_EXITED)
-                return thread_join(tid);
-            childcnt++;
-        }
+    if (CURTHR->preempt_cnt == 0 && CURHART->need_resched && intr_enabled())
+        thread_preempt();
+}
+
+void thread_tick(void) {
+    struct hart * const hart = CURHART;
+
+    if (0 < CURTHR->slice)
+        CURTHR->slice -= 1;
+    
+    if (CURTHR->slice == 0)
+        hart->need_resched = 1;
+    
+    // Periodic boost. The running thread keeps the rest of its slice; if a
+    // ready thread now outranks it, thread_preempt switches to that one.
+
+    hart->boost_ticks += 1;
+
+    if (THREAD_BOOST <= hart->boost_ticks) {
+        hart->boost_ticks = 0;
+        CURTHR->prio = CURTHR->base_prio;
+        rqboost();
+
+        if (rqtop() < CURTHR->prio)
+            hart->need_resched = 1;
     }
+}
+
+void thread_preempt(void) {
+    struct thread * const thr = CURTHR;
+
+    if (!thr->hart->need_resched || 0 < thr->preempt_cnt)
+        return;
+    
+    thr->hart->need_resched = 0;
+
+    // A thread that used up its slice is CPU-bound: it drops a priority and
+    // gets the longer slice of its new level. The idle thread stays put.
+
+    if (thr->slice == 0) {
+        if (thr->prio < THREAD_NPRIO-1)
+            thr->prio += 1;
+        thr->slice = QUANTUM(thr->prio);
+
+        if (thr != thr->hart->idle)
+            timer_slice_start(thr->slice);
+    }
+
+    // Round-robin among threads of the same priority; lower ones wait
+
+    if (rqtop() <= thr->prio)
+        thread_yield();
+}
+
+int thread_set_priority(int prio) {
+    trace("%s(%d) in %s", __func__, prio, CURTHR->name);
+
+    if (prio < 0 || THREAD_NPRIO <= prio)
+        return -EINVAL;
+    
+    CURTHR->base_prio = prio;
+    CURTHR->prio = prio;
+
+    if (rqtop() < prio)
+        thread_yield();
+    
+    return 0;
+}
+
+int thread_get_priority(void) {
+    return CURTHR->base_prio;
+}
+
+int thread_join_any(void) {
+    struct thread * child;
+
+    trace("%s() in %s", __func__, CURTHR->name);
 
     // If the current thread has no children, this is a bug. We could also
     // return -EINVAL if we want to allow the calling thread to recover.
 
-    if (childcnt == 0)
+    if (CURTHR->children == NULL)
         panic("thread_wait called by childless thread");
     
+    // Look for a child that has exited; otherwise wait for one to exit. An
+    // exiting thread signals its parent's child_exit condition, so we must
+    // not be preempted between the scan and the wait, or we could miss it.
 
-    // Wait for some child to exit. An exiting thread signals its parent's
-    // child_exit condition.
-
-    condition_wait(&CURTHR->child_exit);
+    preempt_disable();
 
-    for (tid = 1; tid < NTHR; tid++) {
-        if (thrtab[tid] != NULL &&
-            thrtab[tid]->parent == CURTHR &&
-            thrtab[tid]->state == THREAD_EXITED)
-        {
-            recycle_thread(tid);
-            return tid;
+    for (;;) {
+        for (child = CURTHR->children; child != NULL; child = child->sibling) {
+            if (child->state == THREAD_EXITED) {
+                preempt_enable();
+                return thread_join(child->id);
+            }
         }
-    }
 
-    panic("spurious child_exit signal");
+        condition_wait(&CURTHR->child_exit);
+    }
 }
 
 // Wait for specific child thread to exit. Returns the thread id of the child.
 
 int thread_join(int tid) {
-    struct thread * const child = thrtab[tid];
-
-    trace("%s(tid=%d)", __func__, tid);
-
-    if (tid <= 0 || NTHR <= tid)
-        return -1;
+    struct thread * const child = thrtab_lookup(tid);
 
     trace("%s(tid=%d) in %s", __func__, tid, CURTHR->name);
 
@@ -327,44 +683,69 @@ int thread_join(int tid) {
         return -1;
     
     // Wait for child to exit. Whenever a child exits, it signals its parent's
-    // child_exit condition.
+    // child_exit condition (see thread_join_any for the preempt_disable).
+
+    preempt_disable();
 
     while (child->state != THREAD_EXITED)
         condition_wait(&CURTHR->child_exit);
-    
+
+    preempt_enable();
     recycle_thread(tid);
 
     return tid;
 }
 
 struct process * thread_process(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->proc;
+    struct thread * const thr = thrtab_lookup(tid);
+
+    return (thr != NULL) ? thr->proc : NULL;
 }
 
 void thread_set_process(int tid, struct process * proc) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    thrtab[tid]->proc = proc;
+    struct thread * const thr = thrtab_lookup(tid);
+
+    assert (thr != NULL);
+    thr->proc = proc;
 }
 
 const char * thread_name(int tid) {
-    assert (0 <= tid || tid < NTHR);
-    assert (thrtab[tid] != NULL);
-    return thrtab[tid]->name;
+    struct thread * const thr = thrtab_lookup(tid);
+
+    assert (thr != NULL);
+    return thr->name;
 }
 
 int thread_fork_to_user(struct process* child_proc, const struct trap_frame * parent_tfr) {
 
     trace("%s() in %s", __func__, CURTHR->name);
 
+    // The child gets a copy of the parent's FP state, if it has any
+    struct thread_fpstate * child_fp = NULL;
+    if(CURTHR->fp != NULL)
+        child_fp = kmalloc(sizeof(struct thread_fpstate));
+
+    // Not preempted until the child has been switched to: the parent goes on
+    // a ready queue before the switch
+    preempt_disable();
+
     // setting for new process
-    // 1. set the new process's id
-    child_proc->id = process_count;
+    // 1. create the new thread. A process is identified by the id of its
+    // thread.
+    struct thread * child_thread = create_thread("forked");
+    if(child_thread == NULL){
+        preempt_enable();
+        kfree(child_fp);
+        return -EBUSY;
+    }
+    const int tid = child_thread->id;
+    child_proc->id = tid;
+    child_proc->tid = tid;
+    child_thread->proc = child_proc;
+    child_thread->fp = child_fp;
 
     // 2. set the new process's mtag
-    child_proc->mtag = memory_space_clone(0);
+    child_proc->mtag = memory_space_clone();
 
     // 3. set the new process's io table
     for(int i = 0; i < PROCESS_IOMAX; i++){
@@ -373,26 +754,13 @@ int thread_fork_to_user(struct process* child_proc, const struct trap_frame * pa
     }
     trace("child process's iotab is set");
 
-    // 4. set the new process's thread id
-    // Create a new thread
-    trace("123");
-    trace("234");
-    int tid = thread_spawn("forked", NULL, NULL);//starts at the same point, may be is parent_tfr->sepc+4
-    trace("345");
-    if(tid < 0) {
-        return tid;
-    }
-    child_proc->tid = tid;
-
-    // Set the new process to the process table
-    proctab[process_count] = child_proc;
-    process_count++;
-
-    // Set the new process to the new thread
-    thread_set_process(tid, child_proc);
-
-    // get child thread pointer
-    struct thread * child_thread = thrtab[tid];
+    // Pages of the executable not yet loaded by the parent are loaded by the
+    // child on demand from the same file.
+    child_proc->image = CURTHR->proc->image;
+    if(child_proc->image.io != NULL) ioref(child_proc->image.io);
+    vm_map_copy(&child_proc->vmap, &CURTHR->proc->vmap);
+    child_proc->exec_time = 0;
+    child_proc->pages_loaded = 0;
 
     //initialize stack anchor
     struct thread_stack_anchor * stack_anchor;
@@ -403,13 +771,30 @@ int thread_fork_to_user(struct process* child_proc, const struct trap_frame * pa
     //change to sscratch
     uintptr_t sscratch = (uintptr_t)stack_anchor;
 
+    // The child starts from a copy of the trap frame on its own stack: once
+    // _thread_finish_fork releases the kernel lock, the parent may run on
+    // another hart and reuse its trap frame
+    struct trap_frame * child_tfr = (struct trap_frame *)stack_anchor - 1;
+    *child_tfr = *parent_tfr;
+
     set_thread_state(child_thread, THREAD_RUNNING);
-    set_thread_state(CURTHR, THREAD_READY);
 
     memory_space_switch(child_proc->mtag);
 
     int s = intr_disable();
 
+    // Save the parent's f registers if it changed them, then copy them; the
+    // child loads them on its first FP instruction
+    fp_switch(CURTHR, child_thread);
+    if(child_fp != NULL)
+        memcpy(child_fp, CURTHR->fp, sizeof(struct thread_fpstate));
+
+    set_thread_state(CURTHR, THREAD_READY);
+    rqinsert(CURTHR);
+    CURHART->thread = child_thread;
+    CURHART->need_resched = 0;
+    timer_slice_start(child_thread->slice);
+
     csrc_sstatus(RISCV_SSTATUS_SPP); // sstatus.SPP = 0
     csrs_sstatus(RISCV_SSTATUS_SPIE); // sstatus.SPIE = 1
     
@@ -417,10 +802,41 @@ int thread_fork_to_user(struct process* child_proc, const struct trap_frame * pa
         CURTHR->name, child_thread->name);
     //set sscratch
     csrw_sscratch(sscratch);
-    _thread_finish_fork(child_thread,parent_tfr);
+    _thread_finish_fork(child_thread,child_tfr);
     intr_restore(s);
+    preempt_enable();
     
-    return child_proc->id;
+    return tid;
+}
+
+int thread_handle_fp_fault(struct trap_frame * tfr) {
+    struct thread * const thr = CURTHR;
+    int saved_intr_state;
+
+    // Only an instruction that found FP off may be an FP instruction we
+    // should let through
+
+    if ((tfr->sstatus & RISCV_SSTATUS_FS) != RISCV_SSTATUS_FS_OFF)
+        return -EINVAL;
+
+    // The FP registers of a thread start out zero
+
+    if (thr->fp == NULL)
+        thr->fp = kcalloc(1, sizeof(struct thread_fpstate));
+
+    saved_intr_state = intr_disable();
+
+    fp_disown(thr);
+    _thread_fp_restore(thr->fp);
+    CURHART->fp_owner = thr;
+
+    intr_restore(saved_intr_state);
+
+    trace("Thread <%s> loaded FP state", thr->name);
+
+    tfr->sstatus &= ~RISCV_SSTATUS_FS;
+    tfr->sstatus |= RISCV_SSTATUS_FS_CLEAN;
+    return 0;
 }
 
 void condition_init(struct condition * cond, const char * name) {
@@ -435,8 +851,10 @@ void condition_wait(struct condition * cond) {
 
     assert(CURTHR->state == THREAD_RUNNING);
 
-    // Insert current thread into condition wait list
+    // Insert current thread into condition wait list. A WAITING thread must
+    // not be preempted before it suspends itself: it is on no ready list.
     
+    preempt_disable();
     set_thread_state(CURTHR, THREAD_WAITING);
     CURTHR->wait_cond = cond;
     CURTHR->list_next = NULL;
@@ -446,6 +864,7 @@ void condition_wait(struct condition * cond) {
     intr_restore(saved_intr_state);
 
     suspend_self();
+    preempt_enable();
 }
 
 void condition_broadcast(struct condition * cond) {
@@ -457,25 +876,33 @@ void condition_broadcast(struct condition * cond) {
     if (tlempty(&cond->wait_list))
         return;
 
-    // Mark all waiting threads runnable. This is *not* a constant-time
-    // operation, however, keeping having an enum thread_state member of struct
-    // thread for keeping track of thread state is useful for debugging.
+    // Mark all waiting threads runnable and move them to the ready queues, in
+    // the order they started waiting. This is *not* a constant-time operation.
 
     saved_intr_state = intr_disable();
 
-    for (thr = cond->wait_list.head; thr != NULL; thr = thr->list_next) {
-        assert (thr->state == THREAD_WAITING);
-        assert (thr->wait_cond == cond);
-        set_thread_state(thr, THREAD_READY);
-        thr->wait_cond = NULL;
-    }
+    while ((thr = tlremove(&cond->wait_list)) != NULL)
+        wake_thread(thr, cond);
+
+    intr_restore(saved_intr_state);
+}
 
-    // Append condition variable wait list to run list
+int condition_signal(struct condition * cond) {
+    int saved_intr_state;
+    struct thread * thr;
+    int tid = -1;
 
-    tlappend(&ready_list, &cond->wait_list);
-    tlclear(&cond->wait_list);
+    saved_intr_state = intr_disable();
+
+    thr = tlremove(&cond->wait_list);
+
+    if (thr != NULL) {
+        wake_thread(thr, cond);
+        tid = thr->id;
+    }
 
     intr_restore(saved_intr_state);
+    return tid;
 }
 
 // INTERNAL FUNCTION DEFINITIONS
@@ -499,7 +926,7 @@ void init_idle_thread(void) {
     idle_thread.stack_base = _idle_stack_anchor;
     idle_thread.stack_size = _idle_stack_anchor - _idle_stack_lowest;
     _thread_setup(&idle_thread, _idle_stack_anchor, idle_thread_func);
-    tlinsert(&ready_list, &idle_thread); // interrupts still disabled
+    rqinsert(&idle_thread); // interrupts still disabled
 
 }
 
@@ -523,22 +950,94 @@ const char * thread_state_name(enum thread_state state) {
         return "UNDEFINED";
 };
 
+struct thread * create_thread(const char * name) {
+    struct thread_stack_anchor * stack_anchor;
+    void * stack_page;
+    struct thread * child;
+    int tid;
+
+    // Allocate a struct thread and a TID. The thread is filled in before
+    // anyone else gets to look it up.
+
+    preempt_disable();
+
+    child = kmem_cache_alloc(thread_cache);
+    tid = thrtab_insert(child);
+
+    if (tid < 0) {
+        kmem_cache_free(thread_cache, child);
+        preempt_enable();
+        return NULL;
+    }
+    
+    // Allocate a stack
+
+    stack_page = memory_alloc_page();
+    memory_page(stack_page)->type = PAGE_TYPE_STACK;
+    stack_anchor = stack_page + PAGE_SIZE;
+    stack_anchor -= 1;
+    stack_anchor->thread = child;
+    stack_anchor->reserved = 0;
+
+    child->id = tid;
+    child->name = name;
+    child->parent = CURTHR;
+    child->children = NULL;
+    child->sibling = CURTHR->children;
+    CURTHR->children = child;
+    child->proc = CURTHR->proc;
+    child->stack_base = stack_anchor;
+    child->stack_size = child->stack_base - stack_page;
+    child->preempt_cnt = 0;
+    child->base_prio = CURTHR->base_prio;
+    child->prio = child->base_prio;
+    child->slice = QUANTUM(child->prio);
+    child->hart = CURHART;
+    condition_init(&child->child_exit, name);
+    set_thread_state(child, THREAD_READY);
+
+    preempt_enable();
+    return child;
+}
+
 void recycle_thread(int tid) {
-    struct thread * const thr = thrtab[tid];
-    int ctid;
+    struct thread * const thr = thrtab_lookup(tid);
+    struct thread * parent;
+    struct thread ** link;
+    struct thread * child;
 
-    assert (0 < tid && tid < NTHR && thr != NULL);
+    assert (thr != NULL && tid != MAIN_TID && tid != IDLE_TID);
     assert (thr->state == THREAD_EXITED);
 
+    parent = thr->parent;
+
+    preempt_disable();
+
+    // Take the thread off its parent's list of children
+
+    link = &parent->children;
+    while (*link != thr)
+        link = &(*link)->sibling;
+    *link = thr->sibling;
+
     // Make our parent the parent of our children
 
-    for (ctid = 1; ctid < NTHR; ctid++) {
-        if (thrtab[ctid] != NULL && thrtab[ctid]->parent == thr)
-            thrtab[ctid]->parent = thr->parent;
+    if (thr->children != NULL) {
+        for (child = thr->children; ; child = child->sibling) {
+            child->parent = parent;
+            if (child->sibling == NULL)
+                break;
+        }
+
+        child->sibling = parent->children;
+        parent->children = thr->children;
     }
 
-    thrtab[tid] = NULL;
-    kfree(thr);
+    fp_release(thr);
+    thrtab_remove(tid);
+    kmem_cache_free(thread_cache, thr);
+
+    preempt_enable();
 }
 
 void suspend_self(void) {
@@ -550,17 +1049,27 @@ void suspend_self(void) {
     trace("%s() in %s", __func__, CURTHR->name);
 
     // The idle thread is always runnable, and the idle thread only calls
-    // suspend_self() if the ready_list is not empty.
+    // suspend_self() if a ready queue is not empty.
 
-    assert (!tlempty(&ready_list));
+    assert (!rqempty());
 
     susp_thread = CURTHR;
 
-    // Get a READY thread from the ready list and mark it running
+    // Once it is back on a list, the suspending thread must not be preempted
+    // on the way out (interrupts are enabled before the switch).
+
+    susp_thread->preempt_cnt += 1;
+
+    // Get a READY thread from the ready list and mark it running. Rather
+    // than switch to the idle thread, see if another hart has a thread to
+    // spare.
 
     saved_intr_state = intr_disable();
 
-    next_thread = tlremove(&ready_list);
+    if (susp_thread != CURHART->idle && rqtop() == IDLE_PRIO)
+        rqsteal();
+
+    next_thread = rqremove();
 
     trace("Thread <%s> selected from ready list", next_thread->name);
 
@@ -571,19 +1080,33 @@ void suspend_self(void) {
 
     assert(next_thread->state == THREAD_READY);
     set_thread_state(next_thread, THREAD_RUNNING);
+    next_thread->slice = QUANTUM(next_thread->prio);
+    next_thread->hart = CURHART;
+    CURHART->thread = next_thread;
+    CURHART->need_resched = 0;
+
+    // Without ticks while idle, the hart sleeps until an alarm or interrupt
+
+    timer_slice_start((next_thread != CURHART->idle) ? next_thread->slice : -1);
     
     // If the current thread is still running, mark it ready-to-run and put it
     // in the back of the ready-to-run list.
 
     if (susp_thread->state == THREAD_RUNNING) {
         set_thread_state(susp_thread, THREAD_READY);
-        tlinsert(&ready_list, susp_thread);
+        rqinsert(susp_thread);
     }
 
+    fp_switch(susp_thread, next_thread);
     intr_enable();
 
+    // A thread without a process (idle) runs in the main space: the space the
+    // hart was in may belong to a process that exits on another hart.
+
     if (next_thread->proc != NULL)
         memory_space_switch(next_thread->proc->mtag);
+    else
+        memory_space_switch(main_mtag);
 
     trace("Thread <%s> calling _thread_swtch(<%s>)",
         CURTHR->name, next_thread->name);
@@ -598,6 +1121,7 @@ void suspend_self(void) {
         prev_thread->stack_size = 0;
     }
 
+    CURTHR->preempt_cnt -= 1;
     intr_restore(saved_intr_state);
 }
 
@@ -646,25 +1170,266 @@ struct thread * tlremove(struct thread_list * list) {
     return thr;
 }
 
-// Appends elements of l1 to the end of l0 and clears l1.
+void rqinsert(struct thread * thr) {
+    struct hart * const hart = thr->hart;
 
-void tlappend(struct thread_list * l0, struct thread_list * l1) {
-    if (l0->head != NULL) {
-        assert(l0->tail != NULL);
-        
-        if (l1->head != NULL) {
-            assert(l1->tail != NULL);
-            l0->tail->list_next = l1->head;
-            l0->tail = l1->tail;
+    tlinsert(&hart->ready_list[thr->prio], thr);
+
+    if (thr != hart->idle) {
+        hart->nready += 1;
+
+        if (hart->nready == 1 && hart->thread != hart->idle)
+            hart_kick_idle(hart);
+    }
+}
+
+struct thread * rqremove(void) {
+    struct hart * const hart = CURHART;
+    const int prio = rqtop();
+    struct thread * thr;
+
+    if (IDLE_PRIO < prio)
+        return NULL;
+    
+    thr = tlremove(&hart->ready_list[prio]);
+
+    if (thr != hart->idle)
+        hart->nready -= 1;
+    
+    return thr;
+}
+
+int rqtop(void) {
+    struct hart * const hart = CURHART;
+    int prio;
+
+    for (prio = 0; prio <= IDLE_PRIO; prio++)
+        if (!tlempty(&hart->ready_list[prio]))
+            break;
+    
+    return prio;
+}
+
+int rqempty(void) {
+    return (IDLE_PRIO < rqtop());
+}
+
+void rqplace(struct thread * thr) {
+    struct hart * hart = thr->hart;
+    int h;
+
+    if (hart->thread != hart->idle) {
+        for (h = 0; h < NHART; h++) {
+            if ((hart_online & (1U << h)) != 0 &&
+                harts[h].thread == harts[h].idle && harts[h].nready == 0)
+            {
+                hart = &harts[h];
+                break;
+            }
         }
-    } else {
-        assert(l0->tail == NULL);
-        l0->head = l1->head;
-        l0->tail = l1->tail;
     }
 
-    l1->head = NULL;
-    l1->tail = NULL;
+    thr->hart = hart;
+    rqinsert(thr);
+
+    if (thr->prio < hart->thread->prio) {
+        hart->need_resched = 1;
+        if (hart != CURHART)
+            hart_kick(hart);
+    }
+}
+
+int rqsteal(void) {
+    struct hart * const self = CURHART;
+    struct hart * victim = NULL;
+    struct thread * thr;
+    int h, prio;
+
+    for (h = 0; h < NHART; h++) {
+        if ((hart_online & (1U << h)) != 0 && &harts[h] != self &&
+            0 < harts[h].nready &&
+            (victim == NULL || victim->nready < harts[h].nready))
+        {
+            victim = &harts[h];
+        }
+    }
+
+    if (victim == NULL)
+        return 0;
+    
+    // The victim has a thread above its idle thread's priority
+
+    for (prio = 0; tlempty(&victim->ready_list[prio]); prio++)
+        continue;
+    
+    thr = tlremove(&victim->ready_list[prio]);
+    victim->nready -= 1;
+
+    trace("Hart %d takes <%s> from hart %d", self->id, thr->name, victim->id);
+
+    thr->hart = self;
+    rqinsert(thr);
+    return 1;
+}
+
+void rqboost(void) {
+    struct hart * const hart = CURHART;
+    struct thread_list list;
+    struct thread * thr;
+    int prio;
+
+    // A thread only ever drifts to queues after the one of its base priority,
+    // so each thread moves to a queue that was already drained or its own.
+
+    for (prio = 1; prio < THREAD_NPRIO; prio++) {
+        list = hart->ready_list[prio];
+        tlclear(&hart->ready_list[prio]);
+
+        while ((thr = tlremove(&list)) != NULL) {
+            thr->prio = thr->base_prio;
+            tlinsert(&hart->ready_list[thr->prio], thr);
+        }
+    }
+}
+
+void hart_kick(const struct hart * hart) {
+    *(volatile uint32_t *)(CLINT_MSIP_ADDR + 4 * hart->id) = 1;
+}
+
+void hart_kick_idle(const struct hart * busy) {
+    int h;
+
+    for (h = 0; h < NHART; h++) {
+        if ((hart_online & (1U << h)) != 0 &&
+            &harts[h] != busy && &harts[h] != CURHART &&
+            harts[h].thread == harts[h].idle && harts[h].nready == 0)
+        {
+            hart_kick(&harts[h]);
+            return;
+        }
+    }
+}
+
+int thrtab_insert(struct thread * thr) {
+    struct thrtab_chunk * chunk;
+    int c, i;
+
+    if (thrtab_free == 0)
+        return -EBUSY;
+    
+    c = lowest_bit(thrtab_free);
+
+    if (THRTAB_NCHUNK <= c)
+        return -EBUSY;
+    
+    if (thrtab[c] == NULL) {
+        thrtab[c] = kcalloc(1, sizeof(struct thrtab_chunk));
+        thrtab[c]->free = ~(uint64_t)0;
+
+        // The last chunk may run past NTHR; those TIDs are never free
+
+        if (NTHR < (c+1) * THRTAB_CHUNK)
+            thrtab[c]->free >>= (c+1) * THRTAB_CHUNK - NTHR;
+    }
+
+    chunk = thrtab[c];
+    i = lowest_bit(chunk->free);
+
+    chunk->free &= ~(1UL << i);
+    if (chunk->free == 0)
+        thrtab_free &= ~(1UL << c);
+    
+    chunk->thr[i] = thr;
+    return c * THRTAB_CHUNK + i;
+}
+
+void thrtab_remove(int tid) {
+    const int c = tid / THRTAB_CHUNK;
+    const int i = tid % THRTAB_CHUNK;
+
+    thrtab[c]->thr[i] = NULL;
+    thrtab[c]->free |= 1UL << i;
+    thrtab_free |= 1UL << c;
+}
+
+struct thread * thrtab_lookup(int tid) {
+    const int c = tid / THRTAB_CHUNK;
+
+    if (tid < 0 || NTHR <= tid || thrtab[c] == NULL)
+        return NULL;
+    
+    return thrtab[c]->thr[tid % THRTAB_CHUNK];
+}
+
+// Returns the index of the lowest set bit of /x/, which must not be zero. The
+// kernel is linked without libgcc, so __builtin_ctzl is only used where it
+// becomes a single ctz instruction (Zbb); on plain rv64g it would be a call to
+// __ctzdi2, so the index is found by binary search instead.
+
+int lowest_bit(uint64_t x) {
+#ifdef __riscv_zbb
+    return __builtin_ctzl(x);
+#else
+    int n = 0;
+
+    if ((x & 0xFFFFFFFF) == 0) { n += 32; x >>= 32; }
+    if ((x & 0xFFFF) == 0) { n += 16; x >>= 16; }
+    if ((x & 0xFF) == 0) { n += 8; x >>= 8; }
+    if ((x & 0xF) == 0) { n += 4; x >>= 4; }
+    if ((x & 0x3) == 0) { n += 2; x >>= 2; }
+    if ((x & 0x1) == 0) { n += 1; }
+
+    return n;
+#endif
+}
+
+void wake_thread(struct thread * thr, struct condition * cond) {
+    assert (thr->state == THREAD_WAITING);
+    assert (thr->wait_cond == cond);
+    set_thread_state(thr, THREAD_READY);
+    thr->wait_cond = NULL;
+
+    // A thread that blocked is treated as interactive: it gets its base
+    // priority back, and preempts a thread of lower priority.
+
+    thr->prio = thr->base_prio;
+    rqplace(thr);
+}
+
+void fp_switch(struct thread * prev, struct thread * next) {
+    struct trap_frame * tfr;
+
+    if (prev->fp != NULL && prev->state != THREAD_EXITED) {
+        tfr = user_tfr(prev);
+
+        if ((tfr->sstatus & RISCV_SSTATUS_FS) == RISCV_SSTATUS_FS_DIRTY) {
+            _thread_fp_save(prev->fp);
+            tfr->sstatus &= ~RISCV_SSTATUS_FS;
+            tfr->sstatus |= RISCV_SSTATUS_FS_CLEAN;
+        }
+    }
+
+    if (next->fp != NULL && CURHART->fp_owner != next)
+        user_tfr(next)->sstatus &= ~RISCV_SSTATUS_FS;
+}
+
+void fp_disown(const struct thread * thr) {
+    int h;
+
+    for (h = 0; h < NHART; h++) {
+        if (harts[h].fp_owner == thr)
+            harts[h].fp_owner = NULL;
+    }
+}
+
+void fp_release(struct thread * thr) {
+    fp_disown(thr);
+    kfree(thr->fp);
+    thr->fp = NULL;
+}
+
+struct trap_frame * user_tfr(const struct thread * thr) {
+    return (struct trap_frame *)thr->stack_base - 1;
 }
 
 void idle_thread_func(void * arg __attribute__ ((unused))) {
@@ -673,20 +1438,49 @@ void idle_thread_func(void * arg __attribute__ ((unused))) {
     // avoid a race condition where an ISR marks a thread ready to run between
     // the call to tlempty() and the wfi instruction.
 
+    int stolen;
+
     for (;;) {
         // If there are runnable threads, yield to them.
 
-        while (!tlempty(&ready_list))
+        while (!rqempty())
             thread_yield();
         
+        // None of our own: take one from a busier hart
+
+        intr_disable();
+        stolen = rqsteal();
+        intr_enable();
+
+        if (stolen)
+            continue;
+        
+        // Nothing to run: zero a few free pages for later allocations, or
+        // link more of the RAM memory_init left untouched onto the free
+        // lists, then check the ready list again. Only sleep once both are
+        // done.
+
+        if (memory_refill_zero_pool(ZERO_POOL_CHUNK) != 0)
+            continue;
+        
+        if (memory_carve_free_blocks(CARVE_CHUNK) != 0)
+            continue;
+
         // No runnable threads. Sleep using the wfi instruction. Note that we
         // need to disable interrupts and check the runnable thread list one
         // more time (make sure it is empty) to avoid a race condition where an
         // ISR marks a thread ready before we call the wfi instruction.
 
+        // Other harts need the kernel lock while we sleep. An interrupt that
+        // comes in the meantime stays pending and ends the wfi; we take it
+        // once we have the lock back.
+
         intr_disable();
-        if (tlempty(&ready_list))
+        if (rqempty()) {
+            kernel_lock_release();
             asm ("wfi");
+            kernel_lock_acquire();
+        }
         intr_enable();
     }
 }
@@ -7,6 +7,28 @@
 #include "trap.h"
 #include <stddef.h>
 
+// COMPILE-TIME PARAMETERS
+//
+
+// THREAD_NPRIO is the number of thread priorities. Priority 0 is the highest
+// and the default; CPU-bound threads drift towards THREAD_NPRIO-1.
+
+#ifndef THREAD_NPRIO
+#define THREAD_NPRIO 4
+#endif
+
+// NHART is the maximum number of harts (processors) the kernel runs on; any
+// others are left parked. start.s and struct page (memory.h) have room for at
+// most 8.
+
+#ifndef NHART
+#define NHART 8
+#endif
+
+#if 8 < NHART
+#error "NHART too large"
+#endif
+
 struct thread; // forward decl.
 struct process; // forward decl.
 
@@ -36,11 +58,50 @@ extern char thrmgr_initialized;
 
 extern void thread_init(void);
 
+// void thread_start_harts(void)
+// Starts every other hart that came up (up to NHART), each with an idle thread
+// and ready queues of its own. Called by main once the kernel is initialized.
+// A hart that has run out of threads takes a ready thread from the hart with
+// the most; a thread that wakes up goes to an idle hart if there is one.
+
+extern void thread_start_harts(void);
+
+// void thread_hart_main(void)
+// Runs the idle thread of a hart started by thread_start_harts. Called from
+// start.s on that hart, with tp pointing to the idle thread; does not return.
+
+extern void thread_hart_main(void) __attribute__ ((noreturn));
+
 // int running_thread(void)
 // Returns the thread id of the currently running thread.
 
 int running_thread(void);
 
+// int running_hart(void)
+// Returns the id of the hart the current thread runs on, which only stays the
+// same while preemption or interrupts are disabled.
+
+extern int running_hart(void);
+
+// int thread_hart_count(void)
+// Returns the number of harts the kernel runs on.
+
+extern int thread_hart_count(void);
+
+// void kernel_lock_acquire(void)
+// void kernel_lock_release(void)
+// The kernel lock is a spin lock that a hart holds whenever it runs kernel
+// code, so that at most one hart at a time is in the kernel, while any number
+// run in U mode. The lock belongs to the hart, not to a thread: it is held
+// across context switches, and a thread resumed on another hart finds it held
+// there. A hart takes it on a trap from U mode and gives it up on the way back
+// to U mode, and its idle thread gives it up while it waits for an interrupt.
+// Thus preempt_disable and intr_disable still exclude every other thread and
+// ISR in the system. Interrupts must be disabled when the lock is released.
+
+extern void kernel_lock_acquire(void);
+extern void kernel_lock_release(void);
+
 // int thread_spawn(const char * name, void (*start)(void *), void * arg)
 // Creates and starts a new thread. Argument /name/ is the name of the thread
 // (optional, may be NULL), /start/ is the thread entry point, and /arg/ is an
@@ -57,10 +118,54 @@ extern int thread_spawn(const char * name, void (*start)(void *), void * arg);
 
 extern void thread_yield(void);
 
+// void preempt_disable(void)
+// void preempt_enable(void)
+// Keep the current thread from being preempted between the two calls, which
+// nest. Interrupts are still taken, so this protects data shared with other
+// threads but not data shared with an ISR; use intr_disable for that. The
+// thread may still block, e.g. in condition_wait. preempt_enable yields if the
+// thread's time slice ran out in the meantime and interrupts are enabled.
+
+extern void preempt_disable(void);
+extern void preempt_enable(void);
+
+// int thread_set_priority(int prio)
+// Sets the priority of the current thread to /prio/, between 0 (highest) and
+// THREAD_NPRIO-1. The scheduler lowers the priority of a thread each time it
+// uses up its time slice and restores it to /prio/ when the thread wakes up
+// after blocking, or at the next periodic boost (THREAD_BOOST in thread.c).
+// Returns 0 on success or -EINVAL if /prio/ is out of range.
+
+extern int thread_set_priority(int prio);
+
+// int thread_get_priority(void)
+// Returns the priority last set with thread_set_priority (or inherited from the
+// parent) of the current thread, not the one the scheduler lowered it to.
+
+extern int thread_get_priority(void);
+
+// void thread_tick(void)
+// Charges a timer tick to the running thread's time slice, and boosts the
+// threads of the hart back to their base priority once every THREAD_BOOST
+// ticks. Called by timer_intr_handler once every TICK_PERIOD.
+
+extern void thread_tick(void);
+
+// void thread_preempt(void)
+// Yields the CPU if preemption is enabled and either the running thread has
+// used up its time slice and a thread of the same or higher priority is ready,
+// or a thread of higher priority has woken up. Called by intr_handler before
+// it returns, which is a safe point in both U and S mode.
+
+extern void thread_preempt(void);
+
 // int thread_join_any(void) int thread_join(int tid) Waits for a child thread
 // of the current thread to exit. The thread_join_any function waits for any of
 // the current thread's children to exit, while thread_join waits for a specific
-// thread, given by /tid/, to exit.
+// thread, given by /tid/, to exit. Each thread keeps a list of its children,
+// so waiting takes time proportional to the number of children, not threads.
+// The thread_join function returns -1 if /tid/ is not a child of the current
+// thread.
 
 extern int thread_join_any(void);
 extern int thread_join(int tid);
@@ -69,7 +174,8 @@ extern int thread_join(int tid);
 // Forks a new thread and process. Argument /child_proc/ is a pointer to a struct
 // process to initialize. Argument /parent_tfr/ is a pointer to the trap frame of
 // the parent thread. The new thread starts at the same address as the parent
-// thread. 
+// thread. The new process gets the id of the new thread, which is returned.
+// Returns -EBUSY if there are NTHR threads already.
 extern int thread_fork_to_user(struct process* child_proc, const struct trap_frame * parent_tfr);
 
 // void thread_exit(void)
@@ -77,12 +183,23 @@ extern int thread_fork_to_user(struct process* child_proc, const struct trap_fra
 
 extern void thread_exit(void) __attribute__ ((noreturn));
 
+// int thread_handle_fp_fault(struct trap_frame * tfr)
+// Called on an illegal instruction exception from U mode. User threads run
+// with FP off (sstatus.FS) until they use it, and again after they have been
+// switched away from, if their FP registers are no longer in the hart's. If FP
+// was off, loads the thread's FP registers (zero on first use), turns FP on in
+// /tfr/, and returns 0 so that the instruction is retried. Returns a negative
+// error code if the instruction is illegal regardless.
+
+extern int thread_handle_fp_fault(struct trap_frame * tfr);
+
 extern void __attribute__ ((noreturn)) thread_jump_to_user (
     uintptr_t usp, uintptr_t upc);
 
 
 // Returns a pointer to the process struct of a thread's process, or NULL if the
-// specified thread does not have an associated process (e.g. idle).
+// specified thread does not have an associated process (e.g. idle) or does not
+// exist. A process has the same id as its thread.
 
 extern struct process * thread_process(int tid);
 
@@ -119,8 +236,17 @@ extern void condition_wait(struct condition * cond);
 // an ISR. Calling condition_broadcast() does not cause a context switch from
 // the currently running thread.
 // Waiting threads are added to the ready-to-run list in the order they were
-// added to the wait queue.
+// added to the wait queue, at their base priority. If one of them has a higher
+// priority than the running thread, the running thread is preempted at the
+// next safe point.
 
 extern void condition_broadcast(struct condition * cond);
 
+// int condition_signal(struct condition * cond)
+// Wakes up the thread that has been waiting on a condition the longest, like
+// condition_broadcast does. Returns its thread id, or -1 if no thread was
+// waiting. May be called from an ISR.
+
+extern int condition_signal(struct condition * cond);
+
 #endif // _THREAD_H_
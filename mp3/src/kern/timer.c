@@ -6,6 +6,12 @@
 #include "csr.h"
 #include "intr.h"
 #include "halt.h" // for assert
+#include "console.h"
+#include "device.h"
+#include "memory.h"
+#include "error.h"
+#include "io.h"
+#include "string.h"
 
 #include "config.h"
 #include <limits.h>
@@ -19,24 +25,120 @@
 
 #define TICK_PERIOD (TIMER_FREQ/TICK_FREQ)
 
+// Pending alarms are kept on a timing wheel of TIMER_WHEEL_SIZE buckets, each
+// covering 2^TIMER_WHEEL_SHIFT mtime ticks (about 0.8 ms by default), so the
+// wheel spans about 210 ms. An alarm due within the span goes in the bucket of
+// its wake-up time; a bucket never holds alarms from two turns of the wheel.
+// Alarms due later wait on the overflow list and move to the wheel as its span
+// reaches them. Inserting and removing an alarm takes constant time, and a
+// timer interrupt only looks at the buckets that came due since the last one.
+
+#ifndef TIMER_WHEEL_SHIFT
+#define TIMER_WHEEL_SHIFT 13
+#endif
+
+#ifndef TIMER_WHEEL_SIZE
+#define TIMER_WHEEL_SIZE 256
+#endif
+
+// In tickless mode (TIMER_TICKLESS=1), a hart's timer is programmed for the
+// next event that needs it: the earliest alarm, or the end of the running
+// thread's time slice. The ticks in between are charged all at once when the
+// timer goes off. A hart running its idle thread has no slice, so only alarms
+// wake it. Otherwise, the timer goes off at every tick.
+
+#ifndef TIMER_TICKLESS
+#define TIMER_TICKLESS 1
+#endif
+
+// With TIMER_SSTC=1, harts that have the Sstc extension program their timer
+// by writing the stimecmp CSR. Otherwise, S mode writes the hart's mtimecmp
+// and has to ecall to M mode to re-arm the interrupt (see
+// _mmode_trap_handler in trapasm.s). start.s enables Sstc on each hart that
+// supports it before main runs, so the setting is a variable it can read.
+
+#ifndef TIMER_SSTC
+#define TIMER_SSTC 1
+#endif
+
+#define CSR_STIMECMP 0x14d
+
 
 
 // EXPORTED GLOBAL VARIABLE DEFINITIONS
 // 
 
 char timer_initialized = 0;
+const int timer_use_sstc = TIMER_SSTC; // read by start.s
+
+extern volatile uint64_t _hart_sstc; // from start.s
 
 // INTERNVAL GLOBAL VARIABLE DEFINITIONS
 //
 
-static struct alarm * sleep_list;
-static uint64_t next_tick;
+// The alarms are shared; every hart has a timer (mtimecmp register) of its
+// own, which goes off at its next tick or at the first alarm, whichever comes
+// first. Ticks charge the running thread of the hart (see thread_tick).
+//
+// wheel_slot is the number of the slot (mtime >> TIMER_WHEEL_SHIFT) the wheel
+// was last advanced to; the wheel holds the alarms due in that slot and the
+// TIMER_WHEEL_SIZE-1 slots after it. overflow_min is at most the earliest
+// wake-up time on the overflow list (it is not raised when an alarm leaves
+// the list). All of this is only touched with interrupts disabled.
+
+static struct alarm * wheel[TIMER_WHEEL_SIZE];
+static uint64_t wheel_slot;
+static struct alarm * overflow;
+static uint64_t overflow_min = UINT64_MAX;
+
+// next_tick is the end of the current tick of a hart. slice_end is the end of
+// the time slice of its running thread in tickless mode: UINT64_MAX while the
+// hart is idle, and 0 if ticks are periodic.
+
+static uint64_t next_tick[NHART];
+static uint64_t slice_end[NHART];
+
+// Timer interrupts taken and ticks charged by each hart, for the "timerstat"
+// device (see timer_stats_attach)
+
+static uint64_t intr_cnt[NHART];
+static uint64_t tick_cnt[NHART];
+
+static struct io_intf stats_io;
+
+// Boot-phase log (see boot_mark). boot_time_base is the value of mtime when
+// timer_init reset it to zero.
+
+static struct {
+    const char * phase;
+    uint64_t time;
+} boot_log[BOOT_MARK_MAX];
+
+static int boot_log_cnt;
+static uint64_t boot_time_base;
 
 // INTERNAL FUNCTION DECLARATIONS
 //
 
 static void enable_mmode_timer_intr(void);
 
+// alarm_insert puts a pending alarm on the wheel or the overflow list, and
+// alarm_remove takes it off. wheel_advance fires the alarms due by /now/ and
+// moves the wheel up to /now/. wheel_next returns the earliest wake-up time
+// before /limit/, or /limit/ if there is none.
+
+static void alarm_insert(struct alarm * al);
+static void alarm_remove(struct alarm * al);
+static void wheel_advance(uint64_t now);
+static uint64_t wheel_next(uint64_t limit);
+
+static int stats_open(struct io_intf ** ioptr, void * aux);
+static int stats_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static const struct io_ops stats_io_ops = {
+    .ctl = stats_ioctl
+};
+
 static inline uint64_t get_mtime(void);
 static inline void set_mtime(uint64_t val);
 static inline uint64_t get_mtcmp(void);
@@ -46,22 +148,114 @@ static inline void set_mtcmp(uint64_t val);
 //
 
 void timer_init(void) {
+    boot_time_base = get_mtime();
     set_mtime(0);
-    set_mtcmp(TICK_PERIOD);
+    next_tick[0] = TICK_PERIOD;
+    set_mtcmp(next_tick[0]);
     csrs_sie(RISCV_SIE_STIE);
     enable_mmode_timer_intr();
 
     timer_initialized = 1;
 }
 
+void timer_hart_init(void) {
+    const int hart = running_hart();
+
+    // The hart starts out idle
+
+    next_tick[hart] = get_mtime() + TICK_PERIOD;
+    if (TIMER_TICKLESS)
+        slice_end[hart] = UINT64_MAX;
+
+    set_mtcmp(next_tick[hart]);
+    csrs_sie(RISCV_SIE_STIE);
+    enable_mmode_timer_intr();
+}
+
+void timer_slice_start(int ticks) {
+    const int hart = running_hart();
+    int saved_intr_state;
+    uint64_t now;
+
+    if (!TIMER_TICKLESS)
+        return;
+
+    saved_intr_state = intr_disable();
+
+    if (ticks < 0)
+        slice_end[hart] = UINT64_MAX;
+    else {
+        // Ticks start over when the hart leaves its idle thread. Otherwise,
+        // the previous thread may have blocked with ticks that went by since
+        // the last timer interrupt; they are not charged to the new thread.
+
+        now = get_mtime();
+
+        if (slice_end[hart] == UINT64_MAX)
+            next_tick[hart] = now + TICK_PERIOD;
+        else if (next_tick[hart] <= now) {
+            next_tick[hart] +=
+                ((now - next_tick[hart]) / TICK_PERIOD + 1) * TICK_PERIOD;
+        }
+
+        slice_end[hart] = next_tick[hart];
+        if (1 < ticks)
+            slice_end[hart] += (ticks - 1) * TICK_PERIOD;
+
+        if (slice_end[hart] < get_mtcmp()) {
+            set_mtcmp(slice_end[hart]);
+            enable_mmode_timer_intr();
+        }
+    }
+
+    intr_restore(saved_intr_state);
+}
+
+void timer_stats_attach(void) {
+    stats_io.ops = &stats_io_ops;
+    device_register("timerstat", &stats_open, NULL);
+}
+
+void boot_mark(const char * phase) {
+    uint64_t now;
+    
+    now = get_mtime();
+    if (timer_initialized)
+        now += boot_time_base;
+
+    if (boot_log_cnt < BOOT_MARK_MAX) {
+        boot_log[boot_log_cnt].phase = phase;
+        boot_log[boot_log_cnt].time = now;
+        boot_log_cnt += 1;
+    }
+}
+
+void boot_log_print(void) {
+    uint64_t prev = 0;
+    int i;
+
+    // The first phase is measured from reset, when mtime started at zero
+
+    kprintf("Boot phases (us):\n");
+
+    for (i = 0; i < boot_log_cnt; i++) {
+        kprintf("  %16s %8lu\n", boot_log[i].phase,
+            (boot_log[i].time - prev) / (TIMER_FREQ / 1000 / 1000));
+        prev = boot_log[i].time;
+    }
+
+    kprintf("  %16s %8lu\n", "total",
+        prev / (TIMER_FREQ / 1000 / 1000));
+}
+
 void alarm_init(struct alarm * al, const char * name) {
     condition_init(&al->cond, name ? name : "alarm");
     al->twake = get_mtime();
     al->next = NULL;
+    al->pprev = NULL;
 }
 
 void alarm_sleep(struct alarm * al, uint64_t tcnt) {
-    struct alarm * prev;
     int saved_intr_state;
     uint64_t now;
 
@@ -81,43 +275,15 @@ void alarm_sleep(struct alarm * al, uint64_t tcnt) {
     
     saved_intr_state = intr_disable();
 
-    if (sleep_list == NULL || al->twake <= sleep_list->twake) {
-        debug("[%lu] Inserting alarm %s at head of list", now, al->cond.name);
-        // Insert alarm at head of sleep list
-        al->next = sleep_list;
-        sleep_list = al;
-        // If current alarm occurs before next tick, update mtcmp
-
-        if (al->twake < next_tick) {
-            set_mtcmp(al->twake);
-            csrs_sie(RISCV_SIE_STIE);
-            enable_mmode_timer_intr();
-        }
+    debug("[%lu] Inserting alarm %s for %lu", now, al->cond.name, al->twake);
+    alarm_insert(al);
 
+    // If current alarm occurs before next tick, update mtcmp
 
-    } else {
-        // Insert current alarm in list in order of wake-up time. Ideally, we
-        // should not keep interrupts disabled while we iterate through the
-        // list. The right way would be to restore interrupt state, find the
-        // place on the list where we want to insert, the disable interrupts and
-        // re-check the insert point.
-
-        for (prev = sleep_list; prev->next != NULL; prev = prev->next) {
-            if (al->twake <= prev->next->twake) {
-                debug("[%lu] Inserting alarm %s after %s",
-                    now, al->cond.name, prev->cond.name);
-                al->next = prev->next;
-                prev->next = al;
-                break;
-            }
-        }
-
-        // End of list, insert at tail
-        if (prev->next == NULL) {
-            debug("%[lu] Inserting alarm %s at tail", al->cond.name);
-            al->next = NULL;
-            prev->next = al;
-        }
+    if (al->twake < get_mtcmp()) {
+        set_mtcmp(al->twake);
+        csrs_sie(RISCV_SIE_STIE);
+        enable_mmode_timer_intr();
     }
 
     debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
@@ -138,49 +304,210 @@ void alarm_reset(struct alarm * al) {
     al->twake = get_mtime();
 }
 
+void alarm_cancel(struct alarm * al) {
+    int saved_intr_state;
+
+    saved_intr_state = intr_disable();
+
+    if (al->pprev != NULL) {
+        alarm_remove(al);
+        condition_broadcast(&al->cond);
+    }
+
+    intr_restore(saved_intr_state);
+}
+
 // timer_handle_interrupt() is dispatched from intr_handler in intr.c
 
 void timer_intr_handler(struct trap_frame * tfr) {
-    struct alarm * head = sleep_list;
-    struct alarm * next;
+    const int hart = running_hart();
+    uint64_t deadline;
     uint64_t now;
 
     now = get_mtime();
+    intr_cnt[hart] += 1;
 
     trace("[%lu] %s()", now, __func__);
     debug("[%lu] mtcmp = %lu", now, get_mtcmp());
 
-    while (head != NULL && head->twake <= now) {
-        debug("[%lu] Broadcasting alarm for %s", now, head->cond.name);
-        condition_broadcast(&head->cond);
-        next = head->next;
-        head->next = NULL;
-        head = next;
-    }
+    wheel_advance(now);
 
-    if (next_tick < now)
-        next_tick += TICK_PERIOD;
+    // Charge the running thread for every tick that ended, unless the hart
+    // is idle; then program the next event
 
-    sleep_list = head;
+    if (slice_end[hart] != UINT64_MAX) {
+        while (next_tick[hart] <= now) {
+            next_tick[hart] += TICK_PERIOD;
+            tick_cnt[hart] += 1;
+            thread_tick();
+        }
 
-    if (head != NULL && head->twake < next_tick)
-        set_mtcmp(head->twake);
-    else
-        set_mtcmp(next_tick);
+        if (next_tick[hart] < slice_end[hart])
+            deadline = slice_end[hart];
+        else
+            deadline = next_tick[hart];
+    } else
+        deadline = UINT64_MAX;
 
+    set_mtcmp(wheel_next(deadline));
 
     debug("[%lu] Next timer interrupt set for %lu ticks", now, get_mtcmp());
     enable_mmode_timer_intr();
 
 }
 
+int stats_open(struct io_intf ** ioptr, void * aux) {
+    stats_io.refcnt += 1;
+    *ioptr = &stats_io;
+    return 0;
+}
+
+// Copies the counters of each hart to the struct io_timerstat at /arg/
+
+int stats_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct io_timerstat st;
+    int saved_intr_state;
+    int h;
+
+    if (cmd != IOCTL_TIMERSTAT)
+        return -ENOTSUP;
+
+    memset(&st, 0, sizeof(st));
+    saved_intr_state = intr_disable();
+
+    st.time = get_mtime();
+    st.nhart = (NHART < 8) ? NHART : 8;
+
+    for (h = 0; h < st.nhart; h++) {
+        st.intr_cnt[h] = intr_cnt[h];
+        st.tick_cnt[h] = tick_cnt[h];
+    }
+
+    intr_restore(saved_intr_state);
+
+    if (copy_to_user(arg, &st, sizeof(st)) != 0)
+        return -EFAULT;
+
+    return 0;
+}
+
+void alarm_insert(struct alarm * al) {
+    uint64_t slot = al->twake >> TIMER_WHEEL_SHIFT;
+    struct alarm ** link;
+
+    // An alarm due in a slot the wheel has passed goes in the current one,
+    // which the next timer interrupt looks at
+
+    if (slot < wheel_slot)
+        slot = wheel_slot;
+
+    if (slot - wheel_slot < TIMER_WHEEL_SIZE)
+        link = &wheel[slot % TIMER_WHEEL_SIZE];
+    else {
+        link = &overflow;
+        if (al->twake < overflow_min)
+            overflow_min = al->twake;
+    }
+
+    al->next = *link;
+    if (al->next != NULL)
+        al->next->pprev = &al->next;
+    al->pprev = link;
+    *link = al;
+}
+
+void alarm_remove(struct alarm * al) {
+    *al->pprev = al->next;
+    if (al->next != NULL)
+        al->next->pprev = al->pprev;
+    al->next = NULL;
+    al->pprev = NULL;
+}
+
+void wheel_advance(uint64_t now) {
+    const uint64_t now_slot = now >> TIMER_WHEEL_SHIFT;
+    struct alarm * al;
+    struct alarm * next;
+    uint64_t n;
+
+    // Every alarm on the wheel is due within TIMER_WHEEL_SIZE slots of
+    // wheel_slot, so that many buckets at most need looking at. All alarms in
+    // the buckets of the slots before now_slot are due.
+
+    for (n = 0; n < TIMER_WHEEL_SIZE && wheel_slot + n <= now_slot; n++) {
+        for (al = wheel[(wheel_slot + n) % TIMER_WHEEL_SIZE]; al != NULL; al = next) {
+            next = al->next;
+
+            if (al->twake <= now) {
+                debug("[%lu] Broadcasting alarm for %s", now, al->cond.name);
+                alarm_remove(al);
+                condition_broadcast(&al->cond);
+            }
+        }
+    }
+
+    if (wheel_slot < now_slot)
+        wheel_slot = now_slot;
+
+    // Move the overflow alarms the wheel now reaches onto it. The list is only
+    // walked when one of them is due within the span.
+
+    if ((overflow_min >> TIMER_WHEEL_SHIFT) < wheel_slot + TIMER_WHEEL_SIZE) {
+        overflow_min = UINT64_MAX;
+
+        for (al = overflow; al != NULL; al = next) {
+            next = al->next;
+
+            if ((al->twake >> TIMER_WHEEL_SHIFT) < wheel_slot + TIMER_WHEEL_SIZE) {
+                alarm_remove(al);
+                alarm_insert(al);
+            } else if (al->twake < overflow_min)
+                overflow_min = al->twake;
+        }
+    }
+}
+
+uint64_t wheel_next(uint64_t limit) {
+    const struct alarm * al;
+    uint64_t first = limit;
+    uint64_t n;
+
+    // The buckets are in wake-up order, so the first non-empty one has the
+    // earliest alarm on the wheel
+
+    for (n = 0; n < TIMER_WHEEL_SIZE; n++) {
+        if ((wheel_slot + n) << TIMER_WHEEL_SHIFT >= limit)
+            break;
+
+        al = wheel[(wheel_slot + n) % TIMER_WHEEL_SIZE];
+        if (al == NULL)
+            continue;
+
+        for (; al != NULL; al = al->next) {
+            if (al->twake < first)
+                first = al->twake;
+        }
+
+        return first;
+    }
+
+    // The overflow alarms are all due after the wheel's
+
+    return (overflow_min < first) ? overflow_min : first;
+}
+
 void enable_mmode_timer_intr(void) {
+    // With Sstc, writing stimecmp re-armed the interrupt already
+
+    if (_hart_sstc & (1UL << running_hart()))
+        return;
+
     // see _mmode_trap_handler in trapasm.s
     asm ("ecall" ::: "memory");
 }
 
 #define MTIME_ADDR 0x200BFF8
-#define MTCMP_ADDR 0x2004000
+#define MTCMP_ADDR(hart) (0x2004000UL + 8*(hart))
 
 static inline uint64_t get_mtime(void) {
     return *(volatile uint64_t*)MTIME_ADDR;
@@ -190,10 +517,25 @@ static inline void set_mtime(uint64_t val) {
     *(volatile uint64_t*)MTIME_ADDR = val;
 }
 
+// The timer compare register of the current hart: stimecmp if the hart has
+// Sstc, its mtimecmp otherwise
+
 static inline uint64_t get_mtcmp(void) {
-    return *(volatile uint64_t*)MTCMP_ADDR;
+    const int hart = running_hart();
+    uint64_t val;
+
+    if (_hart_sstc & (1UL << hart)) {
+        asm volatile ("csrr %0, %1" : "=r" (val) : "i" (CSR_STIMECMP));
+        return val;
+    } else
+        return *(volatile uint64_t*)MTCMP_ADDR(hart);
 }
 
 static inline void set_mtcmp(uint64_t val) {
-    *(volatile uint64_t*)MTCMP_ADDR = val;
+    const int hart = running_hart();
+
+    if (_hart_sstc & (1UL << hart))
+        asm volatile ("csrw %0, %1" :: "i" (CSR_STIMECMP), "r" (val));
+    else
+        *(volatile uint64_t*)MTCMP_ADDR(hart) = val;
 }
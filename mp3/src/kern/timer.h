@@ -13,6 +13,7 @@
 struct alarm {
     struct condition cond;
     struct alarm * next;
+    struct alarm ** pprev; // link pointing to this alarm, NULL if not pending
     uint64_t twake;
 };
 
@@ -22,6 +23,34 @@ struct alarm {
 extern char timer_initialized;
 extern void timer_init(void);
 
+// Starts the tick on a hart other than hart 0 (see thread_start_harts)
+
+extern void timer_hart_init(void);
+
+// Called by the scheduler when the running thread of the hart has a new time
+// slice of /ticks/ ticks, or with -1 when the hart switches to its idle
+// thread. In tickless mode the hart's timer is reprogrammed if the slice ends
+// before the next event it was programmed for.
+
+extern void timer_slice_start(int ticks);
+
+// Registers the "timerstat" device, whose IOCTL_TIMERSTAT gets the number of
+// timer interrupts each hart has taken (see io.h)
+
+extern void timer_stats_attach(void);
+
+// Boot-phase log. boot_mark records the time at which the boot phase /phase/
+// (a string literal) finished; boot_log_print prints how long each recorded
+// phase took. Marks past BOOT_MARK_MAX are dropped. Timestamps stay
+// continuous across timer_init resetting mtime.
+
+#ifndef BOOT_MARK_MAX
+#define BOOT_MARK_MAX 16
+#endif
+
+extern void boot_mark(const char * phase);
+extern void boot_log_print(void);
+
 // Initializes an alarm. The /name/ argument is optional.
 
 extern void alarm_init(struct alarm * al, const char * name);
@@ -37,6 +66,11 @@ extern void alarm_sleep(struct alarm * al, uint64_t tcnt);
 
 extern void alarm_reset(struct alarm * al);
 
+// Wakes up the thread sleeping on the alarm right away, as if the alarm had
+// gone off. Does nothing if no thread is sleeping on it.
+
+extern void alarm_cancel(struct alarm * al);
+
 extern void timer_intr_handler(struct trap_frame * tfr); // called from intr.c
 
 static inline void alarm_sleep_sec(struct alarm * al, unsigned int sec);
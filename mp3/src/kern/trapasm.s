@@ -175,10 +175,22 @@ _trap_entry_from_umode:
         la      t6, _trap_entry_from_smode
         csrw    stvec, t6       # update trap handler address to _trap_entry_from_smode
         
+        # Kernel code runs under the kernel lock (see thread.h), which we
+        # hold until we return to U mode. Interrupts are still disabled.
+
+        call    kernel_lock_acquire
+
         call    trap_umode_cont # call U mode trap handler
 
         # U mode handlers return here because the call instruction above places
         # this address in /ra/ before we jump to exception or trap handler.
+        # The handler may have enabled interrupts; disable them before we give
+        # up the kernel lock, since an S mode trap would need it back. We may
+        # be on another hart than the one we entered on.
+
+        csrci   sstatus, 2      # sstatus.SIE = 0
+        call    kernel_lock_release
+
         # We're returning to U mode, so restore _smode_trap_entry_from_umode as
         # trap handler.
 
@@ -249,53 +261,83 @@ trap_umode_cont:
 #   3. When a M mode timer interrupt occurs, we set STIP and clear MTIE. S mode
 #      then needs to re-arm timer interrupts using (2).
 #
+# Harts with the Sstc extension skip all this: start.s enables it, and S mode
+# programs its own timer through the stimecmp CSR (see timer.c).
+#
+# Likewise for interprocessor interrupts: S mode raises an M mode software
+# interrupt on another hart by writing its CLINT msip register, and we pass it
+# on as an S mode software interrupt (SSIP) after clearing msip.
+#
+# mscratch points to a scratch area of this hart (see start.s), where we save
+# the two registers we use.
+
+        .equ    CLINT_MSIP, 0x2000000
 
 _mmode_trap_entry:
-        # Stash t0 away in mscratch
+        csrrw   t0, mscratch, t0
+        sd      t1, 0*8(t0)
+        sd      t2, 1*8(t0)
+
+        csrr    t1, mcause
+        bgez    t1, mmode_excp_handler
 
-        csrw    mscratch, t0
+        slli    t1, t1, 1       # clear msb
+        srli    t1, t1, 1       #
 
-        csrr    t0, mcause
-        bgez    t0, mmode_excp_handler
+        li      t2, 3
+        beq     t1, t2, mmode_soft_intr_handler
 
-        # If it's not a timer interrupt, panic
+        # If it's not a timer or software interrupt, panic
 
-        addi    t0, t0, -7      # subtract 7
-        slli    t0, t0, 1       # clear msb
-        bnez    t0, unexpected_mmode_trap
+        li      t2, 7
+        bne     t1, t2, unexpected_mmode_trap
 
 mmode_intr_handler:
 
         # Set STIP, clear MTIE
 
-        li      t0, 0x20        # STIP
-        csrs    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrc    mie, t0
+        li      t1, 0x20        # STIP
+        csrs    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrc    mie, t1
+        j       mmode_trap_done
+
+mmode_soft_intr_handler:
+
+        # Clear our msip, set SSIP
+
+        csrr    t1, mhartid
+        slli    t1, t1, 2
+        li      t2, CLINT_MSIP
+        add     t1, t1, t2
+        sw      zero, 0(t1)
+        csrsi   mip, 2          # SSIP
         j       mmode_trap_done
 
 mmode_excp_handler:
         # We support one S mode to M mode environment call, which is to re-arm
         # the timer interrupt.
 
-        addi    t0, t0, -9
-        bnez    t0, unexpected_mmode_trap
+        li      t2, 9
+        bne     t1, t2, unexpected_mmode_trap
 
         # Clear STIP, set MTIE
 
-        li      t0, 0x20        # STIP
-        csrc    mip, t0
-        slli    t0, t0, 2       # MTIE
-        csrs    mie, t0
+        li      t1, 0x20        # STIP
+        csrc    mip, t1
+        slli    t1, t1, 2       # MTIE
+        csrs    mie, t1
 
         # Advance mepc past ecall instruction
 
-        csrr    t0, mepc
-        addi    t0, t0, 4
-        csrw    mepc, t0
+        csrr    t1, mepc
+        addi    t1, t1, 4
+        csrw    mepc, t1
        
 mmode_trap_done:
-        csrr    t0, mscratch
+        ld      t2, 1*8(t0)
+        ld      t1, 0*8(t0)
+        csrrw   t0, mscratch, t0
         mret
 
 
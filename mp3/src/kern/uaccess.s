@@ -0,0 +1,85 @@
+# uaccess.s - Copying between kernel and user memory
+#
+
+# size_t _copy_user(void * dst, const void * src, size_t n)
+
+# Copies /n/ bytes from /src/ to /dst/ and returns 0, or the number of bytes
+# not copied if an access faulted. One of /src/ and /dst/ is a user address.
+# The kernel reaches user memory through sstatus.SUM. Every load and store in
+# this function has an entry in the exception table (section __ex_table), so a
+# page fault the memory manager cannot resolve resumes at _copy_user_fault
+# instead of being fatal. Called by copy_from_user and copy_to_user in
+# memory.c, which check that the user buffer lies in the user range.
+#
+# Each exception table entry is a pair of doublewords: the address of an
+# instruction allowed to fault, and the address to resume at.
+
+        .text
+        .global _copy_user
+        .type   _copy_user, @function
+
+_copy_user:
+
+        # a0 = dst, a1 = src, a2 = bytes left to copy
+
+        beqz    a2, copy_done
+
+        # Use doubleword accesses if dst and src have the same alignment
+
+        xor     t0, a0, a1
+        andi    t0, t0, 7
+        bnez    t0, copy_bytes
+
+copy_align:
+        andi    t0, a0, 7
+        beqz    t0, copy_dwords
+.Lfault_lb1:
+        lb      t1, 0(a1)
+.Lfault_sb1:
+        sb      t1, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        bnez    a2, copy_align
+        j       copy_done
+
+copy_dwords:
+        li      t2, 8
+1:      bltu    a2, t2, copy_bytes
+.Lfault_ld:
+        ld      t1, 0(a1)
+.Lfault_sd:
+        sd      t1, 0(a0)
+        addi    a0, a0, 8
+        addi    a1, a1, 8
+        addi    a2, a2, -8
+        j       1b
+
+copy_bytes:
+        beqz    a2, copy_done
+.Lfault_lb2:
+        lb      t1, 0(a1)
+.Lfault_sb2:
+        sb      t1, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       copy_bytes
+
+copy_done:
+_copy_user_fault:
+        # a2 is 0 when the copy completed, otherwise the number of bytes left
+        # when the faulting access was attempted.
+        mv      a0, a2
+        ret
+
+        .section __ex_table, "a"
+        .balign 8
+        .dword  .Lfault_lb1, _copy_user_fault
+        .dword  .Lfault_sb1, _copy_user_fault
+        .dword  .Lfault_ld, _copy_user_fault
+        .dword  .Lfault_sd, _copy_user_fault
+        .dword  .Lfault_lb2, _copy_user_fault
+        .dword  .Lfault_sb2, _copy_user_fault
+
+        .end
@@ -11,6 +11,8 @@
 #include "heap.h"
 #include "halt.h"
 #include "intr.h"
+#include "memory.h"
+#include "csr.h"
 #include "limits.h"
 
 // COMPILE-TIME CONSTANT DEFINITIONS
@@ -73,6 +75,7 @@ struct uart_device {
 	int irqno;
 
 	uint32_t rxovrcnt; // number of times OE was set
+	uint64_t rxtime; // rdtime when rxbuf last became non-empty
 
 	struct io_intf io_intf;
 	
@@ -90,6 +93,7 @@ static int uart_open(struct io_intf ** ioptr, void * aux);
 static void uart_close(struct io_intf * io);
 static long uart_read(struct io_intf * io, void * buf, unsigned long bufsz);
 static long uart_write(struct io_intf * io, const void * buf, unsigned long n);
+static int uart_ioctl(struct io_intf * io, int cmd, void * arg);
 
 static void uart_isr(int irqno, void * driver_private);
 
@@ -108,7 +112,8 @@ void uart_attach(void * mmio_base, int irqno) {
 	static const struct io_ops uart_ops = {
 		.close = uart_close,
 		.read = uart_read,
-		.write = uart_write
+		.write = uart_write,
+		.ctl = uart_ioctl
 	};
 
 	struct uart_device * dev;
@@ -253,6 +258,19 @@ long uart_write(struct io_intf * io, const void * buf, unsigned long n) {
 	return p - (char*)buf;
 }
 
+int uart_ioctl(struct io_intf * io, int cmd, void * arg) {
+	struct uart_device * const dev =
+		(void*)io - offsetof(struct uart_device, io_intf);
+
+	if (cmd != IOCTL_GETRXTIME)
+		return -ENOTSUP;
+	
+	if (copy_to_user(arg, &dev->rxtime, sizeof(dev->rxtime)) != 0)
+		return -EFAULT;
+	
+	return 0;
+}
+
 void uart_isr(int irqno, void * aux) {
 	struct uart_device * const dev = aux;
 	const uint_fast8_t line_status = dev->regs->lsr;
@@ -262,8 +280,10 @@ void uart_isr(int irqno, void * aux) {
 	
 	if (line_status & LSR_DR) {
 		if (!rbuf_full(&dev->rxbuf)) {
-			if (rbuf_empty(&dev->rxbuf))
+			if (rbuf_empty(&dev->rxbuf)) {
+				dev->rxtime = csrr_time();
 				condition_broadcast(&dev->rxbnotempty);
+			}
 			rbuf_put(&dev->rxbuf, dev->regs->rbr);
 		} else
 			dev->regs->ier &= ~IER_DREIE;
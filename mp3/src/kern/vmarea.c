@@ -0,0 +1,334 @@
+// vmarea.c - Virtual memory areas of a user process
+//
+
+#ifdef VMAREA_TRACE
+#define TRACE
+#endif
+
+#ifdef VMAREA_DEBUG
+#define DEBUG
+#endif
+
+#include "vmarea.h"
+#include "memory.h"
+#include "config.h"
+#include "console.h"
+#include "string.h"
+#include "error.h"
+#include "halt.h"
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define PAGE_ROUND_UP(a) (((a) + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int vm_map_index(const struct vm_map * map, uintptr_t vma);
+static int vm_area_mergeable (
+    const struct vm_area * area, uint_fast8_t flags, int type);
+static void vm_area_trim(struct vm_area * area, uintptr_t start);
+static int vm_area_file_fault(const struct vm_area * area, uintptr_t vma);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void vm_map_init(struct vm_map * map, uintptr_t brk_start) {
+    map->cnt = 0;
+    map->brk_start = brk_start;
+    map->brk = brk_start;
+}
+
+void vm_map_copy(struct vm_map * dst, const struct vm_map * src) {
+    *dst = *src;
+
+    for (int i = 0; i < dst->cnt; i++) {
+        if (dst->area[i].io != NULL)
+            ioref(dst->area[i].io);
+    }
+}
+
+void vm_map_clear(struct vm_map * map) {
+    for (int i = 0; i < map->cnt; i++) {
+        if (map->area[i].io != NULL)
+            ioclose(map->area[i].io);
+    }
+
+    vm_map_init(map, map->brk_start);
+}
+
+struct vm_area * vm_map_find(struct vm_map * map, uintptr_t vma) {
+    const int i = vm_map_index(map, vma);
+
+    if (i < map->cnt && map->area[i].start <= vma)
+        return &map->area[i];
+    else
+        return NULL;
+}
+
+int vm_map_insert (
+    struct vm_map * map, uintptr_t start, uintptr_t end,
+    uint_fast8_t flags, int type)
+{
+    struct vm_area * prev;
+    struct vm_area * next;
+    int i;
+
+    trace("%s(start=%p,end=%p,flags=%x,type=%d)",
+        __func__, (void*)start, (void*)end, flags, type);
+
+    assert (start < end);
+
+    i = vm_map_index(map, start);
+    prev = (0 < i) ? &map->area[i-1] : NULL;
+    next = (i < map->cnt) ? &map->area[i] : NULL;
+
+    if (next != NULL && next->start < end)
+        return -EBUSY;
+
+    // Extend a neighbour if possible, e.g. the heap area when brk grows
+
+    if (prev != NULL && prev->end == start &&
+        vm_area_mergeable(prev, flags, type))
+    {
+        prev->end = end;
+
+        if (next != NULL && next->start == end &&
+            vm_area_mergeable(next, flags, type))
+        {
+            prev->end = next->end;
+            memmove(next, next+1, (map->cnt - i - 1) * sizeof(*next));
+            map->cnt -= 1;
+        }
+
+        return 0;
+    }
+
+    if (next != NULL && next->start == end &&
+        vm_area_mergeable(next, flags, type))
+    {
+        next->start = start;
+        return 0;
+    }
+
+    if (map->cnt == VM_AREA_MAX)
+        return -ENOMEM;
+
+    memmove(&map->area[i+1], &map->area[i],
+        (map->cnt - i) * sizeof(map->area[0]));
+    map->area[i].start = start;
+    map->area[i].end = end;
+    map->area[i].flags = flags;
+    map->area[i].type = type;
+    map->area[i].io = NULL;
+    map->area[i].offset = 0;
+    map->cnt += 1;
+
+    return 0;
+}
+
+int vm_map_insert_file (
+    struct vm_map * map, uintptr_t start, uintptr_t end,
+    uint_fast8_t flags, struct io_intf * io, uint64_t offset)
+{
+    struct vm_area * area;
+    int result;
+
+    // File areas are never merged, so this adds a new area at /start/
+
+    result = vm_map_insert(map, start, end, flags, VM_AREA_FILE);
+    if (result < 0)
+        return result;
+
+    area = vm_map_find(map, start);
+    area->io = io;
+    area->offset = offset;
+    ioref(io);
+
+    return 0;
+}
+
+int vm_map_remove(struct vm_map * map, uintptr_t start, uintptr_t end) {
+    struct vm_area * area;
+    int i, j;
+
+    trace("%s(start=%p,end=%p)", __func__, (void*)start, (void*)end);
+
+    i = vm_map_index(map, start);
+    area = &map->area[i];
+
+    // Punching a hole into the middle of an area splits it in two
+
+    if (i < map->cnt && area->start < start && end < area->end) {
+        if (map->cnt == VM_AREA_MAX)
+            return -ENOMEM;
+
+        memmove(area+1, area, (map->cnt - i) * sizeof(*area));
+        area[0].end = start;
+        vm_area_trim(&area[1], end);
+        if (area[1].io != NULL)
+            ioref(area[1].io);
+        map->cnt += 1;
+        return 0;
+    }
+
+    if (i < map->cnt && area->start < start) {
+        area->end = start;
+        i += 1;
+    }
+
+    for (j = i; j < map->cnt && map->area[j].end <= end; j++) {
+        if (map->area[j].io != NULL)
+            ioclose(map->area[j].io);
+    }
+
+    if (j < map->cnt && map->area[j].start < end)
+        vm_area_trim(&map->area[j], end);
+
+    memmove(&map->area[i], &map->area[j],
+        (map->cnt - j) * sizeof(map->area[0]));
+    map->cnt -= j - i;
+
+    return 0;
+}
+
+uintptr_t vm_map_find_gap (
+    const struct vm_map * map, size_t size, uintptr_t lo, uintptr_t hi)
+{
+    uintptr_t top = hi;
+    uintptr_t bottom;
+
+    // Walk the areas from the top down, so that mappings are placed as far
+    // from the heap as possible.
+
+    for (int i = map->cnt-1; -1 <= i; i--) {
+        bottom = (i < 0) ? lo : MAX(lo, map->area[i].end);
+
+        if (bottom < top && size <= top - bottom)
+            return top - size;
+
+        if (0 <= i && map->area[i].start < top)
+            top = map->area[i].start;
+
+        if (top <= lo)
+            break;
+    }
+
+    return 0;
+}
+
+uintptr_t vm_map_brk(struct vm_map * map, uintptr_t addr) {
+    const uintptr_t old_end = PAGE_ROUND_UP(map->brk);
+    const uintptr_t new_end = PAGE_ROUND_UP(addr);
+
+    trace("%s(addr=%p)", __func__, (void*)addr);
+
+    if (addr < map->brk_start || USER_STACK_VMA - USER_STACK_SIZE < addr)
+        return map->brk;
+
+    if (old_end < new_end) {
+        if (vm_map_insert(map, old_end, new_end,
+            PTE_R | PTE_W | PTE_U, VM_AREA_HEAP) != 0)
+        {
+            return map->brk;
+        }
+    } else if (new_end < old_end) {
+        if (vm_map_remove(map, new_end, old_end) != 0)
+            return map->brk;
+
+        memory_unmap_and_free_range((void*)new_end, old_end - new_end);
+    }
+
+    map->brk = addr;
+    return addr;
+}
+
+int vm_area_fault(const struct vm_area * area, uintptr_t vma) {
+    const uintptr_t mega = vma & ~(uintptr_t)(MEGA_SIZE-1);
+
+    // Without R, W or X the PTE would be a pointer to a page table
+
+    if (!(area->flags & (PTE_R | PTE_W | PTE_X)))
+        return -EACCESS;
+
+    if (area->type == VM_AREA_FILE)
+        return vm_area_file_fault(area, vma);
+
+    // A large heap or mmap area is backed by megapages where it covers a
+    // whole aligned 2 MB block. The stack is left to 4 kB pages: it always
+    // spans several aligned blocks but a thread only touches a few pages of
+    // it, so a megapage there would cost 2 MB and a 2 MB memset per process.
+
+    if (USER_MEGAPAGES &&
+        (area->type == VM_AREA_HEAP || area->type == VM_AREA_ANON) &&
+        area->start <= mega && mega + MEGA_SIZE <= area->end &&
+        memory_map_megapage(mega, PTE_R | PTE_W))
+    {
+        memset((void*)mega, 0, MEGA_SIZE);
+        memory_set_range_flags((const void*)mega, MEGA_SIZE, area->flags);
+        return 0;
+    }
+
+    memory_alloc_and_map_page(vma, area->flags);
+    return 0;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Returns the index of the first area ending above /vma/, or map->cnt if there
+// is none.
+
+static int vm_map_index(const struct vm_map * map, uintptr_t vma) {
+    int lo = 0;
+    int hi = map->cnt;
+    int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (map->area[mid].end <= vma)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int vm_area_mergeable (
+    const struct vm_area * area, uint_fast8_t flags, int type)
+{
+    return (area->type == type && area->flags == flags &&
+            type != VM_AREA_IMAGE && type != VM_AREA_FILE);
+}
+
+// Moves the start of /area/ up to /start/, keeping a file area's pages at
+// the same file positions.
+
+static void vm_area_trim(struct vm_area * area, uintptr_t start) {
+    if (area->io != NULL)
+        area->offset += start - area->start;
+    
+    area->start = start;
+}
+
+// Maps the page cache frame holding the page of the file at /vma/. Stores to
+// a writable (private) mapping go to a copy made on the first store.
+
+static int vm_area_file_fault(const struct vm_area * area, uintptr_t vma) {
+    struct io_page req;
+    int result;
+
+    vma &= ~(uintptr_t)(PAGE_SIZE-1);
+    req.pos = area->offset + (vma - area->start);
+
+    result = ioctl(area->io, IOCTL_GETPAGE, &req);
+    if (result < 0)
+        return (result == -EINVAL) ? -EFAULT : result;
+
+    memory_map_shared_page(vma, req.page, area->flags);
+    return 0;
+}
@@ -0,0 +1,119 @@
+// vmarea.h - Virtual memory areas of a user process
+//
+
+#ifndef _VMAREA_H_
+#define _VMAREA_H_
+
+#include "io.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// VM_AREA_MAX is the maximum number of areas in a process's address space.
+// Adjacent anonymous areas with the same permissions are merged, so this
+// bounds the number of distinct mappings, not their total size.
+
+#ifndef VM_AREA_MAX
+#define VM_AREA_MAX 32
+#endif
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+enum vm_area_type {
+    VM_AREA_IMAGE,  // segment of the executable, paged in from the file
+    VM_AREA_HEAP,   // program break, grown and shrunk by brk
+    VM_AREA_STACK,  // user stack
+    VM_AREA_ANON,   // anonymous mapping created by mmap
+    VM_AREA_FILE    // file mapping created by mmap, backed by the page cache
+};
+
+// An area is a page-aligned range [start,end) of user addresses with the same
+// permissions and backing. Only addresses inside an area are faulted in; an
+// access anywhere else terminates the process.
+
+struct vm_area {
+    uintptr_t start;
+    uintptr_t end;
+    uint8_t flags;  // PTE flags of the pages in the area (R, W, X, U)
+    uint8_t type;   // enum vm_area_type
+    struct io_intf * io;    // mapped file (VM_AREA_FILE), referenced
+    uint64_t offset;        // position in the file of the page at start
+};
+
+// The areas of an address space, sorted by address and non-overlapping, so
+// that the area containing a faulting address is found by binary search.
+
+struct vm_map {
+    int cnt;
+    struct vm_area area[VM_AREA_MAX];
+    uintptr_t brk_start;    // start of the heap, the end of the image
+    uintptr_t brk;          // current program break
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// void vm_map_init(struct vm_map * map, uintptr_t brk_start)
+// Empties /map/ and sets the program break to /brk_start/ (page aligned).
+extern void vm_map_init(struct vm_map * map, uintptr_t brk_start);
+
+// void vm_map_copy(struct vm_map * dst, const struct vm_map * src)
+// Makes /dst/ a copy of /src/ for a forked process, taking a reference to
+// every mapped file.
+extern void vm_map_copy(struct vm_map * dst, const struct vm_map * src);
+
+// void vm_map_clear(struct vm_map * map)
+// Removes all areas of /map/, dropping the references to mapped files, and
+// resets the program break. Does not touch the page tables.
+extern void vm_map_clear(struct vm_map * map);
+
+// struct vm_area * vm_map_find(struct vm_map * map, uintptr_t vma)
+// Returns the area containing /vma/, or NULL if /vma/ is in no area.
+extern struct vm_area * vm_map_find(struct vm_map * map, uintptr_t vma);
+
+// int vm_map_insert(struct vm_map * map, uintptr_t start, uintptr_t end,
+//      uint_fast8_t flags, int type)
+// Adds the area [start,end) to /map/, merging it with adjacent anonymous areas
+// of the same type and flags. Returns 0 on success, -EBUSY if the range
+// overlaps an existing area, or -ENOMEM if /map/ is full.
+// vm_map_insert_file adds a VM_AREA_FILE area mapping /io/ from position
+// /offset/ and takes a reference to /io/.
+extern int vm_map_insert (
+    struct vm_map * map, uintptr_t start, uintptr_t end,
+    uint_fast8_t flags, int type);
+
+extern int vm_map_insert_file (
+    struct vm_map * map, uintptr_t start, uintptr_t end,
+    uint_fast8_t flags, struct io_intf * io, uint64_t offset);
+
+// int vm_map_remove(struct vm_map * map, uintptr_t start, uintptr_t end)
+// Removes [start,end) from the areas of /map/, trimming or splitting areas
+// that overlap it partially, and drops the references to files no longer
+// mapped. Does not touch the page tables. Returns 0 on
+// success or -ENOMEM if splitting an area would overflow /map/.
+extern int vm_map_remove(struct vm_map * map, uintptr_t start, uintptr_t end);
+
+// uintptr_t vm_map_find_gap(const struct vm_map * map, size_t size,
+//      uintptr_t lo, uintptr_t hi)
+// Returns the highest address /a/ such that [a,a+size) lies within [lo,hi)
+// and overlaps no area, or 0 if there is no such gap.
+extern uintptr_t vm_map_find_gap (
+    const struct vm_map * map, size_t size, uintptr_t lo, uintptr_t hi);
+
+// uintptr_t vm_map_brk(struct vm_map * map, uintptr_t addr)
+// Moves the program break of /map/ to /addr/, adding heap pages or unmapping
+// and freeing them from the active memory space. Returns the new program
+// break, or the old one if the break cannot be moved there.
+extern uintptr_t vm_map_brk(struct vm_map * map, uintptr_t addr);
+
+// int vm_area_fault(const struct vm_area * area, uintptr_t vma)
+// Maps the page at /vma/ in a heap, stack or mmap area /area/: zero-filled
+// memory, or the page cache frame of a mapped file (copy-on-write if the area
+// is writable). Returns 0 on success, -EACCESS if the area allows no access,
+// or -EFAULT if the page is past the end of the file.
+extern int vm_area_fault(const struct vm_area * area, uintptr_t vma);
+
+#endif // _VMAREA_H_
@@ -0,0 +1,20 @@
+// clock.h - Reading the time
+//
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <stdint.h>
+
+// Frequency of the time counter (rdtime) of the QEMU virt machine
+
+#define TICKS_PER_SEC   10000000
+#define TICKS_PER_US    (TICKS_PER_SEC / 1000000)
+
+static inline uint64_t rdtime(void) {
+    uint64_t t;
+    asm volatile ("rdtime %0" : "=r" (t));
+    return t;
+}
+
+#endif // _CLOCK_H_
@@ -0,0 +1,69 @@
+#include "syscall.h"
+#include "string.h"
+#include "io.h"
+#include <stdint.h>
+
+// Prints the kmalloc call sites of the kernel that hold the most memory. The
+// kernel must be built with HEAP_PROFILE=1, which provides the "heapprof"
+// device. Caller addresses can be turned into source lines with addr2line on
+// kernel.elf.
+
+#define MAX_SITES 256
+#define TOP_SITES 16
+
+static struct heap_prof_entry sites[MAX_SITES];
+
+void main(void) {
+    struct io_heapprof req;
+    struct heap_prof_entry tmp;
+    char linebuf[80];
+    uint64_t live_bytes = 0;
+    uint64_t live_cnt = 0;
+    int i, j;
+
+    if (_devopen(0, "heapprof", 0) < 0) {
+        _msgout("heapprof: no heapprof device (build with HEAP_PROFILE=1)");
+        _exit();
+    }
+
+    req.cnt = MAX_SITES;
+    req.buf = sites;
+
+    if (_ioctl(0, IOCTL_HEAPPROF, &req) < 0) {
+        _msgout("heapprof: IOCTL_HEAPPROF failed");
+        _exit();
+    }
+
+    _close(0);
+
+    // Sort by live bytes, largest first
+
+    for (i = 1; i < req.cnt; i++) {
+        tmp = sites[i];
+        for (j = i; 0 < j && sites[j-1].live_bytes < tmp.live_bytes; j--)
+            sites[j] = sites[j-1];
+        sites[j] = tmp;
+    }
+
+    for (i = 0; i < req.cnt; i++) {
+        live_bytes += sites[i].live_bytes;
+        live_cnt += sites[i].live_cnt;
+    }
+
+    snprintf(linebuf, sizeof(linebuf),
+        "%lu call sites, %lu live blocks, %lu live bytes",
+        (unsigned long)req.cnt, (unsigned long)live_cnt,
+        (unsigned long)live_bytes);
+    _msgout(linebuf);
+
+    for (i = 0; i < req.cnt && i < TOP_SITES; i++) {
+        snprintf(linebuf, sizeof(linebuf),
+            "%p: %lu live, %lu bytes, %lu allocs, peak %lu bytes",
+            (void*)(uintptr_t)sites[i].caller,
+            (unsigned long)sites[i].live_cnt,
+            (unsigned long)sites[i].live_bytes,
+            (unsigned long)sites[i].alloc_cnt,
+            (unsigned long)sites[i].peak_bytes);
+        _msgout(linebuf);
+    }
+}
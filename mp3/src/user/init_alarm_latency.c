@@ -0,0 +1,48 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include <stdint.h>
+
+// Measures how late short sleeps wake up on an otherwise idle system. The
+// lateness covers arming the alarm (the system call, queueing the alarm and
+// programming the timer) and firing it (the timer interrupt, waking the
+// thread and returning to user mode). Compare a kernel built with
+// TIMER_SSTC=1 against one built with TIMER_SSTC=0, which re-arms the timer
+// through an ecall to M mode.
+
+#define NRUN 200 // sleeps per duration
+
+static const unsigned long durations[] = { 10, 100, 1000 }; // us
+
+void main(void) {
+    uint64_t start, late, min, max, sum;
+    char linebuf[80];
+    unsigned long us;
+    int i, n;
+
+    for (i = 0; i < sizeof(durations) / sizeof(durations[0]); i++) {
+        us = durations[i];
+        min = UINT64_MAX;
+        max = 0;
+        sum = 0;
+
+        for (n = 0; n < NRUN; n++) {
+            start = rdtime();
+            _usleep(us);
+            late = rdtime() - start - us * TICKS_PER_US;
+
+            if (late < min)
+                min = late;
+            if (max < late)
+                max = late;
+            sum += late;
+        }
+
+        snprintf(linebuf, sizeof(linebuf),
+            "sleep %lu us x %d: late by min %lu avg %lu max %lu us",
+            us, NRUN, (unsigned long)(min / TICKS_PER_US),
+            (unsigned long)(sum / NRUN / TICKS_PER_US),
+            (unsigned long)(max / TICKS_PER_US));
+        _msgout(linebuf);
+    }
+}
@@ -0,0 +1,92 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include "io.h"
+#include <stdint.h>
+
+// Measures keypress-to-echo latency on ser1 while CPU-bound processes compete
+// for the CPU. The kernel stamps the time at which a key arrives (see
+// IOCTL_GETRXTIME); the latency is the time from there until the echo has been
+// handed to the driver. The CPU-bound processes use up every time slice they
+// get, so the scheduler demotes them, while the echo process blocks on every
+// key and keeps its priority.
+
+#define NLOAD 2 // CPU-bound processes
+#define LOAD_PRIO 0 // priority they run at; 3 lowers it up front
+#define LOAD_TIME 60 // seconds they run for
+#define NKEYS 32 // keys to measure
+
+static void load(void) {
+    volatile uint64_t x = 0;
+    uint64_t start = rdtime();
+
+    _setpriority(LOAD_PRIO);
+
+    while (rdtime() - start < LOAD_TIME * 1000000UL * TICKS_PER_US)
+        x += 1;
+
+    _exit();
+}
+
+static void say(const char * s) {
+    _write(0, s, strlen(s));
+}
+
+void main(void) {
+    char linebuf[80];
+    uint64_t rxtime, lat, min = UINT64_MAX, max = 0, sum = 0;
+    int cnt = 0;
+    int i, result;
+    char c;
+
+    for (i = 0; i < NLOAD; i++) {
+        if (_fork() == 0)
+            load();
+    }
+
+    result = _devopen(0, "ser", 1);
+
+    if (result < 0) {
+        _msgout("_devopen failed");
+        _exit();
+    }
+
+    snprintf(linebuf, sizeof(linebuf),
+        "Type %d keys (q to stop early)\r\n", NKEYS);
+    say(linebuf);
+
+    while (cnt < NKEYS) {
+        if (_read(0, &c, 1) != 1)
+            break;
+
+        if (_ioctl(0, IOCTL_GETRXTIME, &rxtime) != 0) {
+            _msgout("IOCTL_GETRXTIME failed");
+            _exit();
+        }
+
+        _write(0, &c, 1);
+        lat = rdtime() - rxtime;
+
+        if (c == 'q')
+            break;
+
+        if (lat < min)
+            min = lat;
+        if (max < lat)
+            max = lat;
+        sum += lat;
+        cnt++;
+    }
+
+    if (cnt != 0) {
+        snprintf(linebuf, sizeof(linebuf),
+            "echo latency over %d keys, %d loads: min %lu avg %lu max %lu us",
+            cnt, NLOAD, (unsigned long)(min / TICKS_PER_US),
+            (unsigned long)(sum / cnt / TICKS_PER_US),
+            (unsigned long)(max / TICKS_PER_US));
+        _msgout(linebuf);
+    }
+
+    for (i = 0; i < NLOAD; i++)
+        _wait(0);
+}
@@ -0,0 +1,53 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include <stdint.h>
+
+// Measures fork+exec latency. The parent first dirties a large buffer so that
+// fork has a sizable address space to clone, then repeatedly forks a child
+// that immediately execs the "nop" program and waits for it to exit.
+
+#define FOOTPRINT_SIZE (256*1024) // bytes of dirty user memory in the parent
+#define ITERATIONS 8 // fork+exec rounds to time
+
+static char footprint[FOOTPRINT_SIZE];
+
+void main(void) {
+    char linebuf[80];
+    uint64_t start, elapsed, total = 0;
+    int result;
+    int i;
+
+    for (i = 0; i < FOOTPRINT_SIZE; i += 4096)
+        footprint[i] = 1;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        start = rdtime();
+
+        if (_fork() == 0) {
+            result = _fsopen(1, "nop");
+
+            if (result < 0) {
+                _msgout("_fsopen failed");
+                _exit();
+            }
+
+            _exec(1);
+            _msgout("_exec failed");
+            _exit();
+        }
+
+        _wait(0);
+        elapsed = rdtime() - start;
+        total += elapsed;
+
+        snprintf(linebuf, sizeof(linebuf),
+            "fork+exec %d: %lu ticks", i, (unsigned long)elapsed);
+        _msgout(linebuf);
+    }
+
+    snprintf(linebuf, sizeof(linebuf),
+        "fork+exec average: %lu ticks (%d KB parent footprint)",
+        (unsigned long)(total / ITERATIONS), FOOTPRINT_SIZE / 1024);
+    _msgout(linebuf);
+}
@@ -0,0 +1,63 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include <stdint.h>
+
+// Forks NCHILD processes that are all alive at the same time, far more than
+// the 16 the thread and process tables used to hold, then reaps them. Every
+// child sleeps for a while before exiting, so none has exited by the time the
+// last one is forked. Process ids must be unique among the live processes.
+
+#define NCHILD 200 // concurrently live children
+#define CHILD_SLEEP 500000 // microseconds each child sleeps
+
+static int pids[NCHILD];
+
+void main(void) {
+    char linebuf[80];
+    uint64_t start, forked, reaped;
+    int i, j, pid;
+
+    start = rdtime();
+
+    for (i = 0; i < NCHILD; i++) {
+        pid = _fork();
+
+        if (pid == 0) {
+            _usleep(CHILD_SLEEP);
+            _exit();
+        }
+
+        if (pid < 0) {
+            snprintf(linebuf, sizeof(linebuf), "fork %d failed: %d", i, pid);
+            _msgout(linebuf);
+            _exit();
+        }
+
+        for (j = 0; j < i; j++) {
+            if (pids[j] == pid) {
+                _msgout("duplicate process id");
+                _exit();
+            }
+        }
+
+        pids[i] = pid;
+    }
+
+    forked = rdtime();
+
+    for (i = 0; i < NCHILD; i++) {
+        if (_wait(0) < 0) {
+            _msgout("wait failed");
+            _exit();
+        }
+    }
+
+    reaped = rdtime();
+
+    snprintf(linebuf, sizeof(linebuf),
+        "%d live children: fork %lu ticks, reap %lu ticks",
+        NCHILD, (unsigned long)(forked - start),
+        (unsigned long)(reaped - forked));
+    _msgout(linebuf);
+}
@@ -0,0 +1,95 @@
+#include "syscall.h"
+#include "string.h"
+#include "scnum.h"
+#include <stdint.h>
+
+// Checks that processes using floating point do not see each other's FP
+// registers. The parent computes NCHILD results with FP running alone, then
+// forks NCHILD children that compute them again while competing for the CPU,
+// so they are switched (and their FP state saved and reloaded) many times in
+// the middle of their loops. Every child must get the parent's result bit for
+// bit. The children also check that they inherit the parent's FP registers.
+
+#define INHERITED 3.25 // value in fs11 at the fork
+
+#define NCHILD 4 // competing FP processes
+#define NITER 2000000 // loop iterations per result
+#define NSLEEP 8 // times each child sleeps in the middle of its loop
+
+static double compute(int i, int nsleep) {
+    double x = 1.0 + i;
+    double y = 0.5 / (i + 1);
+    long n;
+
+    for (n = 0; n < NITER; n++) {
+        x = x * 0.999999 + y;
+        y = y * 1.000001 - x * 1e-9;
+
+        if (nsleep != 0 && n % (NITER / nsleep) == 0)
+            _usleep(1000);
+    }
+
+    return x + y;
+}
+
+// Forks with /val/ in fs11 and stores the value of fs11 right after the fork
+// in *after, in parent and child alike. The fork is a bare ecall so that
+// nothing can touch the register between the two moves.
+
+static int fork_fp(double val, double * after) {
+    register long a0 asm ("a0");
+    register long a7 asm ("a7") = SYSCALL_FORK;
+    double out;
+
+    asm volatile (
+        "fmv.d  fs11, %2\n\t"
+        "ecall\n\t"
+        "fmv.d  %1, fs11"
+        : "=r" (a0), "=&f" (out)
+        : "f" (val), "r" (a7)
+        : "fs11", "a1", "a2", "a3", "a4", "a5", "a6", "memory");
+
+    *after = out;
+    return a0;
+}
+
+static uint64_t bits(double d) {
+    uint64_t u;
+
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+void main(void) {
+    char linebuf[80];
+    uint64_t expected[NCHILD];
+    double inherited;
+    int i, pid;
+
+    for (i = 0; i < NCHILD; i++)
+        expected[i] = bits(compute(i, 0));
+
+    for (i = 0; i < NCHILD; i++) {
+        pid = fork_fp(INHERITED, &inherited);
+
+        if (pid < 0) {
+            _msgout("_fork failed");
+            _exit();
+        }
+
+        if (pid == 0) {
+            if (bits(compute(i, NSLEEP)) != expected[i] ||
+                bits(inherited) != bits(INHERITED))
+                snprintf(linebuf, sizeof(linebuf), "fp child %d: MISMATCH", i);
+            else
+                snprintf(linebuf, sizeof(linebuf), "fp child %d: ok", i);
+            _msgout(linebuf);
+            _exit();
+        }
+    }
+
+    for (i = 0; i < NCHILD; i++)
+        _wait(0);
+
+    _msgout("fp test done");
+}
@@ -1,8 +1,69 @@
 #include "syscall.h"
 #include "string.h"
+#include "clock.h"
 #include <stdint.h>
 #include "io.h"
 
+// After the parent and a child take turns writing the shared file, NWORK
+// processes contend for the file system lock, each writing the start of the
+// file NWRITE times through a file descriptor of its own. Writers hold the
+// lock alone (readers share it), so the time this takes shows what a lock
+// release costs with many waiters (compare kernels built with LOCK_HANDOFF=0
+// and 1).
+
+#define NWORK 8 // contending processes
+#define NWRITE 500 // writes per process
+
+static void lock_bench_worker(void) {
+    static const char buf[4] = "Wrk\n";
+    uint64_t zero = 0;
+    int i;
+
+    if (_fsopen(1, "to_write") < 0) {
+        _msgout("_fsopen failed in worker");
+        _exit();
+    }
+
+    for (i = 0; i < NWRITE; i++) {
+        _ioctl(1, IOCTL_SETPOS, &zero);
+        _write(1, buf, sizeof(buf));
+    }
+
+    _close(1);
+    _exit();
+}
+
+static void lock_bench(void) {
+    char linebuf[80];
+    uint64_t start, elapsed;
+    int i, pid;
+
+    start = rdtime();
+
+    for (i = 0; i < NWORK; i++) {
+        pid = _fork();
+
+        if (pid < 0) {
+            _msgout("_fork failed");
+            _exit();
+        }
+
+        if (pid == 0)
+            lock_bench_worker();
+    }
+
+    for (i = 0; i < NWORK; i++)
+        _wait(0);
+
+    elapsed = rdtime() - start;
+
+    snprintf(linebuf, sizeof(linebuf),
+        "lock bench: %d processes x %d writes in %lu us (%lu ns/write)",
+        NWORK, NWRITE, (unsigned long)(elapsed / TICKS_PER_US),
+        (unsigned long)(elapsed * 100 / (NWORK * NWRITE)));
+    _msgout(linebuf);
+}
+
 void main(void) {
     int result;
     uint64_t position; 
@@ -45,6 +106,8 @@ void main(void) {
         }
 
         _close(0);
+
+        lock_bench();
         _exit();
     } 
 
@@ -0,0 +1,77 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include <stdint.h>
+
+// Puts many processes to sleep at once, for durations from under a
+// millisecond to over a second, so that alarms land both on the kernel's
+// timing wheel and on its overflow list. Each child checks that it never
+// wakes up early and reports its worst lateness if it is over LATE_US.
+
+#define NCHILD 64 // sleeping processes
+#define NSLEEP 16 // sleeps per process
+#define LATE_US 5000 // lateness worth reporting
+
+static void sleeper(int i) {
+    char linebuf[80];
+    uint64_t start, slept, late, worst = 0;
+    unsigned long us;
+    int n;
+
+    for (n = 0; n < NSLEEP; n++) {
+        // Durations spread from 500 us to about 1.3 s
+
+        us = 500 + ((i * 7919UL + n * 104729UL) % 1300) * 1000;
+
+        start = rdtime();
+        _usleep(us);
+        slept = (rdtime() - start) / TICKS_PER_US;
+
+        if (slept < us) {
+            snprintf(linebuf, sizeof(linebuf),
+                "sleeper %d: woke after %lu us of %lu", i,
+                (unsigned long)slept, us);
+            _msgout(linebuf);
+        }
+
+        late = slept - us;
+        if (us <= slept && worst < late)
+            worst = late;
+    }
+
+    if (LATE_US < worst) {
+        snprintf(linebuf, sizeof(linebuf),
+            "sleeper %d: up to %lu us late", i, (unsigned long)worst);
+        _msgout(linebuf);
+    }
+
+    _exit();
+}
+
+void main(void) {
+    char linebuf[80];
+    uint64_t start;
+    int i, pid;
+
+    start = rdtime();
+
+    for (i = 0; i < NCHILD; i++) {
+        pid = _fork();
+
+        if (pid < 0) {
+            _msgout("_fork failed");
+            _exit();
+        }
+
+        if (pid == 0)
+            sleeper(i);
+    }
+
+    for (i = 0; i < NCHILD; i++)
+        _wait(0);
+
+    snprintf(linebuf, sizeof(linebuf),
+        "sleep test: %d processes x %d sleeps in %lu ms", NCHILD, NSLEEP,
+        (unsigned long)((rdtime() - start) / TICKS_PER_US / 1000));
+    _msgout(linebuf);
+}
@@ -0,0 +1,79 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include <stdint.h>
+
+// Parallel scaling benchmark: forks NWORK CPU-bound workers that never enter
+// the kernel while they compute, half of them evaluating fib(FIB_N) the naive
+// recursive way and half running RULE30_GENS generations of the rule 30
+// cellular automaton, and reports how long it takes until all have exited.
+// Run it with SMP=1 and then with more harts (make run-kernel SMP=4): with
+// NWORK workers, the elapsed time should shrink by up to min(NWORK, harts).
+
+#define NWORK 8 // workers
+#define FIB_N 27 // fib argument of a fib worker
+#define RULE30_CELLS 1024 // cells of a rule 30 worker (multiple of 64)
+#define RULE30_GENS 20000 // generations of a rule 30 worker
+
+static uint64_t fib(int n) {
+    return (n < 2) ? n : fib(n-1) + fib(n-2);
+}
+
+// Runs rule 30 on a ring of cells packed 64 to a word: the next state of a
+// cell is left XOR (center OR right).
+
+static uint64_t rule30(void) {
+    static uint64_t cells[RULE30_CELLS/64], next[RULE30_CELLS/64];
+    const int nw = RULE30_CELLS/64;
+    uint64_t left, right, cnt = 0;
+    int g, w;
+
+    cells[nw/2] = 1;
+
+    for (g = 0; g < RULE30_GENS; g++) {
+        for (w = 0; w < nw; w++) {
+            left = (cells[w] << 1) | (cells[(w+nw-1)%nw] >> 63);
+            right = (cells[w] >> 1) | (cells[(w+1)%nw] << 63);
+            next[w] = left ^ (cells[w] | right);
+        }
+        memcpy(cells, next, sizeof(cells));
+        cnt += cells[nw/2] & 1;
+    }
+
+    return cnt;
+}
+
+void main(void) {
+    char linebuf[80];
+    volatile uint64_t sink;
+    uint64_t start, elapsed;
+    int i, pid;
+
+    start = rdtime();
+
+    for (i = 0; i < NWORK; i++) {
+        pid = _fork();
+
+        if (pid < 0) {
+            _msgout("_fork failed");
+            _exit();
+        }
+
+        if (pid == 0) {
+            sink = (i % 2 == 0) ? fib(FIB_N) : rule30();
+            (void)sink;
+            _exit();
+        }
+    }
+
+    for (i = 0; i < NWORK; i++)
+        _wait(0);
+
+    elapsed = rdtime() - start;
+
+    snprintf(linebuf, sizeof(linebuf),
+        "smp bench: %d workers (fib %d, rule30 %dx%d) in %lu us",
+        NWORK, FIB_N, RULE30_CELLS, RULE30_GENS,
+        (unsigned long)(elapsed / TICKS_PER_US));
+    _msgout(linebuf);
+}
@@ -0,0 +1,84 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include "io.h"
+#include <stdint.h>
+
+// Measures read and write syscall throughput with large user buffers. The
+// data file is read into the buffer in calls of a given size and then written
+// back unchanged in calls of the same size, several times over. The kernel
+// moves the data through copy_to_user and copy_from_user, so a call no longer
+// walks the page table for every page of the buffer before the I/O starts.
+// A kernel built with SYSCALL_PREVALIDATE=1 takes that old path, for
+// comparison.
+
+#define DATA_FILE "trek"
+#define MAX_BUFSZ (256 * 1024)
+#define ROUNDS 4 // passes over the file per call size
+
+static char buf[MAX_BUFSZ];
+
+static const size_t callszs[] = { 4096, 16384, 65536, MAX_BUFSZ };
+
+static void rewind(int fd) {
+    uint64_t pos = 0;
+    _ioctl(fd, IOCTL_SETPOS, &pos);
+}
+
+void main(void) {
+    char linebuf[80];
+    uint64_t start, rticks, wticks;
+    uint64_t len;
+    size_t callsz, pos, n;
+    long cnt;
+    int round, i;
+
+    if (_fsopen(0, DATA_FILE) < 0 || _ioctl(0, IOCTL_GETLEN, &len) < 0) {
+        _msgout("_fsopen failed");
+        _exit();
+    }
+
+    if (len > MAX_BUFSZ)
+        len = MAX_BUFSZ;
+
+    // Touch the buffer once so that the first round does not pay for
+    // faulting it in.
+
+    memset(buf, 0, sizeof(buf));
+
+    for (i = 0; i < sizeof(callszs)/sizeof(callszs[0]); i++) {
+        callsz = callszs[i];
+        rticks = 0;
+        wticks = 0;
+
+        for (round = 0; round < ROUNDS; round++) {
+            rewind(0);
+            start = rdtime();
+            for (pos = 0; pos < len; pos += cnt) {
+                n = (len - pos < callsz) ? len - pos : callsz;
+                cnt = _read(0, buf + pos, n);
+                if (cnt <= 0)
+                    break;
+            }
+            rticks += rdtime() - start;
+
+            rewind(0);
+            start = rdtime();
+            for (pos = 0; pos < len; pos += cnt) {
+                n = (len - pos < callsz) ? len - pos : callsz;
+                cnt = _write(0, buf + pos, n);
+                if (cnt <= 0)
+                    break;
+            }
+            wticks += rdtime() - start;
+        }
+
+        snprintf(linebuf, sizeof(linebuf),
+            "%lu-byte calls: read %lu ticks, write %lu ticks for %lu bytes",
+            (unsigned long)callsz, (unsigned long)(rticks / ROUNDS),
+            (unsigned long)(wticks / ROUNDS), (unsigned long)len);
+        _msgout(linebuf);
+    }
+
+    _close(0);
+}
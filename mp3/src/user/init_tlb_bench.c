@@ -0,0 +1,58 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include <stdint.h>
+
+// Measures the cost of TLB misses. The program walks a large array one byte
+// per page, so that every access needs a different translation. The walk
+// covers a megapage-aligned window of a .bss array, so the kernel can back it
+// with 2 MB megapages; build the kernel with USER_MEGAPAGES=0 to compare
+// against 4 kB pages.
+
+#define MEGA_SIZE (2UL*1024*1024)
+#define WALK_SIZE (8UL*1024*1024) // bytes walked per pass
+#define STRIDE 4096 // bytes between accesses, one page
+#define PASSES 32 // number of timed passes over the array
+
+// Aligning the array itself would also align the file offset of the data
+// segment, padding the executable by up to 2 MB, so the walk starts at the
+// first megapage boundary inside the array instead.
+
+static char array[WALK_SIZE + MEGA_SIZE];
+
+void main(void) {
+    char linebuf[80];
+    uint64_t start, elapsed;
+    volatile char * const base = (volatile char *)
+        (((uintptr_t)array + MEGA_SIZE - 1) & ~(MEGA_SIZE - 1));
+    unsigned long sum = 0;
+    unsigned long i;
+    int pass;
+
+    // First touch: page faults map the array
+
+    start = rdtime();
+
+    for (i = 0; i < WALK_SIZE; i += STRIDE)
+        base[i] = 1;
+
+    elapsed = rdtime() - start;
+    snprintf(linebuf, sizeof(linebuf),
+        "first touch: %lu ticks", (unsigned long)elapsed);
+    _msgout(linebuf);
+
+    // Strided walk over mapped memory
+
+    start = rdtime();
+
+    for (pass = 0; pass < PASSES; pass++) {
+        for (i = 0; i < WALK_SIZE; i += STRIDE)
+            sum += base[i];
+    }
+
+    elapsed = rdtime() - start;
+    snprintf(linebuf, sizeof(linebuf),
+        "strided walk: %lu ticks for %d passes over %lu KB (sum %lu)",
+        (unsigned long)elapsed, PASSES, WALK_SIZE / 1024, sum);
+    _msgout(linebuf);
+}
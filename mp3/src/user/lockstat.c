@@ -0,0 +1,55 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include "io.h"
+#include <stdint.h>
+
+// Prints the contention statistics of the kernel's sleep locks, the most
+// contended first. The kernel must be built with LOCK_STATS=1, which provides
+// the "lockstat" device.
+
+#define MAX_LOCKS 64
+
+static struct lock_stat_entry locks[MAX_LOCKS];
+
+void main(void) {
+    struct io_lockstat req;
+    struct lock_stat_entry tmp;
+    char linebuf[100];
+    int i, j;
+
+    if (_devopen(0, "lockstat", 0) < 0) {
+        _msgout("lockstat: no lockstat device (build with LOCK_STATS=1)");
+        _exit();
+    }
+
+    req.cnt = MAX_LOCKS;
+    req.buf = locks;
+
+    if (_ioctl(0, IOCTL_LOCKSTAT, &req) < 0) {
+        _msgout("lockstat: IOCTL_LOCKSTAT failed");
+        _exit();
+    }
+
+    _close(0);
+
+    // Sort by time spent waiting, longest first
+
+    for (i = 1; i < req.cnt; i++) {
+        tmp = locks[i];
+        for (j = i; 0 < j && locks[j-1].wait_ticks < tmp.wait_ticks; j--)
+            locks[j] = locks[j-1];
+        locks[j] = tmp;
+    }
+
+    for (i = 0; i < req.cnt; i++) {
+        snprintf(linebuf, sizeof(linebuf),
+            "%s: %lu acquired, %lu contended, waited %lu us, held up to %lu us",
+            locks[i].name,
+            (unsigned long)locks[i].acquired,
+            (unsigned long)locks[i].contended,
+            (unsigned long)(locks[i].wait_ticks / TICKS_PER_US),
+            (unsigned long)(locks[i].max_hold / TICKS_PER_US));
+        _msgout(linebuf);
+    }
+}
@@ -0,0 +1,24 @@
+// mman.h - Memory mapping flags
+//
+
+#ifndef _MMAN_H_
+#define _MMAN_H_
+
+// Protection of a mapping, the /prot/ argument of mmap. PROT_WRITE implies
+// PROT_READ.
+
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+// Kind of mapping, the /flags/ argument of mmap. Exactly one of MAP_SHARED
+// and MAP_PRIVATE must be given. MAP_SHARED is only supported for read-only
+// file mappings; a private file mapping is copy-on-write.
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10 // map exactly at addr, replacing what is there
+#define MAP_ANONYMOUS   0x20 // zero-filled memory, fd and offset ignored
+
+#endif // _MMAN_H_
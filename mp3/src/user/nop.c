@@ -0,0 +1,7 @@
+#include "syscall.h"
+
+// Does nothing. Used as a minimal exec target by init_fork_bench.
+
+void main(void) {
+    _exit();
+}
@@ -19,4 +19,21 @@ extern int _fork(void);
 extern int _wait(int tid);
 extern int _usleep(unsigned long us);
 
+// _setpriority sets the scheduling priority of the calling process, from 0
+// (highest, the default) to 3 (lowest). A process that keeps using up its time
+// slice drops below this priority until it next blocks. A process can only
+// lower its priority; a child starts at its parent's. Returns 0, or a negative
+// error code if /prio/ is out of range or higher than the current priority.
+
+extern int _setpriority(int prio);
+
+// _brk returns the new program break, or the current one if it could not be
+// moved (pass NULL to query it). _mmap returns the address of the mapping, or
+// a negative error code cast to a pointer; see mman.h for its flags.
+
+extern void * _brk(void * addr);
+extern void * _mmap(void * addr, size_t len, int prot, int flags,
+    int fd, long offset);
+extern int _munmap(void * addr, size_t len);
+
 #endif // _SYSCALL_H_
@@ -1,6 +1,7 @@
 
 #include "syscall.h"
 #include "string.h"
+#include "mman.h"
 
 void main(void) {
     _msgout("Hello, world from gmzOS!");
@@ -9,6 +10,15 @@ void main(void) {
     // reading/writing to an unmapped virtual memory addr in a userspace program
     _msgout("Testing demand paging...");
 
+    // Only addresses in a mapping are faulted in, so reserve the range first.
+    // No page is allocated until it is touched.
+    if ((long)_mmap((void *)0xC0018000, 0x20000, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) < 0)
+    {
+        _msgout("mmap failed");
+        _exit();
+    }
+
     char *unmapped_addr = (char *)0xC0018000; // Example address outside mapped range
     _msgout("Writing to unmapped virtual address...");
     *unmapped_addr = 'A'; // This should trigger a page fault and allocate a new page
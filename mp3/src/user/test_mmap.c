@@ -0,0 +1,103 @@
+#include "syscall.h"
+#include "string.h"
+#include "mman.h"
+#include <stdint.h>
+
+// Exercises the VM area syscalls: grows and shrinks the heap with _brk, maps
+// and unmaps anonymous memory, maps a file privately and shared, and finally
+// touches an address in no area, which must terminate the process instead of
+// mapping a page.
+
+#define HEAP_GROW (64 * 1024)
+#define MAP_LEN (4 * 1024 * 1024)
+#define DATA_FILE "trek"
+
+static char filebuf[4096];
+
+void main(void) {
+    char linebuf[80];
+    char * brk0;
+    char * brk1;
+    char * map;
+    char * priv;
+    char * shr;
+    size_t i;
+
+    brk0 = _brk(NULL);
+    brk1 = _brk(brk0 + HEAP_GROW);
+    snprintf(linebuf, sizeof(linebuf), "brk: %p -> %p", brk0, brk1);
+    _msgout(linebuf);
+
+    if (brk1 != brk0 + HEAP_GROW) {
+        _msgout("brk failed");
+        _exit();
+    }
+
+    memset(brk0, 0x5a, HEAP_GROW);
+    if (_brk(brk0) != brk0) {
+        _msgout("brk shrink failed");
+        _exit();
+    }
+
+    map = _mmap(NULL, MAP_LEN, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((long)map < 0) {
+        _msgout("mmap failed");
+        _exit();
+    }
+
+    snprintf(linebuf, sizeof(linebuf), "mmap: %lu bytes at %p",
+        (unsigned long)MAP_LEN, map);
+    _msgout(linebuf);
+
+    for (i = 0; i < MAP_LEN; i += 4096) {
+        if (map[i] != 0) {
+            _msgout("mmap page not zero-filled");
+            _exit();
+        }
+        map[i] = 1;
+    }
+
+    if (_munmap(map, MAP_LEN) != 0) {
+        _msgout("munmap failed");
+        _exit();
+    }
+
+    // A private writable mapping and a shared read-only mapping of the same
+    // file share the page cache frame until the first store to the private one
+
+    if (_fsopen(0, DATA_FILE) < 0 || _read(0, filebuf, sizeof(filebuf)) < 0) {
+        _msgout("_fsopen failed");
+        _exit();
+    }
+
+    priv = _mmap(NULL, sizeof(filebuf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, 0, 0);
+    shr = _mmap(NULL, sizeof(filebuf), PROT_READ, MAP_SHARED, 0, 0);
+    if ((long)priv < 0 || (long)shr < 0) {
+        _msgout("file mmap failed");
+        _exit();
+    }
+
+    if (memcmp(priv, filebuf, sizeof(filebuf)) != 0 ||
+        memcmp(shr, filebuf, sizeof(filebuf)) != 0)
+    {
+        _msgout("file mapping differs from _read");
+        _exit();
+    }
+
+    priv[0] ^= 0xff;
+    if (shr[0] != filebuf[0]) {
+        _msgout("store to private mapping reached the page cache");
+        _exit();
+    }
+
+    _munmap(priv, sizeof(filebuf));
+    _munmap(shr, sizeof(filebuf));
+    _close(0);
+    _msgout("file mmap ok");
+
+    _msgout("Expected: process terminated by the access below");
+    map[0] = 1;
+    _msgout("You are wrong if you see me");
+}
@@ -0,0 +1,72 @@
+#include "syscall.h"
+#include "string.h"
+#include "clock.h"
+#include "io.h"
+#include <stdint.h>
+
+// Prints the timer interrupts each hart takes per second, first while the
+// system is idle and then while one process spins. In a tickless kernel
+// (TIMER_TICKLESS=1), an idle hart takes no timer interrupts at all, and a
+// busy one takes about one per time slice instead of one per tick.
+
+#define PERIOD 2 // seconds each measurement lasts
+
+static void snapshot(struct io_timerstat * st) {
+    if (_ioctl(0, IOCTL_TIMERSTAT, st) < 0) {
+        _msgout("timerstat: IOCTL_TIMERSTAT failed");
+        _exit();
+    }
+}
+
+static void report(const char * what,
+    const struct io_timerstat * st0, const struct io_timerstat * st1)
+{
+    const uint64_t dt = st1->time - st0->time;
+    char linebuf[100];
+    int h;
+
+    for (h = 0; h < st1->nhart; h++) {
+        snprintf(linebuf, sizeof(linebuf),
+            "%s: hart %d: %lu timer interrupts/s, %lu ticks/s", what, h,
+            (unsigned long)((st1->intr_cnt[h] - st0->intr_cnt[h])
+                * TICKS_PER_SEC / dt),
+            (unsigned long)((st1->tick_cnt[h] - st0->tick_cnt[h])
+                * TICKS_PER_SEC / dt));
+        _msgout(linebuf);
+    }
+}
+
+static void spin(void) {
+    volatile uint64_t x = 0;
+    uint64_t start = rdtime();
+
+    while (rdtime() - start < (PERIOD + 1) * (uint64_t)TICKS_PER_SEC)
+        x += 1;
+
+    _exit();
+}
+
+void main(void) {
+    struct io_timerstat st0, st1;
+
+    if (_devopen(0, "timerstat", 0) < 0) {
+        _msgout("timerstat: no timerstat device");
+        _exit();
+    }
+
+    snapshot(&st0);
+    _usleep(PERIOD * 1000000UL);
+    snapshot(&st1);
+    report("idle", &st0, &st1);
+
+    if (_fork() == 0)
+        spin();
+
+    snapshot(&st0);
+    _usleep(PERIOD * 1000000UL);
+    snapshot(&st1);
+    report("one busy", &st0, &st1);
+
+    _wait(0);
+    _close(0);
+}